@@ -0,0 +1,352 @@
+/*
+ * Benchmarks for part05: sequential insert, random point lookup, full scan,
+ * db_open on a large file and the flush in db_close. Every case reports
+ * ops/sec, p50/p99 latency and the bytes it read and wrote, and --json
+ * writes the same figures to a file, so that runs can be compared between
+ * releases. Runs are repeatable: the db is created from scratch and the
+ * random ids come from a fixed seed.
+ *
+ *   bench [--rows N] [--lookups N] [--repeat N] [--seed N] [--dir DIR]
+ *         [--sync on] [--json FILE] [pager options of part05]
+ */
+#define main part05_main
+#include "part05.cpp"
+#undef main
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+typedef struct {
+    uint64_t rows;
+    uint64_t lookups;
+    uint32_t repeat;
+    uint32_t seed;
+    std::string dir;
+    std::string json_filename;
+    PagerOptions pager;
+} BenchOptions;
+
+typedef struct {
+    std::string name;
+    uint64_t ops;
+    double seconds;
+    std::vector<double> latencies; // seconds, one per timed unit of work
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+} BenchResult;
+
+typedef struct {
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+} IoCounters;
+
+/*
+ * Bytes the engine has read from and written to the db file and the log so
+ * far, from its own STAT_BYTES_READ and STAT_BYTES_WRITTEN counters. Unlike
+ * /proc/self/io these count every I/O backend, pages read through the
+ * mapping with --mmap, and none of the bench's own file access.
+ */
+IoCounters io_counters() {
+    StatsSnapshot snapshot;
+    stats_collect(&snapshot);
+    IoCounters counters;
+    counters.read_bytes = snapshot.counters[STAT_BYTES_READ];
+    counters.write_bytes = snapshot.counters[STAT_BYTES_WRITTEN];
+    return counters;
+}
+
+double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+typedef struct {
+    double started;
+    IoCounters io;
+} BenchTimer;
+
+BenchTimer bench_start() {
+    BenchTimer timer;
+    timer.io = io_counters();
+    timer.started = now();
+    return timer;
+}
+
+void bench_stop(const BenchTimer *timer, BenchResult *result) {
+    result->seconds = now() - timer->started;
+    IoCounters io = io_counters();
+    result->read_bytes = io.read_bytes - timer->io.read_bytes;
+    result->write_bytes = io.write_bytes - timer->io.write_bytes;
+}
+
+// Add one timed run to the totals of a case that only times part of each run.
+void bench_add(BenchResult *result, const BenchResult *run) {
+    result->latencies.push_back(run->seconds);
+    result->seconds += run->seconds;
+    result->read_bytes += run->read_bytes;
+    result->write_bytes += run->write_bytes;
+}
+
+double percentile(std::vector<double> latencies, double fraction) {
+    if (latencies.empty())
+        return 0;
+    std::sort(latencies.begin(), latencies.end());
+    size_t index = static_cast<size_t>(fraction * (latencies.size() - 1) + 0.5);
+    return latencies[index];
+}
+
+void make_row(uint32_t id, Row *row) {
+    row->id = id;
+    std::snprintf(row->username, sizeof(row->username), "user%u", id);
+    std::snprintf(row->email, sizeof(row->email), "person%u@example.com", id);
+}
+
+void remove_db(const std::string &filename) {
+    unlink(filename.c_str());
+    unlink((filename + "-wal").c_str());
+}
+
+// One insert statement per row, in id order, each committed on its own.
+BenchResult bench_sequential_insert(const BenchOptions *options, const std::string &filename) {
+    BenchResult result;
+    result.name = "sequential_insert";
+    result.ops = options->rows;
+    remove_db(filename);
+    Table *table = db_open(filename.c_str(), &(options->pager));
+
+    BenchTimer timer = bench_start();
+    Row row;
+    for (uint64_t i = 0; i < options->rows; i++) {
+        make_row(i, &row);
+        double started = now();
+        if (table_insert(table, &row) != EXECUTE_SUCCESS) {
+            std::cout << "sequential_insert failed on row " << i << "\n";
+            exit(EXIT_FAILURE);
+        }
+        pager_commit(table->pager);
+        result.latencies.push_back(now() - started);
+    }
+    bench_stop(&timer, &result);
+
+    db_close(table);
+    return result;
+}
+
+BenchResult bench_random_lookup(const BenchOptions *options, const std::string &filename) {
+    BenchResult result;
+    result.name = "random_lookup";
+    result.ops = options->lookups;
+    Table *table = db_open(filename.c_str(), &(options->pager));
+    std::mt19937 random(options->seed);
+    std::uniform_int_distribution<uint32_t> ids(0, options->rows - 1);
+
+    Predicate where;
+    where.column = PREDICATE_ID;
+    where.op = COMPARE_EQ;
+    where.id_high = UINT32_MAX;
+    uint64_t found = 0;
+    BenchTimer timer = bench_start();
+    for (uint64_t i = 0; i < options->lookups; i++) {
+        where.id = ids(random);
+        double started = now();
+        scan_table(table, nullptr, &where, ACCESS_ID_LOOKUP, nullptr, count_row_callback, &found);
+        result.latencies.push_back(now() - started);
+    }
+    bench_stop(&timer, &result);
+
+    if (found != options->lookups) {
+        std::cout << "random_lookup found " << found << " of " << options->lookups << " rows\n";
+        exit(EXIT_FAILURE);
+    }
+    db_close(table);
+    return result;
+}
+
+// Rows read per second over repeated scans of the whole table, latency per scan.
+BenchResult bench_full_scan(const BenchOptions *options, const std::string &filename) {
+    BenchResult result;
+    result.name = "full_scan";
+    result.ops = options->rows * options->repeat;
+    Table *table = db_open(filename.c_str(), &(options->pager));
+
+    Predicate where;
+    where.column = PREDICATE_NONE;
+    BenchTimer timer = bench_start();
+    for (uint32_t i = 0; i < options->repeat; i++) {
+        uint64_t rows = 0;
+        double started = now();
+        parallel_scan(table, nullptr, &where, false, count_row_callback, &rows);
+        result.latencies.push_back(now() - started);
+        if (rows != options->rows) {
+            std::cout << "full_scan read " << rows << " of " << options->rows << " rows\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+    bench_stop(&timer, &result);
+
+    db_close(table);
+    return result;
+}
+
+BenchResult bench_db_open(const BenchOptions *options, const std::string &filename) {
+    BenchResult result;
+    result.name = "db_open";
+    result.ops = options->repeat;
+
+    result.seconds = 0;
+    result.read_bytes = 0;
+    result.write_bytes = 0;
+    for (uint32_t i = 0; i < options->repeat; i++) {
+        BenchResult open;
+        BenchTimer timer = bench_start();
+        Table *table = db_open(filename.c_str(), &(options->pager));
+        bench_stop(&timer, &open);
+        db_close(table);
+        bench_add(&result, &open);
+    }
+    return result;
+}
+
+// The checkpoint in db_close, after a batch of scattered updates left dirty pages behind.
+BenchResult bench_db_close(const BenchOptions *options, const std::string &filename) {
+    BenchResult result;
+    result.name = "db_close";
+    result.ops = options->repeat;
+    std::mt19937 random(options->seed + 1);
+    std::uniform_int_distribution<uint32_t> ids(0, options->rows - 1);
+
+    result.seconds = 0;
+    result.read_bytes = 0;
+    result.write_bytes = 0;
+    for (uint32_t i = 0; i < options->repeat; i++) {
+        Table *table = db_open(filename.c_str(), &(options->pager));
+        // ids are unique, so rewrite existing rows rather than insert them again
+        Statement statement;
+        prepare_modify(&statement, STATEMENT_UPDATE);
+        statement.set_email = true;
+        statement.where.column = PREDICATE_ID;
+        statement.where.op = COMPARE_EQ;
+        statement.access_path = plan_select(&(statement.where));
+        for (uint32_t j = 0; j < 1000; j++) {
+            statement.where.id = ids(random);
+            std::snprintf(statement.row_to_insert.email, sizeof(statement.row_to_insert.email),
+                          "person%u.%u@example.com", statement.where.id, i);
+            if (execute_statement(&statement, table) != EXECUTE_SUCCESS) {
+                std::cout << "db_close failed to update row " << statement.where.id << "\n";
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        BenchResult close;
+        BenchTimer timer = bench_start();
+        db_close(table);
+        bench_stop(&timer, &close);
+        bench_add(&result, &close);
+    }
+    return result;
+}
+
+void print_result(const BenchResult *result) {
+    std::printf("%-18s %12llu %14.0f %12.2f %12.2f %14llu %14llu\n", result->name.c_str(),
+                static_cast<unsigned long long>(result->ops), result->ops / result->seconds,
+                percentile(result->latencies, 0.50) * 1e6, percentile(result->latencies, 0.99) * 1e6,
+                static_cast<unsigned long long>(result->read_bytes),
+                static_cast<unsigned long long>(result->write_bytes));
+}
+
+void write_json(const BenchOptions *options, const std::vector<BenchResult> &results) {
+    FILE *file = std::fopen(options->json_filename.c_str(), "w");
+    if (file == nullptr) {
+        printf("Unable to write %s: %d\n", options->json_filename.c_str(), errno);
+        exit(EXIT_FAILURE);
+    }
+    std::fprintf(file, "{\"rows\": %llu, \"lookups\": %llu, \"repeat\": %u, \"seed\": %u, \"results\": [\n",
+                 static_cast<unsigned long long>(options->rows), static_cast<unsigned long long>(options->lookups),
+                 options->repeat, options->seed);
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult *result = &results[i];
+        std::fprintf(file,
+                     "  {\"name\": \"%s\", \"ops\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+                     "\"p50_us\": %.3f, \"p99_us\": %.3f, \"read_bytes\": %llu, \"write_bytes\": %llu}%s\n",
+                     result->name.c_str(), static_cast<unsigned long long>(result->ops), result->seconds,
+                     result->ops / result->seconds, percentile(result->latencies, 0.50) * 1e6,
+                     percentile(result->latencies, 0.99) * 1e6,
+                     static_cast<unsigned long long>(result->read_bytes),
+                     static_cast<unsigned long long>(result->write_bytes), i + 1 < results.size() ? "," : "");
+    }
+    std::fprintf(file, "]}\n");
+    std::fclose(file);
+}
+
+int main(int argc, char *argv[]) {
+    BenchOptions options;
+    options.rows = 100000;
+    options.lookups = 100000;
+    options.repeat = 10;
+    options.seed = 1;
+    options.dir = ".";
+    options.pager.num_frames = DEFAULT_BUFFER_POOL_FRAMES;
+    // a synced commit per insert would measure the disk and nothing else
+    options.pager.synchronous = false;
+    options.pager.use_mmap = false;
+    options.pager.leaf_layout = LEAF_LAYOUT_SLOTTED;
+    options.pager.page_codec = PAGE_CODEC_NONE;
+    options.pager.io_backend = IO_BACKEND_PREAD;
+    options.pager.readahead_pages = DEFAULT_READAHEAD_PAGES;
+    options.pager.snapshots = false;
+    options.pager.scan_threads = 0;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+            options.rows = std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--lookups") == 0 && i + 1 < argc) {
+            options.lookups = std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            options.repeat = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            options.seed = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            options.dir = argv[++i];
+        } else if (std::strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            options.json_filename = argv[++i];
+        } else if (std::strcmp(argv[i], "--sync") == 0 && i + 1 < argc) {
+            options.pager.synchronous = std::strcmp(argv[++i], "off") != 0;
+        } else if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            options.pager.num_frames = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--mmap") == 0) {
+            options.pager.use_mmap = true;
+        } else if (std::strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+            options.pager.io_backend = std::strcmp(argv[++i], "uring") == 0 ? IO_BACKEND_URING : IO_BACKEND_PREAD;
+        } else if (std::strcmp(argv[i], "--readahead") == 0 && i + 1 < argc) {
+            options.pager.readahead_pages = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options.pager.scan_threads = std::atoi(argv[++i]);
+        } else {
+            std::cout << "Unknown option " << argv[i] << "\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (options.rows == 0 || options.repeat == 0) {
+        std::cout << "--rows and --repeat must be positive.\n";
+        exit(EXIT_FAILURE);
+    }
+
+    std::string filename = options.dir + "/bench.db";
+    std::vector<BenchResult> results;
+    std::printf("%-18s %12s %14s %12s %12s %14s %14s\n", "case", "ops", "ops/sec", "p50 us", "p99 us",
+                "read bytes", "write bytes");
+    results.push_back(bench_sequential_insert(&options, filename));
+    print_result(&results.back());
+    results.push_back(bench_random_lookup(&options, filename));
+    print_result(&results.back());
+    results.push_back(bench_full_scan(&options, filename));
+    print_result(&results.back());
+    results.push_back(bench_db_open(&options, filename));
+    print_result(&results.back());
+    results.push_back(bench_db_close(&options, filename));
+    print_result(&results.back());
+    remove_db(filename);
+
+    if (!options.json_filename.empty())
+        write_json(&options, results);
+    return 0;
+}
@@ -1,9 +1,31 @@
 #include <iostream>
 #include <cstring>
+#include <cctype>
 #include <memory>
 #include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
 
 
 #define COLUMN_USERNAME_SIZE 32
@@ -15,6 +37,56 @@ typedef struct {
     char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
 
+/*
+ * Tables made by create table. Row above is the record of the built-in
+ * users table; the others describe theirs with a Schema, kept in the
+ * catalog on the header page.
+ */
+#define TABLE_NAME_SIZE 31
+#define MAX_TABLE_COLUMNS 16
+#define COLUMN_TEXT_MAX_SIZE 255
+
+// int is 64 bit and signed, text(N) takes up to N bytes, char(N) always N
+typedef enum { COLUMN_INT, COLUMN_TEXT, COLUMN_CHAR } ColumnType;
+
+typedef struct {
+    char name[TABLE_NAME_SIZE + 1];
+    ColumnType type;
+    uint32_t size;   // 8 for int, N for text(N) and char(N)
+    uint32_t offset; // where a fixed width record keeps the column
+} Column;
+
+// One column of a record. text points into the record, not null terminated.
+typedef struct {
+    int64_t number;
+    const char *text;
+    uint32_t length;
+} Value;
+
+// One copy between a fixed width record and a Value, see schema_prepare().
+typedef struct {
+    uint32_t column; // index into the values
+    uint32_t offset; // where the record keeps it
+    uint32_t size;
+} FieldCopy;
+
+typedef struct Schema {
+    char name[TABLE_NAME_SIZE + 1];
+    uint32_t num_columns;
+    Column columns[MAX_TABLE_COLUMNS]; // the first is an int, the key of the table
+    uint32_t fixed_size; // the size of every record, 0 when a text column makes it vary
+    uint32_t max_size;   // the size of the longest record
+    // the copies a fixed width record takes, ints and chars apart so that
+    // neither codec looks at a column's type
+    FieldCopy int_copies[MAX_TABLE_COLUMNS];
+    uint32_t num_int_copies;
+    FieldCopy char_copies[MAX_TABLE_COLUMNS];
+    uint32_t num_char_copies;
+    // encode returns the length of the record, see schema_prepare()
+    uint32_t (*encode)(const struct Schema *schema, const Value *values, char *record);
+    void (*decode)(const struct Schema *schema, const char *record, Value *values);
+} Schema;
+
 
 typedef struct {
     char *buffer;
@@ -23,213 +95,6611 @@ typedef struct {
 } InputBuffer;
 
 
-typedef enum { META_COMMAND_SUCCESS, META_COMMAND_UNRECOGNIZED_COMMAND } MetaCommandResult;
+typedef enum { META_COMMAND_SUCCESS, META_COMMAND_UNRECOGNIZED_COMMAND } MetaCommandResult;
+
+typedef enum { PREPARE_SUCCESS, PREPARE_SYNTAX_ERROR, PREPARE_STRING_TOO_LONG, PREPARE_NEGATIVE_ID, PREPARE_ROW_TOO_LONG, PREPARE_NO_SUCH_STATEMENT, PREPARE_UNRECOGNIZED_STATEMENT } PrepareResult;
+
+typedef enum {
+    STATEMENT_INSERT,
+    STATEMENT_SELECT,
+    STATEMENT_BEGIN,
+    STATEMENT_COMMIT,
+    STATEMENT_CREATE_INDEX,
+    STATEMENT_UPDATE,
+    STATEMENT_DELETE,
+    STATEMENT_CREATE_TABLE
+} StatementType;
+
+typedef enum {
+    EXECUTE_SUCCESS,
+    EXECUTE_TABLE_FULL,
+    EXECUTE_TRANSACTION_FULL,
+    EXECUTE_INDEX_EXISTS,
+    EXECUTE_DUPLICATE_KEY,
+    EXECUTE_TABLE_EXISTS,
+    EXECUTE_NO_SUCH_TABLE,
+    EXECUTE_CATALOG_FULL,
+    EXECUTE_BAD_VALUES,
+    EXECUTE_WHERE_NOT_KEY
+} ExecuteResult;
+
+typedef enum { IMPORT_CSV, IMPORT_BINARY } ImportFormat;
+
+typedef enum {
+    IMPORT_SUCCESS,
+    IMPORT_FILE_ERROR,
+    IMPORT_SYNTAX_ERROR,
+    IMPORT_STRING_TOO_LONG,
+    IMPORT_NEGATIVE_ID,
+    IMPORT_TABLE_FULL,
+    IMPORT_DUPLICATE_KEY
+} ImportResult;
+
+typedef enum { COMPARE_EQ, COMPARE_NE, COMPARE_LT, COMPARE_LE, COMPARE_GT, COMPARE_GE } CompareOp;
+
+typedef enum { PREDICATE_NONE, PREDICATE_ID, PREDICATE_USERNAME, PREDICATE_EMAIL } PredicateColumn;
+
+// how a select reaches its rows, decided once when it is prepared; an index
+// lookup turns into a full scan while the column has no index
+typedef enum { ACCESS_FULL_SCAN, ACCESS_RANGE_SCAN, ACCESS_ID_LOOKUP, ACCESS_INDEX_LOOKUP } AccessPath;
+
+// columns that can have a secondary index, see table_create_index()
+typedef enum { INDEX_USERNAME, INDEX_EMAIL, INDEX_COLUMNS } IndexColumn;
+
+// what a ? placeholder of a prepared statement stands for
+typedef enum {
+    PARAMETER_INSERT_ID,
+    PARAMETER_INSERT_USERNAME,
+    PARAMETER_INSERT_EMAIL,
+    PARAMETER_WHERE_ID,
+    PARAMETER_WHERE_ID_HIGH,
+    PARAMETER_WHERE_USERNAME,
+    PARAMETER_WHERE_EMAIL
+} ParameterSlot;
+
+#define MAX_STATEMENT_PARAMETERS 3
+
+// select where <column> <op> <value>
+typedef struct {
+    PredicateColumn column;
+    CompareOp op;            // always COMPARE_EQ for username and email
+    uint32_t id;
+    uint32_t id_high;        // ids above it never match, UINT32_MAX but for between
+    char text[COLUMN_EMAIL_SIZE + 1]; // the username or email
+    uint32_t text_length;
+} Predicate;
+
+#define SELECT_NO_LIMIT UINT32_MAX
+
+// select count(*)|min(id)|max(id)|sum(id), or rows for AGGREGATE_NONE
+typedef enum { AGGREGATE_NONE, AGGREGATE_COUNT, AGGREGATE_MIN, AGGREGATE_MAX, AGGREGATE_SUM } Aggregate;
+
+// order by id [asc|desc] limit N
+typedef struct {
+    bool descending;
+    uint32_t limit;
+} SelectOrder;
+
+typedef struct {
+    StatementType type;
+    Row row_to_insert;
+    std::vector<Row> rows; // insert values (...), ..., row_to_insert is unused then
+    Predicate where;
+    SelectOrder order;
+    Aggregate aggregate;
+    AccessPath access_path;
+    IndexColumn index_column; // create index on <column>
+    // update set <column> = <value>: the columns to change, and their new values in row_to_insert
+    bool set_username;
+    bool set_email;
+    // insert into, select from and create table name a table of the
+    // catalog here, which stays empty for the users table
+    std::string table;
+    std::vector<Column> columns;                   // create table
+    std::vector<std::vector<std::string>> records; // insert into: the fields of every row
+    std::string where_column; // select from: the column of the where clause, its id stands for it
+} Statement;
+
+/*
+ * A statement parsed once, with ? in place of some of its values, to be
+ * run any number of times with values bound to the placeholders.
+ */
+typedef struct {
+    uint32_t handle;
+    Statement statement; // the bound values are stored straight into it
+    uint32_t num_parameters;
+    ParameterSlot parameters[MAX_STATEMENT_PARAMETERS];
+} PreparedStatement;
+
+// Prepared statements by their text, and by handle for execute.
+typedef struct {
+    std::unordered_map<std::string, PreparedStatement *> by_text;
+    std::vector<PreparedStatement *> by_handle;
+} StatementCache;
+
+
+#define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
+
+const uint32_t ID_SIZE = size_of_attribute(Row, id);
+const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
+const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
+const uint32_t ID_OFFSET = 0;
+const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
+const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
+const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
+
+
+void serialize_row(Row *row, void *destination) {
+    std::memcpy(static_cast<char *>(destination) + ID_OFFSET, &(row->id), ID_SIZE);
+    std::memcpy(static_cast<char *>(destination) + USERNAME_OFFSET, &(row->username), USERNAME_SIZE);
+    std::memcpy(static_cast<char *>(destination) + EMAIL_OFFSET, &(row->email), EMAIL_SIZE);
+}
+
+void deserialize_row(void *source, Row *destination) {
+    std::memcpy(&(destination->id), static_cast<char *>(source) + ID_OFFSET, ID_SIZE);
+    std::memcpy(&(destination->username), static_cast<char *>(source) + USERNAME_OFFSET, USERNAME_SIZE);
+    std::memcpy(&(destination->email), static_cast<char *>(source) + EMAIL_OFFSET, EMAIL_SIZE);
+}
+
+// A row read in place. The strings point into the serialized row, are not
+// necessarily null terminated, and are only valid for as long as the page
+// holding them stays pinned.
+typedef struct {
+    uint32_t id;
+    const char *username;
+    uint32_t username_length;
+    const char *email;
+    uint32_t email_length;
+} RowView;
+
+RowView view_row(const void *source) {
+    RowView view;
+    std::memcpy(&(view.id), static_cast<const char *>(source) + ID_OFFSET, ID_SIZE);
+    view.username = static_cast<const char *>(source) + USERNAME_OFFSET;
+    view.username_length = strnlen(view.username, COLUMN_USERNAME_SIZE);
+    view.email = static_cast<const char *>(source) + EMAIL_OFFSET;
+    view.email_length = strnlen(view.email, COLUMN_EMAIL_SIZE);
+    return view;
+}
+
+/*
+ * Records of a created table. In a fixed width schema, one without text
+ * columns, each column sits at an offset worked out once by
+ * schema_prepare(): an int as 8 bytes, a char(N) as N bytes padded with
+ * zeros. schema_prepare() also turns the columns into two lists of copies,
+ * one for the ints and one for the chars, so the fixed codec is just those
+ * memcpys with no type dispatch. A text(N) column is a length byte and its
+ * bytes instead, which moves the columns after it, so such records are
+ * walked column by column.
+ */
+uint32_t record_encode_fixed(const Schema *schema, const Value *values, char *record) {
+    std::memset(record, 0, schema->fixed_size);
+    for (uint32_t i = 0; i < schema->num_int_copies; i++) {
+        const FieldCopy *copy = &(schema->int_copies[i]);
+        std::memcpy(record + copy->offset, &(values[copy->column].number), sizeof(int64_t));
+    }
+    for (uint32_t i = 0; i < schema->num_char_copies; i++) {
+        const FieldCopy *copy = &(schema->char_copies[i]);
+        std::memcpy(record + copy->offset, values[copy->column].text, values[copy->column].length);
+    }
+    return schema->fixed_size;
+}
+
+void record_decode_fixed(const Schema *schema, const char *record, Value *values) {
+    for (uint32_t i = 0; i < schema->num_int_copies; i++) {
+        const FieldCopy *copy = &(schema->int_copies[i]);
+        std::memcpy(&(values[copy->column].number), record + copy->offset, sizeof(int64_t));
+    }
+    for (uint32_t i = 0; i < schema->num_char_copies; i++) {
+        const FieldCopy *copy = &(schema->char_copies[i]);
+        values[copy->column].text = record + copy->offset;
+        values[copy->column].length = strnlen(record + copy->offset, copy->size);
+    }
+}
+
+uint32_t record_encode_variable(const Schema *schema, const Value *values, char *record) {
+    char *position = record;
+    for (uint32_t i = 0; i < schema->num_columns; i++) {
+        const Column *column = &(schema->columns[i]);
+        switch (column->type) {
+            case COLUMN_INT:
+                std::memcpy(position, &(values[i].number), sizeof(int64_t));
+                position += sizeof(int64_t);
+                break;
+            case COLUMN_TEXT:
+                *position++ = static_cast<char>(values[i].length);
+                std::memcpy(position, values[i].text, values[i].length);
+                position += values[i].length;
+                break;
+            case COLUMN_CHAR:
+                std::memset(position, 0, column->size);
+                std::memcpy(position, values[i].text, values[i].length);
+                position += column->size;
+                break;
+        }
+    }
+    return position - record;
+}
+
+void record_decode_variable(const Schema *schema, const char *record, Value *values) {
+    const char *position = record;
+    for (uint32_t i = 0; i < schema->num_columns; i++) {
+        const Column *column = &(schema->columns[i]);
+        switch (column->type) {
+            case COLUMN_INT:
+                std::memcpy(&(values[i].number), position, sizeof(int64_t));
+                position += sizeof(int64_t);
+                break;
+            case COLUMN_TEXT:
+                values[i].length = static_cast<uint8_t>(*position++);
+                values[i].text = position;
+                position += values[i].length;
+                break;
+            case COLUMN_CHAR:
+                values[i].text = position;
+                values[i].length = strnlen(position, column->size);
+                position += column->size;
+                break;
+        }
+    }
+}
+
+// Work out where the columns of schema go, and pick the codec for its records.
+void schema_prepare(Schema *schema) {
+    uint32_t offset = 0;
+    bool fixed = true;
+    schema->num_int_copies = 0;
+    schema->num_char_copies = 0;
+    for (uint32_t i = 0; i < schema->num_columns; i++) {
+        Column *column = &(schema->columns[i]);
+        column->offset = offset;
+        offset += column->size + (column->type == COLUMN_TEXT ? 1 : 0);
+        fixed = fixed && column->type != COLUMN_TEXT;
+        FieldCopy copy = {i, column->offset, column->size};
+        if (column->type == COLUMN_INT)
+            schema->int_copies[schema->num_int_copies++] = copy;
+        else if (column->type == COLUMN_CHAR)
+            schema->char_copies[schema->num_char_copies++] = copy;
+    }
+    schema->max_size = offset;
+    schema->fixed_size = fixed ? offset : 0;
+    schema->encode = fixed ? record_encode_fixed : record_encode_variable;
+    schema->decode = fixed ? record_decode_fixed : record_decode_variable;
+}
+
+
+const uint32_t PAGE_SIZE = 4096;
+// resident set of the buffer pool, 4 MB unless overridden with --frames
+#define DEFAULT_BUFFER_POOL_FRAMES 1024
+// a split cascade pins a handful of pages at once, leave room for that
+#define MIN_BUFFER_POOL_FRAMES 8
+// longest run of adjacent dirty pages written with a single pwritev
+#define FLUSH_MAX_RUN 128
+// address space set aside up front with --mmap, so the mapping can grow in
+// place and page pointers handed out earlier stay valid
+#define MMAP_RESERVE_BYTES (1ULL << 40)
+// leaves a scan asks for ahead of the one it is reading, --readahead N
+#define DEFAULT_READAHEAD_PAGES 8
+#define MAX_READAHEAD_PAGES 64
+// leaves a parallel scan hands to a worker at a time
+#define SCAN_MORSEL_LEAVES 16
+#define MAX_SCAN_THREADS 64
+// bytes .import reads from its file at a time
+#define IMPORT_BLOCK_SIZE (1 << 20)
+// submission queue size of the io_uring backend
+#define URING_ENTRIES 128
+
+const uint32_t INVALID_PAGE_NUM = UINT32_MAX;
+
+typedef struct {
+    uint32_t page_num;  // INVALID_PAGE_NUM while the frame is unused
+    void *data;         // buffer, or the page inside the file mapping
+    char *buffer;       // memory owned by the frame
+    bool mapped;        // data points into the mapping, read only
+    uint32_t pin_count;
+    bool dirty;
+    bool referenced;    // second-chance bit for the CLOCK sweep
+    bool in_write_set;  // changed by the running statement, not logged yet
+    bool image_saved;   // its image from before the open statement is in statement_images
+    uint64_t page_lsn;  // commit record of the last logged change
+    bool io_pending;    // a read into buffer has not completed yet
+} Frame;
+
+// page number -> frame number, open addressing with linear probing
+typedef struct {
+    uint32_t page_num;
+    uint32_t frame_num;
+} PageTableEntry;
+
+/*
+ * Counters and statement latency histograms, kept per thread so that
+ * counting is a plain store to memory no other thread writes. They are
+ * relaxed atomics only so that .stats can read them from another thread;
+ * a thread's stats are registered on first use and live as long as the
+ * process, so the counts of threads that have exited are not lost.
+ */
+typedef enum {
+    STAT_PAGE_HITS,
+    STAT_PAGE_MISSES,
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    STAT_SYSCALLS,
+    STAT_ROWS_SCANNED,
+    STAT_ROWS_RETURNED,
+    STAT_STATEMENTS,
+    STAT_COUNTERS
+} StatCounter;
+
+typedef enum { PHASE_PREPARE, PHASE_EXECUTE, PHASE_COMMIT, STAT_PHASES } StatementPhase;
+
+// bucket i counts the statement phases that took [2^(i-1), 2^i) ns
+#define HISTOGRAM_BUCKETS 40
+
+typedef struct {
+    std::atomic<uint64_t> counters[STAT_COUNTERS];
+    std::atomic<uint64_t> phase_ns[STAT_PHASES];
+    std::atomic<uint64_t> histograms[STAT_PHASES][HISTOGRAM_BUCKETS];
+} ThreadStats;
+
+// The sum over every thread, see stats_collect().
+typedef struct {
+    uint64_t counters[STAT_COUNTERS];
+    uint64_t phase_ns[STAT_PHASES];
+    uint64_t histograms[STAT_PHASES][HISTOGRAM_BUCKETS];
+    uint32_t threads;
+} StatsSnapshot;
+
+std::mutex stats_registry_lock;
+std::vector<ThreadStats *> stats_registry;
+thread_local ThreadStats *thread_stats = nullptr;
+
+ThreadStats *stats_register_thread() {
+    ThreadStats *stats = new ThreadStats();
+    for (uint32_t i = 0; i < STAT_COUNTERS; i++)
+        stats->counters[i].store(0, std::memory_order_relaxed);
+    for (uint32_t phase = 0; phase < STAT_PHASES; phase++) {
+        stats->phase_ns[phase].store(0, std::memory_order_relaxed);
+        for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+            stats->histograms[phase][i].store(0, std::memory_order_relaxed);
+    }
+    std::lock_guard<std::mutex> guard(stats_registry_lock);
+    stats_registry.push_back(stats);
+    return stats;
+}
+
+// Only the owning thread writes, so a load and a store make an increment.
+inline void stats_bump(std::atomic<uint64_t> *value, uint64_t amount) {
+    value->store(value->load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+inline void stats_add(StatCounter counter, uint64_t amount) {
+    if (thread_stats == nullptr)
+        thread_stats = stats_register_thread();
+    stats_bump(&(thread_stats->counters[counter]), amount);
+}
+
+inline uint64_t stats_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void stats_record_phase(StatementPhase phase, uint64_t started_ns) {
+    if (thread_stats == nullptr)
+        thread_stats = stats_register_thread();
+    uint64_t elapsed = stats_now_ns() - started_ns;
+    uint32_t bucket = elapsed == 0 ? 0 : 64 - __builtin_clzll(elapsed);
+    stats_bump(&(thread_stats->phase_ns[phase]), elapsed);
+    stats_bump(&(thread_stats->histograms[phase][std::min(bucket, static_cast<uint32_t>(HISTOGRAM_BUCKETS - 1))]), 1);
+}
+
+void stats_collect(StatsSnapshot *snapshot) {
+    std::memset(snapshot, 0, sizeof(*snapshot));
+    std::lock_guard<std::mutex> guard(stats_registry_lock);
+    for (ThreadStats *stats : stats_registry) {
+        for (uint32_t i = 0; i < STAT_COUNTERS; i++)
+            snapshot->counters[i] += stats->counters[i].load(std::memory_order_relaxed);
+        for (uint32_t phase = 0; phase < STAT_PHASES; phase++) {
+            snapshot->phase_ns[phase] += stats->phase_ns[phase].load(std::memory_order_relaxed);
+            for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+                snapshot->histograms[phase][i] += stats->histograms[phase][i].load(std::memory_order_relaxed);
+        }
+    }
+    snapshot->threads = stats_registry.size();
+}
+
+// A count a thread bumps while this runs may survive the reset.
+void stats_reset() {
+    std::lock_guard<std::mutex> guard(stats_registry_lock);
+    for (ThreadStats *stats : stats_registry) {
+        for (uint32_t i = 0; i < STAT_COUNTERS; i++)
+            stats->counters[i].store(0, std::memory_order_relaxed);
+        for (uint32_t phase = 0; phase < STAT_PHASES; phase++) {
+            stats->phase_ns[phase].store(0, std::memory_order_relaxed);
+            for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+                stats->histograms[phase][i].store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+// An upper bound on the given quantile of a phase, in ns, from its histogram.
+uint64_t stats_phase_quantile(const StatsSnapshot *snapshot, StatementPhase phase, double quantile) {
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        total += snapshot->histograms[phase][i];
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += snapshot->histograms[phase][i];
+        if (seen > 0 && seen >= quantile * total)
+            return 1ULL << i;
+    }
+    return 0;
+}
+
+/*
+ * Write-ahead log, kept next to the db file as <db>-wal. Each statement
+ * appends the image of every page it changed followed by a commit record.
+ * The db file is only brought up to date by checkpoints, so after a crash
+ * replaying the committed images on top of it is all recovery has to do.
+ */
+#define WAL_CHECKPOINT_BYTES (4 * 1024 * 1024)
+
+typedef enum { WAL_RECORD_PAGE = 1, WAL_RECORD_COMMIT = 2 } WalRecordType;
+
+const uint32_t WAL_RECORD_TYPE_SIZE = sizeof(uint32_t);
+const uint32_t WAL_RECORD_TYPE_OFFSET = 0;
+const uint32_t WAL_RECORD_PAGE_NUM_SIZE = sizeof(uint32_t);
+const uint32_t WAL_RECORD_PAGE_NUM_OFFSET = WAL_RECORD_TYPE_OFFSET + WAL_RECORD_TYPE_SIZE;
+const uint32_t WAL_RECORD_LSN_SIZE = sizeof(uint64_t);
+const uint32_t WAL_RECORD_LSN_OFFSET = WAL_RECORD_PAGE_NUM_OFFSET + WAL_RECORD_PAGE_NUM_SIZE;
+// two running sums over the rest of the header and the page image
+const uint32_t WAL_RECORD_CHECKSUM_SIZE = 2 * sizeof(uint32_t);
+const uint32_t WAL_RECORD_CHECKSUM_OFFSET = WAL_RECORD_LSN_OFFSET + WAL_RECORD_LSN_SIZE;
+const uint32_t WAL_RECORD_HEADER_SIZE = WAL_RECORD_CHECKSUM_OFFSET + WAL_RECORD_CHECKSUM_SIZE;
+
+/*
+ * Appends only go to an in-memory buffer. Committers that need durability
+ * ask the flusher thread for it, and the flusher writes everything that has
+ * accumulated with a single write + fdatasync, so statements that commit
+ * while an fdatasync is in flight share the next one (group commit).
+ */
+typedef struct {
+    int file_descriptor;
+    std::string filename;
+    bool synchronous;            // wait for fdatasync before a commit returns
+    uint64_t file_length;
+    uint64_t next_lsn;
+    uint64_t last_lsn;           // last record appended
+    uint64_t durable_lsn;        // last record known to be on disk
+    uint64_t flush_requested_lsn;
+    std::vector<char> buffer;    // appended, not yet handed to the flusher
+    std::vector<char> flush_buffer;
+    std::mutex lock;
+    std::condition_variable flush_needed;
+    std::condition_variable flushed;
+    std::thread flusher;
+    bool shutting_down;
+    uint64_t group_commits;
+} Wal;
+
+/*
+ * Page I/O goes through a backend so the pager does not care how reads and
+ * writes are issued. Reads are split into submit and wait, which lets a
+ * scan keep the next pages in flight while it works on the current one.
+ * Writes are synchronous and arrive sorted by page number.
+ */
+typedef enum { IO_BACKEND_PREAD, IO_BACKEND_URING } IoBackendType;
+
+typedef struct {
+    uint32_t page_num;
+    char *buffer;
+    uint32_t tag;       // handed back by wait_reads() once the read is done
+} PageRequest;
+
+class IoBackend {
+public:
+    virtual ~IoBackend() {}
+
+    virtual const char *name() const = 0;
+
+    virtual void submit_reads(int fd, const PageRequest *requests, uint32_t count) = 0;
+
+    // Block until at least one submitted read has finished, and return the
+    // tags of all reads that have.
+    virtual uint32_t wait_reads(uint32_t *tags, uint32_t max_tags) = 0;
+
+    // Write every page and return how many write requests that took.
+    virtual uint32_t write_pages(int fd, const PageRequest *requests, uint32_t count) = 0;
+
+    // Make every page written so far durable and findable after a restart.
+    virtual void sync(int fd) {
+        stats_add(STAT_SYSCALLS, 1);
+        if (fsync(fd) == -1) {
+            printf("Error syncing db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Cut the file down to its first num_pages pages, durably.
+    virtual void truncate(int fd, uint32_t num_pages) {
+        stats_add(STAT_SYSCALLS, 1);
+        if (ftruncate(fd, static_cast<off_t>(num_pages) * PAGE_SIZE) == -1) {
+            printf("Error truncating db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        sync(fd);
+    }
+};
+
+void io_read_page(int fd, const PageRequest *request) {
+    ssize_t bytes_read = pread(fd, request->buffer, PAGE_SIZE, static_cast<off_t>(request->page_num) * PAGE_SIZE);
+    stats_add(STAT_SYSCALLS, 1);
+    if (bytes_read == -1) {
+        std::cout << "Error reading file: " << errno << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    stats_add(STAT_BYTES_READ, bytes_read);
+    if (bytes_read < PAGE_SIZE)
+        std::memset(request->buffer + bytes_read, 0, PAGE_SIZE - bytes_read);
+}
+
+// Length of the run of adjacent pages that starts at requests[0].
+uint32_t io_run_length(const PageRequest *requests, uint32_t count) {
+    uint32_t length = 1;
+    while (length < count && length < FLUSH_MAX_RUN &&
+           requests[length].page_num == requests[length - 1].page_num + 1)
+        length++;
+    return length;
+}
+
+// Write the iovecs at offset with pwritev, picking up after short writes.
+// The iovecs are advanced as they are written. Returns the number of calls.
+uint32_t pwritev_all(int fd, struct iovec *iov, size_t count, uint64_t offset) {
+    uint32_t calls = 0;
+    size_t done = 0;
+    while (done < count) {
+        ssize_t bytes_written = pwritev(fd, iov + done, count - done, offset);
+        stats_add(STAT_SYSCALLS, 1);
+        if (bytes_written == -1) {
+            if (errno == EINTR)
+                continue;
+            printf("Error writing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        stats_add(STAT_BYTES_WRITTEN, bytes_written);
+        calls += 1;
+        offset += bytes_written;
+
+        // a short write can stop in the middle of an iovec
+        size_t remaining = bytes_written;
+        while (remaining > 0) {
+            if (remaining >= iov[done].iov_len) {
+                remaining -= iov[done].iov_len;
+                done++;
+            } else {
+                iov[done].iov_base = static_cast<char *>(iov[done].iov_base) + remaining;
+                iov[done].iov_len -= remaining;
+                remaining = 0;
+            }
+        }
+    }
+    return calls;
+}
+
+// Write a run of adjacent pages with a single pwritev where the kernel allows.
+uint32_t io_write_run(int fd, const PageRequest *requests, uint32_t count) {
+    struct iovec iov[FLUSH_MAX_RUN];
+    for (uint32_t i = 0; i < count; i++) {
+        iov[i].iov_base = requests[i].buffer;
+        iov[i].iov_len = PAGE_SIZE;
+    }
+    return pwritev_all(fd, iov, count, static_cast<uint64_t>(requests[0].page_num) * PAGE_SIZE);
+}
+
+// Plain blocking system calls, reads complete as soon as they are submitted.
+class PreadIoBackend : public IoBackend {
+public:
+    const char *name() const { return "pread"; }
+
+    void submit_reads(int fd, const PageRequest *requests, uint32_t count) {
+        for (uint32_t i = 0; i < count; i++) {
+            io_read_page(fd, &requests[i]);
+            finished_.push_back(requests[i].tag);
+        }
+    }
+
+    uint32_t wait_reads(uint32_t *tags, uint32_t max_tags) {
+        uint32_t count = std::min(max_tags, static_cast<uint32_t>(finished_.size()));
+        std::copy(finished_.end() - count, finished_.end(), tags);
+        finished_.resize(finished_.size() - count);
+        return count;
+    }
+
+    uint32_t write_pages(int fd, const PageRequest *requests, uint32_t count) {
+        uint32_t calls = 0;
+        for (uint32_t i = 0; i < count;) {
+            uint32_t length = io_run_length(requests + i, count - i);
+            calls += io_write_run(fd, requests + i, length);
+            i += length;
+        }
+        return calls;
+    }
+
+private:
+    std::vector<uint32_t> finished_;
+};
+
+#ifdef __linux__
+/*
+ * io_uring through the raw system calls: one READ per page and one WRITEV
+ * per run of adjacent dirty pages, submitted in batches.
+ */
+class UringIoBackend : public IoBackend {
+public:
+    // nullptr when the kernel does not let us set up a ring
+    static UringIoBackend *create(uint32_t entries) {
+        struct io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        int ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0)
+            return nullptr;
+
+        UringIoBackend *backend = new UringIoBackend();
+        backend->ring_fd_ = ring_fd;
+        backend->entries_ = params.sq_entries;
+        backend->sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        backend->cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        backend->single_mmap_ = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (backend->single_mmap_)
+            backend->sq_ring_size_ = backend->cq_ring_size_ = std::max(backend->sq_ring_size_, backend->cq_ring_size_);
+        backend->sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+
+        backend->sq_ring_ = mmap(nullptr, backend->sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 ring_fd, IORING_OFF_SQ_RING);
+        backend->cq_ring_ = backend->single_mmap_
+                                ? backend->sq_ring_
+                                : mmap(nullptr, backend->cq_ring_size_, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        backend->sqes_ = static_cast<struct io_uring_sqe *>(mmap(nullptr, backend->sqes_size_,
+                                                                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                                                 ring_fd, IORING_OFF_SQES));
+        if (backend->sq_ring_ == MAP_FAILED || backend->cq_ring_ == MAP_FAILED || backend->sqes_ == MAP_FAILED) {
+            delete backend;
+            return nullptr;
+        }
+
+        char *sq = static_cast<char *>(backend->sq_ring_);
+        char *cq = static_cast<char *>(backend->cq_ring_);
+        backend->sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        backend->sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        backend->sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        backend->cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        backend->cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        backend->cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        backend->cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        return backend;
+    }
+
+    ~UringIoBackend() {
+        if (sqes_ != nullptr && sqes_ != MAP_FAILED)
+            munmap(sqes_, sqes_size_);
+        if (cq_ring_ != nullptr && cq_ring_ != MAP_FAILED && !single_mmap_)
+            munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_ != nullptr && sq_ring_ != MAP_FAILED)
+            munmap(sq_ring_, sq_ring_size_);
+        if (ring_fd_ >= 0)
+            close(ring_fd_);
+    }
+
+    const char *name() const { return "io_uring"; }
+
+    void submit_reads(int fd, const PageRequest *requests, uint32_t count) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (requests[i].tag >= read_buffers_.size())
+                read_buffers_.resize(requests[i].tag + 1);
+            read_buffers_[requests[i].tag] = requests[i].buffer;
+
+            struct io_uring_sqe *sqe = next_sqe();
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = reinterpret_cast<uint64_t>(requests[i].buffer);
+            sqe->len = PAGE_SIZE;
+            sqe->off = static_cast<uint64_t>(requests[i].page_num) * PAGE_SIZE;
+            sqe->user_data = (URING_READ << 32) | requests[i].tag;
+        }
+        enter(0);
+    }
+
+    uint32_t wait_reads(uint32_t *tags, uint32_t max_tags) {
+        reap();
+        while (finished_reads_.empty()) {
+            if (in_flight_ == 0 && queued_ == 0) {
+                std::cout << "Waiting for a page read that was never submitted." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            enter(1);
+            reap();
+        }
+        uint32_t count = std::min(max_tags, static_cast<uint32_t>(finished_reads_.size()));
+        std::copy(finished_reads_.end() - count, finished_reads_.end(), tags);
+        finished_reads_.resize(finished_reads_.size() - count);
+        return count;
+    }
+
+    uint32_t write_pages(int fd, const PageRequest *requests, uint32_t count) {
+        // one iovec per page, kept alive until every write has completed
+        std::vector<struct iovec> iov(count);
+        write_runs_.clear();
+        for (uint32_t i = 0; i < count;) {
+            uint32_t length = io_run_length(requests + i, count - i);
+            for (uint32_t j = 0; j < length; j++) {
+                iov[i + j].iov_base = requests[i + j].buffer;
+                iov[i + j].iov_len = PAGE_SIZE;
+            }
+            WriteRun run = {requests + i, length, false};
+            write_runs_.push_back(run);
+            i += length;
+        }
+
+        uint32_t calls = write_runs_.size();
+        uint32_t iov_index = 0;
+        for (uint32_t run_num = 0; run_num < write_runs_.size(); run_num++) {
+            WriteRun *run = &write_runs_[run_num];
+            struct io_uring_sqe *sqe = next_sqe();
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->fd = fd;
+            sqe->addr = reinterpret_cast<uint64_t>(&iov[iov_index]);
+            sqe->len = run->count;
+            sqe->off = static_cast<uint64_t>(run->requests[0].page_num) * PAGE_SIZE;
+            sqe->user_data = (URING_WRITE << 32) | run_num;
+            pending_writes_ += 1;
+            iov_index += run->count;
+        }
+
+        while (pending_writes_ > 0) {
+            enter(1);
+            reap();
+        }
+
+        // rare: finish short writes the simple way
+        for (uint32_t run_num = 0; run_num < write_runs_.size(); run_num++) {
+            if (write_runs_[run_num].short_write)
+                calls += io_write_run(fd, write_runs_[run_num].requests, write_runs_[run_num].count);
+        }
+        return calls;
+    }
+
+private:
+    static const uint64_t URING_READ = 1;
+    static const uint64_t URING_WRITE = 2;
+
+    typedef struct {
+        const PageRequest *requests;
+        uint32_t count;
+        bool short_write;
+    } WriteRun;
+
+    UringIoBackend()
+        : ring_fd_(-1), entries_(0), queued_(0), in_flight_(0), pending_writes_(0), single_mmap_(false),
+          sq_ring_(nullptr), cq_ring_(nullptr), sq_ring_size_(0), cq_ring_size_(0), sqes_size_(0),
+          sqes_(nullptr), cqes_(nullptr), sq_tail_(nullptr), sq_array_(nullptr), cq_head_(nullptr),
+          cq_tail_(nullptr), sq_mask_(0), cq_mask_(0) {}
+
+    struct io_uring_sqe *next_sqe() {
+        // never have more requests out than the ring has entries, so the
+        // completion queue (twice as large) cannot overflow
+        while (queued_ + in_flight_ >= entries_) {
+            enter(queued_ > 0 ? 0 : 1);
+            reap();
+        }
+        unsigned tail = *sq_tail_;
+        unsigned index = tail & sq_mask_;
+        struct io_uring_sqe *sqe = &sqes_[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        queued_ += 1;
+        return sqe;
+    }
+
+    void enter(uint32_t min_complete) {
+        while (true) {
+            int submitted = syscall(__NR_io_uring_enter, ring_fd_, queued_, min_complete,
+                                    min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            stats_add(STAT_SYSCALLS, 1);
+            if (submitted >= 0) {
+                queued_ -= submitted;
+                in_flight_ += submitted;
+                return;
+            }
+            if (errno != EINTR) {
+                printf("Error submitting I/O: %d\n", errno);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    void reap() {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &cqes_[head & cq_mask_];
+            uint64_t kind = cqe->user_data >> 32;
+            uint32_t index = static_cast<uint32_t>(cqe->user_data);
+            if (cqe->res < 0) {
+                printf("Error in %s: %d\n", kind == URING_READ ? "read" : "write", -cqe->res);
+                exit(EXIT_FAILURE);
+            }
+            stats_add(kind == URING_READ ? STAT_BYTES_READ : STAT_BYTES_WRITTEN, cqe->res);
+            if (kind == URING_READ) {
+                if (cqe->res < static_cast<int32_t>(PAGE_SIZE))
+                    std::memset(read_buffers_[index] + cqe->res, 0, PAGE_SIZE - cqe->res);
+                finished_reads_.push_back(index);
+            } else {
+                WriteRun *run = &write_runs_[index];
+                if (cqe->res != static_cast<int32_t>(run->count * PAGE_SIZE))
+                    run->short_write = true;
+                pending_writes_ -= 1;
+            }
+            head++;
+            in_flight_ -= 1;
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+
+    int ring_fd_;
+    uint32_t entries_;
+    uint32_t queued_;      // in the submission queue, not yet seen by the kernel
+    uint32_t in_flight_;   // submitted, completion not reaped yet
+    uint32_t pending_writes_;
+    bool single_mmap_;
+    void *sq_ring_;
+    void *cq_ring_;
+    size_t sq_ring_size_;
+    size_t cq_ring_size_;
+    size_t sqes_size_;
+    struct io_uring_sqe *sqes_;
+    struct io_uring_cqe *cqes_;
+    unsigned *sq_tail_;
+    unsigned *sq_array_;
+    unsigned *cq_head_;
+    unsigned *cq_tail_;
+    unsigned sq_mask_;
+    unsigned cq_mask_;
+    std::vector<char *> read_buffers_;
+    std::vector<uint32_t> finished_reads_;
+    std::vector<WriteRun> write_runs_;
+};
+#endif
+
+IoBackend *io_backend_open(IoBackendType type) {
+#ifdef __linux__
+    if (type == IO_BACKEND_URING) {
+        IoBackend *backend = UringIoBackend::create(URING_ENTRIES);
+        if (backend != nullptr)
+            return backend;
+        std::cout << "io_uring is not available, using pread.\n";
+    }
+#endif
+    return new PreadIoBackend();
+}
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+    uint64_t pages_written;
+    uint64_t write_calls;
+    uint64_t mapped_reads;
+    uint64_t reads;
+    uint64_t prefetches;
+    uint64_t checkpoints;
+} PagerStats;
+
+/*
+ * With snapshots enabled, the first change a statement makes to a page
+ * happens in a fresh copy, and the committed image readers may still be
+ * looking at is kept as a version of the page, valid up to the commit that
+ * replaced it. A reader whose snapshot predates that commit keeps seeing
+ * it, and a version goes away once no open snapshot is that old.
+ */
+#define VERSION_PENDING UINT64_MAX
+
+typedef struct {
+    uint64_t end_lsn; // commit that replaced this image, VERSION_PENDING until then
+    char *image;
+} PageVersion;
+
+// A page as it was before the open statement first changed it.
+typedef struct {
+    uint32_t page_num;
+    char *image;
+    bool dirty;
+} PageImage;
+
+typedef struct {
+    uint32_t num_frames;
+    bool synchronous;
+    bool use_mmap;
+    uint32_t leaf_layout; // only used when the file is created
+    uint32_t page_codec;  // a PageCodec, only used when the file is created
+    IoBackendType io_backend;
+    uint32_t readahead_pages;
+    bool snapshots;       // keep old page versions for snapshot_open()
+    uint32_t scan_threads; // workers for parallel scans, 0 or 1 scans on the calling thread
+} PagerOptions;
+
+typedef struct {
+    int file_descriptor;
+    uint64_t file_length;
+    uint32_t num_pages;
+    uint32_t num_frames;
+    uint32_t frames_in_use;
+    uint32_t clock_hand;
+    Frame *frames;
+    char *frame_data;
+    char *map;           // read-only mapping of the db file with --mmap
+    uint64_t map_length; // bytes of the file currently mapped
+    PageTableEntry *page_table;
+    uint32_t page_table_mask;
+    PagerStats stats;
+    Wal *wal;
+    std::vector<uint32_t> write_set; // pages to log at the next commit
+    IoBackend *io;
+    uint32_t reads_in_flight;
+    uint32_t readahead_pages;
+    // Held for every buffer pool operation, never across a whole statement,
+    // so that reader threads and the writer thread can share the pool.
+    std::recursive_mutex latch;
+    uint64_t committed_lsn;
+    bool versioned;
+    std::unordered_map<uint32_t, std::vector<PageVersion>> versions; // oldest first
+    std::vector<uint32_t> pending_versions; // pages versioned by the running statement
+    std::multiset<uint64_t> snapshot_lsns;
+    std::vector<char *> spare_buffers;
+    std::vector<char *> page_buffers;     // allocated beyond frame_data, freed on close
+    // what pager_statement_rollback() takes the open statement back to
+    bool in_statement;
+    std::vector<PageImage> statement_images;
+    size_t statement_write_set; // write_set.size() as the statement began
+    size_t statement_versions;  // pending_versions.size() as the statement began
+    uint32_t statement_num_pages;
+    // checkpoints run here rather than on the committing thread, see pager_commit()
+    std::thread checkpointer;
+    std::condition_variable_any checkpoint_needed; // waited on with latch held
+    bool checkpoint_requested;
+    bool closing;
+} Pager;
+
+typedef struct {
+    void (*run)(void *context, uint32_t index);
+    void *context;
+    uint32_t index;
+} Task;
+
+typedef struct {
+    std::mutex lock;
+    std::deque<Task> tasks;
+} WorkQueue;
+
+/*
+ * Fixed set of worker threads, each with a queue of its own. A worker takes
+ * tasks from the front of its queue and, once that is empty, steals from
+ * the back of the others', so a worker that got slow tasks does not hold
+ * the rest of a batch up.
+ */
+typedef struct {
+    uint32_t num_threads;
+    std::vector<std::thread> threads;
+    WorkQueue *queues;
+    std::mutex lock;
+    std::condition_variable work_available;
+    uint32_t queued; // tasks in the queues, guarded by lock
+    bool shutting_down;
+} WorkerPool;
+
+class ResultSink;
+
+/*
+ * A set of ids: open addressing with linear probing, kept at most half
+ * full. ID_SET_EMPTY marks a free slot, so that id is tracked on its own.
+ */
+const uint32_t ID_SET_EMPTY = UINT32_MAX;
+const uint32_t ID_SET_MIN_SLOTS = 1024;
+
+typedef struct {
+    std::vector<uint32_t> slots; // a power of two of them
+    uint32_t shift;              // 64 less the log2 of slots.size()
+    uint64_t count;
+    bool has_empty_id;
+} IdSet;
+
+typedef struct Table {
+    uint32_t root_page_num;
+    uint32_t root_offset; // where the header page keeps root_page_num, 0 while it does not
+    uint32_t leaf_layout; // a LeafLayout, for leaves created from now on
+    Pager *pager;
+    WorkerPool *scan_pool; // nullptr unless opened with scan_threads > 1
+    bool in_transaction;   // between begin and commit, statements do not commit
+    ResultSink *output;    // where select statements send their rows
+    uint64_t num_rows;     // ROW_COUNT_UNKNOWN until counted, see table_add_row()
+    bool row_count_stale;  // the header no longer holds num_rows
+    IdSet *ids;            // nullptr until the first insert, see table_id_set()
+    // B+trees of the same file that index a column, nullptr for a column
+    // without an index and in an index itself
+    struct Table *indexes[INDEX_COLUMNS];
+    const Schema *schema; // that of a table made by create table, nullptr otherwise
+    // the tables made by create table, in catalog order, in the users table only
+    std::vector<struct Table *> tables;
+} Table;
+
+// A consistent view of the table as of one commit, see snapshot_open().
+typedef struct {
+    Table *table;
+    uint64_t lsn;
+    uint32_t root_page_num;
+    uint32_t index_root_page_nums[INDEX_COLUMNS]; // 0 for a column without an index
+} Snapshot;
+
+
+/*
+ * Database header, always page 0. It records where the roots of the table
+ * and its indexes live, so that a root split does not need to move the old
+ * root, and in a compressed file where the page map is. The catalog of the
+ * tables made by create table fills the rest of the page.
+ */
+const uint32_t DB_HEADER_MAGIC = 0x62647278; // "xrdb"
+const uint32_t DB_HEADER_MAGIC_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_MAGIC_OFFSET = 0;
+const uint32_t DB_HEADER_ROOT_PAGE_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_ROOT_PAGE_OFFSET = DB_HEADER_MAGIC_OFFSET + DB_HEADER_MAGIC_SIZE;
+// layout of new leaves, chosen when the file is created
+const uint32_t DB_HEADER_LEAF_LAYOUT_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_LEAF_LAYOUT_OFFSET = DB_HEADER_ROOT_PAGE_OFFSET + DB_HEADER_ROOT_PAGE_SIZE;
+// the rest is kept up to date by the I/O backend of a compressed file
+const uint32_t DB_HEADER_CODEC_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_CODEC_OFFSET = DB_HEADER_LEAF_LAYOUT_OFFSET + DB_HEADER_LEAF_LAYOUT_SIZE;
+const uint32_t DB_HEADER_MAP_OFFSET_SIZE = sizeof(uint64_t);
+const uint32_t DB_HEADER_MAP_OFFSET_OFFSET = DB_HEADER_CODEC_OFFSET + DB_HEADER_CODEC_SIZE;
+const uint32_t DB_HEADER_MAP_PAGES_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_MAP_PAGES_OFFSET = DB_HEADER_MAP_OFFSET_OFFSET + DB_HEADER_MAP_OFFSET_SIZE;
+// roots of the secondary indexes, one per IndexColumn, 0 for no index
+const uint32_t DB_HEADER_INDEX_ROOT_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_INDEX_ROOT_OFFSET = DB_HEADER_MAP_PAGES_OFFSET + DB_HEADER_MAP_PAGES_SIZE;
+// rows in the table plus one as of the last clean close, 0 when not known
+const uint32_t DB_HEADER_ROW_COUNT_SIZE = sizeof(uint64_t);
+const uint32_t DB_HEADER_ROW_COUNT_OFFSET = DB_HEADER_INDEX_ROOT_OFFSET + INDEX_COLUMNS * DB_HEADER_INDEX_ROOT_SIZE;
+const uint64_t ROW_COUNT_UNKNOWN = UINT64_MAX;
+// first page of the list of free pages, 0 when there are none
+const uint32_t DB_HEADER_FREE_PAGE_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_FREE_PAGE_OFFSET = DB_HEADER_ROW_COUNT_OFFSET + DB_HEADER_ROW_COUNT_SIZE;
+// bytes of catalog entries that follow, see catalog_create_table()
+const uint32_t DB_HEADER_CATALOG_SIZE_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_CATALOG_SIZE_OFFSET = DB_HEADER_FREE_PAGE_OFFSET + DB_HEADER_FREE_PAGE_SIZE;
+const uint32_t DB_HEADER_CATALOG_OFFSET = DB_HEADER_CATALOG_SIZE_OFFSET + DB_HEADER_CATALOG_SIZE_SIZE;
+const uint32_t DB_HEADER_PAGE_NUM = 0;
+
+
+/*
+ * LZ4 block format, compressor and decompressor. Inputs are at most 64 KB,
+ * which is plenty for a page and lets the match finder keep 16 bit
+ * positions.
+ */
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // the block always ends in this many literals
+#define LZ4_MATCH_LIMIT 12  // and no match starts this close to its end
+#define LZ4_HASH_BITS 12
+#define LZ4_BOUND(length) ((length) + (length) / 255 + 16)
+
+void lz4_put_length(char **out, uint32_t length) {
+    for (; length >= 255; length -= 255)
+        *(*out)++ = static_cast<char>(255);
+    *(*out)++ = static_cast<char>(length);
+}
+
+// Returns the compressed length, dst needs room for LZ4_BOUND(length).
+uint32_t lz4_compress(const char *src, uint32_t length, char *dst) {
+    char *out = dst;
+    uint32_t anchor = 0;
+    if (length >= LZ4_MATCH_LIMIT) {
+        uint16_t table[1 << LZ4_HASH_BITS];
+        std::memset(table, 0, sizeof(table));
+        uint32_t pos = 0;
+        while (pos <= length - LZ4_MATCH_LIMIT) {
+            uint32_t sequence, candidate_sequence;
+            std::memcpy(&sequence, src + pos, sizeof(sequence));
+            uint32_t hash = (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+            uint32_t candidate = table[hash];
+            table[hash] = pos;
+            std::memcpy(&candidate_sequence, src + candidate, sizeof(candidate_sequence));
+            if (candidate >= pos || pos - candidate > UINT16_MAX || candidate_sequence != sequence) {
+                pos++;
+                continue;
+            }
+            while (pos > anchor && candidate > 0 && src[pos - 1] == src[candidate - 1]) {
+                pos--;
+                candidate--;
+            }
+            uint32_t match_length = LZ4_MIN_MATCH;
+            while (pos + match_length < length - LZ4_LAST_LITERALS &&
+                   src[pos + match_length] == src[candidate + match_length])
+                match_length++;
+
+            uint32_t literals = pos - anchor;
+            uint32_t extra = match_length - LZ4_MIN_MATCH;
+            *out++ = static_cast<char>((std::min(literals, 15u) << 4) | std::min(extra, 15u));
+            if (literals >= 15)
+                lz4_put_length(&out, literals - 15);
+            std::memcpy(out, src + anchor, literals);
+            out += literals;
+            uint32_t offset = pos - candidate;
+            *out++ = static_cast<char>(offset & 0xff);
+            *out++ = static_cast<char>(offset >> 8);
+            if (extra >= 15)
+                lz4_put_length(&out, extra - 15);
+            pos += match_length;
+            anchor = pos;
+        }
+    }
+
+    uint32_t literals = length - anchor;
+    *out++ = static_cast<char>(std::min(literals, 15u) << 4);
+    if (literals >= 15)
+        lz4_put_length(&out, literals - 15);
+    std::memcpy(out, src + anchor, literals);
+    out += literals;
+    return out - dst;
+}
+
+bool lz4_get_length(const uint8_t **in, const uint8_t *end, uint32_t *length) {
+    uint8_t byte;
+    do {
+        if (*in >= end)
+            return false;
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// False when src is not a block that decompresses to exactly length bytes.
+bool lz4_decompress(const char *src, uint32_t src_length, char *dst, uint32_t length) {
+    const uint8_t *in = reinterpret_cast<const uint8_t *>(src);
+    const uint8_t *end = in + src_length;
+    uint32_t out = 0;
+    while (in < end) {
+        uint32_t token = *in++;
+        uint32_t literals = token >> 4;
+        if (literals == 15 && !lz4_get_length(&in, end, &literals))
+            return false;
+        if (literals > static_cast<uint32_t>(end - in) || literals > length - out)
+            return false;
+        std::memcpy(dst + out, in, literals);
+        in += literals;
+        out += literals;
+        if (in == end)
+            break;
+
+        if (end - in < 2)
+            return false;
+        uint32_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        uint32_t match_length = token & 15;
+        if (match_length == 15 && !lz4_get_length(&in, end, &match_length))
+            return false;
+        match_length += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > out || match_length > length - out)
+            return false;
+        // byte by byte, a match may overlap the bytes it produces
+        for (uint32_t i = 0; i < match_length; i++)
+            dst[out + i] = dst[out - offset + i];
+        out += match_length;
+    }
+    return out == length;
+}
+
+
+/*
+ * Compressed db files. The header page stays uncompressed at the start of
+ * the file, every other page is stored compressed wherever there was room
+ * for it, and a page map records where each one went. Space is handed out
+ * in units of COMPRESSED_UNIT bytes. A page that still fits where it was is
+ * rewritten in place, one that has outgrown its extent moves to a free one
+ * and leaves the old extent behind for others.
+ *
+ * The map on disk only changes in sync(): it is written to a new extent,
+ * then the header is pointed at it. A page moved since the last sync can
+ * reuse an extent the old map still points at, which is fine because that
+ * page is in the log and recovery writes it again.
+ */
+typedef enum { PAGE_CODEC_NONE, PAGE_CODEC_LZ4 } PageCodec;
+
+#define COMPRESSED_UNIT 128
+#define PAGE_UNITS (PAGE_SIZE / COMPRESSED_UNIT)
+
+typedef struct {
+    uint32_t offset;   // in units
+    uint16_t length;   // bytes, PAGE_SIZE when stored uncompressed, 0 when never written
+    uint16_t capacity; // units
+} PageExtent;
+
+class CompressedIoBackend : public IoBackend {
+public:
+    // Takes over an existing compressed file, or an empty file when codec
+    // asks for compression. Returns nullptr for any other file.
+    static CompressedIoBackend *open(int fd, PageCodec codec) {
+        off_t file_length = lseek(fd, 0, SEEK_END);
+        std::vector<char> header(PAGE_SIZE, 0);
+        if (file_length == 0) {
+            if (codec == PAGE_CODEC_NONE)
+                return nullptr;
+        } else {
+            if (file_length < PAGE_SIZE)
+                return nullptr;
+            read_exactly(fd, header.data(), PAGE_SIZE, 0);
+            uint32_t magic;
+            std::memcpy(&magic, header.data() + DB_HEADER_MAGIC_OFFSET, DB_HEADER_MAGIC_SIZE);
+            std::memcpy(&codec, header.data() + DB_HEADER_CODEC_OFFSET, DB_HEADER_CODEC_SIZE);
+            if (magic != DB_HEADER_MAGIC || codec == PAGE_CODEC_NONE)
+                return nullptr;
+            if (codec != PAGE_CODEC_LZ4) {
+                std::cout << "Unknown page compression " << codec << ".\n";
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        CompressedIoBackend *backend = new CompressedIoBackend();
+        backend->codec_ = codec;
+        backend->header_.swap(header);
+        backend->end_ = std::max(static_cast<uint32_t>(PAGE_UNITS),
+                                 static_cast<uint32_t>((file_length + COMPRESSED_UNIT - 1) / COMPRESSED_UNIT));
+        backend->map_offset_ = 0;
+        backend->map_units_ = 0;
+        backend->map_pages_ = 0;
+        backend->map_dirty_ = false;
+        if (file_length > 0)
+            backend->load_map(fd);
+        return backend;
+    }
+
+    const char *name() const { return "pread, lz4 pages"; }
+
+    // Pages in the file, including the header once it has been written.
+    uint32_t num_pages() const { return extents_.size(); }
+
+    void submit_reads(int fd, const PageRequest *requests, uint32_t count) {
+        for (uint32_t i = 0; i < count; i++) {
+            read_page(fd, &requests[i]);
+            finished_.push_back(requests[i].tag);
+        }
+    }
+
+    uint32_t wait_reads(uint32_t *tags, uint32_t max_tags) {
+        uint32_t count = std::min(max_tags, static_cast<uint32_t>(finished_.size()));
+        std::copy(finished_.end() - count, finished_.end(), tags);
+        finished_.resize(finished_.size() - count);
+        return count;
+    }
+
+    /*
+     * Compress every page and find it a place, then write the pages in file
+     * order so that the ones that landed next to each other, typically new
+     * pages at the end of the file, go out as a single request.
+     */
+    uint32_t write_pages(int fd, const PageRequest *requests, uint32_t count) {
+        std::vector<char> compressed(static_cast<size_t>(count) * LZ4_BOUND(PAGE_SIZE));
+        std::vector<std::pair<uint64_t, struct iovec>> writes;
+        uint32_t calls = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t page_num = requests[i].page_num;
+            if (page_num >= extents_.size()) {
+                PageExtent unwritten = {0, 0, 0};
+                extents_.resize(page_num + 1, unwritten);
+            }
+            if (page_num == DB_HEADER_PAGE_NUM) {
+                std::memcpy(header_.data(), requests[i].buffer, PAGE_SIZE);
+                calls += write_header(fd);
+                continue;
+            }
+
+            char *data = compressed.data() + static_cast<size_t>(i) * LZ4_BOUND(PAGE_SIZE);
+            uint32_t length = lz4_compress(requests[i].buffer, PAGE_SIZE, data);
+            if ((length + COMPRESSED_UNIT - 1) / COMPRESSED_UNIT >= PAGE_UNITS) {
+                data = requests[i].buffer;
+                length = PAGE_SIZE;
+            }
+            PageExtent *extent = &(extents_[page_num]);
+            uint32_t units = (length + COMPRESSED_UNIT - 1) / COMPRESSED_UNIT;
+            if (units > extent->capacity) {
+                free_extent(extent->offset, extent->capacity);
+                // one spare unit, so a page that grows a little stays put
+                extent->capacity = std::min(units + 1, static_cast<uint32_t>(PAGE_UNITS));
+                extent->offset = allocate(extent->capacity);
+            }
+            extent->length = length;
+            map_dirty_ = true;
+
+            struct iovec iov = {data, length};
+            writes.push_back(std::make_pair(static_cast<uint64_t>(extent->offset) * COMPRESSED_UNIT, iov));
+        }
+
+        std::sort(writes.begin(), writes.end(),
+                  [](const std::pair<uint64_t, struct iovec> &a, const std::pair<uint64_t, struct iovec> &b) {
+                      return a.first < b.first;
+                  });
+        for (size_t i = 0; i < writes.size();) {
+            // the unused tail of an extent is skipped, so runs only join
+            // pages that fill their extents to the last byte
+            size_t run = 1;
+            while (i + run < writes.size() && run < FLUSH_MAX_RUN &&
+                   writes[i + run].first == writes[i + run - 1].first + writes[i + run - 1].second.iov_len)
+                run++;
+            struct iovec iov[FLUSH_MAX_RUN];
+            for (size_t j = 0; j < run; j++)
+                iov[j] = writes[i + j].second;
+            calls += pwritev_all(fd, iov, run, writes[i].first);
+            i += run;
+        }
+        return calls;
+    }
+
+    void sync(int fd) {
+        if (!map_dirty_) {
+            IoBackend::sync(fd);
+            return;
+        }
+
+        std::vector<char> map(extents_.size() * sizeof(PageExtent) + COMPRESSED_UNIT);
+        for (size_t i = 0; i < extents_.size(); i++) {
+            char *entry = map.data() + i * sizeof(PageExtent);
+            std::memcpy(entry, &(extents_[i].offset), sizeof(uint32_t));
+            std::memcpy(entry + 4, &(extents_[i].length), sizeof(uint16_t));
+            std::memcpy(entry + 6, &(extents_[i].capacity), sizeof(uint16_t));
+        }
+        uint32_t map_units = (extents_.size() * sizeof(PageExtent) + COMPRESSED_UNIT - 1) / COMPRESSED_UNIT;
+        uint32_t map_offset = allocate(map_units);
+        struct iovec iov = {map.data(), static_cast<size_t>(map_units) * COMPRESSED_UNIT};
+        pwritev_all(fd, &iov, 1, static_cast<uint64_t>(map_offset) * COMPRESSED_UNIT);
+        IoBackend::sync(fd);
+
+        // only now is the old map no longer needed
+        uint32_t old_offset = map_offset_;
+        uint32_t old_units = map_units_;
+        map_offset_ = map_offset;
+        map_units_ = map_units;
+        map_pages_ = extents_.size();
+        write_header(fd);
+        IoBackend::sync(fd);
+        free_extent(old_offset, old_units);
+        map_dirty_ = false;
+
+        // nothing on disk points at free space any more, give the tail back
+        if (!free_.empty()) {
+            auto last = std::prev(free_.end());
+            if (last->first + last->second == end_) {
+                end_ = last->first;
+                free_by_size_.erase(std::make_pair(last->second, last->first));
+                free_.erase(last);
+                if (ftruncate(fd, static_cast<off_t>(end_) * COMPRESSED_UNIT) == -1) {
+                    printf("Error truncating db file: %d\n", errno);
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+    }
+
+    // The space of the pages dropped is only freed once no map on disk
+    // lists them, and the map written after that gives the tail back.
+    void truncate(int fd, uint32_t num_pages) {
+        if (num_pages >= extents_.size())
+            return;
+        std::vector<PageExtent> dropped(extents_.begin() + num_pages, extents_.end());
+        extents_.resize(num_pages);
+        map_dirty_ = true;
+        sync(fd);
+        for (const PageExtent &extent : dropped)
+            free_extent(extent.offset, extent.capacity);
+        map_dirty_ = true;
+        sync(fd);
+    }
+
+private:
+    static void read_exactly(int fd, char *buffer, size_t length, uint64_t offset) {
+        ssize_t bytes_read = pread(fd, buffer, length, offset);
+        stats_add(STAT_SYSCALLS, 1);
+        if (bytes_read != static_cast<ssize_t>(length)) {
+            std::cout << "Error reading file: " << errno << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        stats_add(STAT_BYTES_READ, bytes_read);
+    }
+
+    uint32_t write_header(int fd) {
+        uint64_t map_offset = static_cast<uint64_t>(map_offset_) * COMPRESSED_UNIT;
+        std::memcpy(header_.data() + DB_HEADER_CODEC_OFFSET, &codec_, DB_HEADER_CODEC_SIZE);
+        std::memcpy(header_.data() + DB_HEADER_MAP_OFFSET_OFFSET, &map_offset, DB_HEADER_MAP_OFFSET_SIZE);
+        std::memcpy(header_.data() + DB_HEADER_MAP_PAGES_OFFSET, &map_pages_, DB_HEADER_MAP_PAGES_SIZE);
+        struct iovec iov = {header_.data(), PAGE_SIZE};
+        return pwritev_all(fd, &iov, 1, 0);
+    }
+
+    void read_page(int fd, const PageRequest *request) {
+        if (request->page_num == DB_HEADER_PAGE_NUM) {
+            std::memcpy(request->buffer, header_.data(), PAGE_SIZE);
+            return;
+        }
+        if (request->page_num >= extents_.size() || extents_[request->page_num].length == 0) {
+            std::memset(request->buffer, 0, PAGE_SIZE);
+            return;
+        }
+        const PageExtent *extent = &(extents_[request->page_num]);
+        uint64_t offset = static_cast<uint64_t>(extent->offset) * COMPRESSED_UNIT;
+        if (extent->length == PAGE_SIZE) {
+            read_exactly(fd, request->buffer, PAGE_SIZE, offset);
+            return;
+        }
+        read_exactly(fd, buffer_, extent->length, offset);
+        if (!lz4_decompress(buffer_, extent->length, request->buffer, PAGE_SIZE)) {
+            std::cout << "Page " << request->page_num << " does not decompress. Corrupt file.\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Read the page map and treat every gap between extents as free.
+    void load_map(int fd) {
+        uint64_t map_offset;
+        uint32_t map_pages;
+        std::memcpy(&map_offset, header_.data() + DB_HEADER_MAP_OFFSET_OFFSET, DB_HEADER_MAP_OFFSET_SIZE);
+        std::memcpy(&map_pages, header_.data() + DB_HEADER_MAP_PAGES_OFFSET, DB_HEADER_MAP_PAGES_SIZE);
+        std::vector<char> map(static_cast<size_t>(map_pages) * sizeof(PageExtent));
+        if (map_pages > 0)
+            read_exactly(fd, map.data(), map.size(), map_offset);
+        extents_.resize(map_pages);
+        if (extents_.empty()) {
+            PageExtent header = {0, 0, 0};
+            extents_.push_back(header);
+        }
+        map_offset_ = map_offset / COMPRESSED_UNIT;
+        map_units_ = (map.size() + COMPRESSED_UNIT - 1) / COMPRESSED_UNIT;
+        map_pages_ = map_pages;
+
+        std::vector<std::pair<uint32_t, uint32_t>> used;
+        if (map_units_ > 0)
+            used.push_back(std::make_pair(map_offset_, map_units_));
+        for (uint32_t i = 0; i < map_pages; i++) {
+            const char *entry = map.data() + static_cast<size_t>(i) * sizeof(PageExtent);
+            std::memcpy(&(extents_[i].offset), entry, sizeof(uint32_t));
+            std::memcpy(&(extents_[i].length), entry + 4, sizeof(uint16_t));
+            std::memcpy(&(extents_[i].capacity), entry + 6, sizeof(uint16_t));
+            if (extents_[i].capacity > 0)
+                used.push_back(std::make_pair(extents_[i].offset, extents_[i].capacity));
+        }
+        std::sort(used.begin(), used.end());
+        uint32_t next = PAGE_UNITS;
+        for (const auto &extent : used) {
+            if (extent.first > next)
+                free_extent(next, extent.first - next);
+            next = std::max(next, extent.first + extent.second);
+        }
+        // the last extent may end past the last byte written to it
+        if (end_ > next)
+            free_extent(next, end_ - next);
+        end_ = std::max(end_, next);
+    }
+
+    // Best fit among the free extents, or the end of the file.
+    uint32_t allocate(uint32_t units) {
+        auto fit = free_by_size_.lower_bound(std::make_pair(units, 0u));
+        if (fit == free_by_size_.end()) {
+            uint32_t offset = end_;
+            end_ += units;
+            return offset;
+        }
+        uint32_t offset = fit->second;
+        uint32_t left = fit->first - units;
+        free_by_size_.erase(fit);
+        free_.erase(offset);
+        if (left > 0) {
+            free_[offset + units] = left;
+            free_by_size_.insert(std::make_pair(left, offset + units));
+        }
+        return offset;
+    }
+
+    // Merge the extent with the free space on either side of it.
+    void free_extent(uint32_t offset, uint32_t units) {
+        if (units == 0)
+            return;
+        auto next = free_.find(offset + units);
+        if (next != free_.end()) {
+            units += next->second;
+            free_by_size_.erase(std::make_pair(next->second, next->first));
+            free_.erase(next);
+        }
+        auto previous = free_.lower_bound(offset);
+        if (previous != free_.begin()) {
+            --previous;
+            if (previous->first + previous->second == offset) {
+                offset = previous->first;
+                units += previous->second;
+                free_by_size_.erase(std::make_pair(previous->second, previous->first));
+                free_.erase(previous);
+            }
+        }
+        free_[offset] = units;
+        free_by_size_.insert(std::make_pair(units, offset));
+    }
+
+    PageCodec codec_;
+    std::vector<char> header_;
+    std::vector<PageExtent> extents_; // by page number
+    std::map<uint32_t, uint32_t> free_;      // offset -> units, no two adjacent
+    std::set<std::pair<uint32_t, uint32_t>> free_by_size_; // (units, offset)
+    uint32_t end_;                    // units in the file
+    uint32_t map_offset_;             // units, where the page map on disk is
+    uint32_t map_units_;
+    uint32_t map_pages_;              // pages the map on disk covers
+    bool map_dirty_;
+    char buffer_[PAGE_SIZE];
+    std::vector<uint32_t> finished_;
+};
+
+
+/*
+ * Common node header layout
+ */
+typedef enum { NODE_INTERNAL, NODE_LEAF, NODE_FREE } NodeType;
+
+const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
+const uint32_t NODE_TYPE_OFFSET = 0;
+const uint32_t NODE_LAYOUT_SIZE = sizeof(uint8_t);
+const uint32_t NODE_LAYOUT_OFFSET = NODE_TYPE_OFFSET + NODE_TYPE_SIZE;
+// padded so that every following field is 4-byte aligned
+const uint32_t COMMON_NODE_HEADER_SIZE = sizeof(uint32_t);
+
+/*
+ * Leaf node header layout
+ */
+const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE;
+
+/*
+ * Leaves come in two layouts, recorded in each leaf's header so that both
+ * can be read no matter which one the file creates new leaves with.
+ *
+ * LEAF_LAYOUT_ROW: an array of (key, row) cells sorted by key.
+ *
+ * LEAF_LAYOUT_PAX: one minipage per column, all ids first, then all
+ * usernames, then all emails, each array sorted by key. The id doubles as
+ * the key, so a scan that only looks at ids reads 4 bytes per row instead
+ * of a whole cell.
+ *
+ * LEAF_LAYOUT_SLOTTED: a directory of (key, offset, length) slots sorted by
+ * key grows from the front of the page, and the rows it points to grow
+ * from the back, each stored as its id followed by its strings with a
+ * length byte in front of each. Rows only take the space their strings
+ * need, so a leaf holds as many as fit rather than a fixed count.
+ */
+typedef enum { LEAF_LAYOUT_ROW, LEAF_LAYOUT_PAX, LEAF_LAYOUT_SLOTTED } LeafLayout;
+
+const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_KEY_OFFSET = 0;
+const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
+const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
+const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
+const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
+const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
+const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
+const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+
+// Both layouts hold LEAF_NODE_MAX_CELLS rows, PAX just drops the copy of the key.
+const uint32_t PAX_IDS_OFFSET = LEAF_NODE_HEADER_SIZE;
+const uint32_t PAX_USERNAMES_OFFSET = PAX_IDS_OFFSET + LEAF_NODE_MAX_CELLS * ID_SIZE;
+const uint32_t PAX_EMAILS_OFFSET = PAX_USERNAMES_OFFSET + LEAF_NODE_MAX_CELLS * USERNAME_SIZE;
+
+// Where the row area of a slotted leaf starts, and how many bytes in it are
+// taken by rows that moved away and can be compacted.
+const uint32_t SLOTTED_CONTENT_START_SIZE = sizeof(uint16_t);
+const uint32_t SLOTTED_CONTENT_START_OFFSET = LEAF_NODE_HEADER_SIZE;
+const uint32_t SLOTTED_FRAGMENTED_SIZE = sizeof(uint16_t);
+const uint32_t SLOTTED_FRAGMENTED_OFFSET = SLOTTED_CONTENT_START_OFFSET + SLOTTED_CONTENT_START_SIZE;
+const uint32_t SLOTTED_HEADER_SIZE = SLOTTED_FRAGMENTED_OFFSET + SLOTTED_FRAGMENTED_SIZE;
+
+const uint32_t SLOT_KEY_SIZE = sizeof(uint32_t);
+const uint32_t SLOT_KEY_OFFSET = 0;
+const uint32_t SLOT_CELL_OFFSET_SIZE = sizeof(uint16_t);
+const uint32_t SLOT_CELL_OFFSET_OFFSET = SLOT_KEY_OFFSET + SLOT_KEY_SIZE;
+const uint32_t SLOT_CELL_LENGTH_SIZE = sizeof(uint16_t);
+const uint32_t SLOT_CELL_LENGTH_OFFSET = SLOT_CELL_OFFSET_OFFSET + SLOT_CELL_OFFSET_SIZE;
+const uint32_t SLOT_SIZE = SLOT_CELL_LENGTH_OFFSET + SLOT_CELL_LENGTH_SIZE;
+
+// a row with two empty strings
+const uint32_t SLOTTED_MIN_CELL_SIZE = ID_SIZE + 2 * sizeof(uint8_t);
+const uint32_t SLOTTED_MAX_CELL_SIZE = ID_SIZE + 2 * sizeof(uint8_t) + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE;
+const uint32_t SLOTTED_MAX_CELLS = (PAGE_SIZE - SLOTTED_HEADER_SIZE) / (SLOT_SIZE + SLOTTED_MIN_CELL_SIZE);
+// a record of a created table, small enough that a split of a full leaf always has room for it
+const uint32_t RECORD_MAX_SIZE = PAGE_SIZE / 4;
+
+// most rows a leaf of any layout can hold
+const uint32_t LEAF_NODE_MAX_ROWS = LEAF_NODE_MAX_CELLS > SLOTTED_MAX_CELLS ? LEAF_NODE_MAX_CELLS : SLOTTED_MAX_CELLS;
+// one bit per row of a leaf, see filter_ids()
+const uint32_t SELECTION_WORDS = (LEAF_NODE_MAX_ROWS + 63) / 64;
+
+/*
+ * Internal node header layout
+ */
+const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET = INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
+const uint32_t INTERNAL_NODE_HEADER_SIZE =
+    COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+
+/*
+ * Internal node body layout: (child, key) cells where key is an upper bound
+ * of every key stored under child, plus a right child for everything larger.
+ */
+const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
+const uint32_t INTERNAL_NODE_MAX_KEYS = (PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE) / INTERNAL_NODE_CELL_SIZE;
+
+/*
+ * Free page layout: a page no B+tree uses any more, linked to the next
+ * one on the free list that starts in the header. Zeroed otherwise.
+ */
+const uint32_t FREE_PAGE_NEXT_SIZE = sizeof(uint32_t);
+const uint32_t FREE_PAGE_NEXT_OFFSET = COMMON_NODE_HEADER_SIZE;
+
+// deep enough for far more rows than a uint32_t page number can address
+#define BTREE_MAX_DEPTH 16
+
+typedef struct {
+    Table *table;
+    const Snapshot *snapshot; // nullptr to read the latest version of every page
+    uint32_t page_num;
+    uint32_t cell_num;
+    bool end_of_table; // indicates a position one past the last element
+    void *page;        // the current leaf, pinned until the cursor moves on
+    bool page_pinned;  // false when page is an old version
+    // internal nodes from the root down to the current leaf, and which
+    // child was taken in each of them
+    uint32_t depth;
+    uint32_t path_page_num[BTREE_MAX_DEPTH];
+    uint32_t path_child_num[BTREE_MAX_DEPTH];
+    // leaves to keep in flight ahead of the current one, and how far the
+    // last batch reached among the children of prefetch_parent
+    uint32_t readahead;
+    uint32_t prefetch_parent;
+    uint32_t prefetch_until;
+} Cursor;
+
+/*
+ * The rows a cursor hands out in one go: consecutive cells of a single
+ * leaf, read in place. Valid until the cursor is advanced or closed.
+ */
+typedef struct {
+    void *node;
+    uint32_t first_cell;
+    uint32_t count;
+} RowBatch;
+
+
+NodeType get_node_type(void *node) {
+    uint8_t value = *(static_cast<uint8_t *>(node) + NODE_TYPE_OFFSET);
+    return static_cast<NodeType>(value);
+}
+
+void set_node_type(void *node, NodeType type) {
+    *(static_cast<uint8_t *>(node) + NODE_TYPE_OFFSET) = static_cast<uint8_t>(type);
+}
+
+LeafLayout get_leaf_layout(void *node) {
+    uint8_t value = *(static_cast<uint8_t *>(node) + NODE_LAYOUT_OFFSET);
+    return static_cast<LeafLayout>(value);
+}
+
+uint32_t *leaf_node_num_cells(void *node) {
+    return reinterpret_cast<uint32_t *>(static_cast<char *>(node) + LEAF_NODE_NUM_CELLS_OFFSET);
+}
+
+void *leaf_node_cell(void *node, uint32_t cell_num) {
+    return static_cast<char *>(node) + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+}
+
+// The column arrays of a PAX leaf.
+uint32_t *pax_ids(void *node) {
+    return reinterpret_cast<uint32_t *>(static_cast<char *>(node) + PAX_IDS_OFFSET);
+}
+
+char *pax_username(void *node, uint32_t cell_num) {
+    return static_cast<char *>(node) + PAX_USERNAMES_OFFSET + cell_num * USERNAME_SIZE;
+}
+
+char *pax_email(void *node, uint32_t cell_num) {
+    return static_cast<char *>(node) + PAX_EMAILS_OFFSET + cell_num * EMAIL_SIZE;
+}
+
+// The slot directory and row area of a slotted leaf.
+uint16_t *slotted_content_start(void *node) {
+    return reinterpret_cast<uint16_t *>(static_cast<char *>(node) + SLOTTED_CONTENT_START_OFFSET);
+}
+
+uint16_t *slotted_fragmented(void *node) {
+    return reinterpret_cast<uint16_t *>(static_cast<char *>(node) + SLOTTED_FRAGMENTED_OFFSET);
+}
+
+char *slotted_slot(void *node, uint32_t cell_num) {
+    return static_cast<char *>(node) + SLOTTED_HEADER_SIZE + cell_num * SLOT_SIZE;
+}
+
+uint16_t *slotted_cell_offset(void *node, uint32_t cell_num) {
+    return reinterpret_cast<uint16_t *>(slotted_slot(node, cell_num) + SLOT_CELL_OFFSET_OFFSET);
+}
+
+uint16_t *slotted_cell_length(void *node, uint32_t cell_num) {
+    return reinterpret_cast<uint16_t *>(slotted_slot(node, cell_num) + SLOT_CELL_LENGTH_OFFSET);
+}
+
+char *slotted_cell(void *node, uint32_t cell_num) {
+    return static_cast<char *>(node) + *slotted_cell_offset(node, cell_num);
+}
+
+// Unused bytes between the slot directory and the row area.
+uint32_t slotted_free_space(void *node) {
+    return *slotted_content_start(node) - (SLOTTED_HEADER_SIZE + *leaf_node_num_cells(node) * SLOT_SIZE);
+}
+
+// Encode row into cell and return its length.
+uint32_t slotted_encode_row(Row *row, char *cell) {
+    uint8_t username_length = strnlen(row->username, COLUMN_USERNAME_SIZE);
+    uint8_t email_length = strnlen(row->email, COLUMN_EMAIL_SIZE);
+    char *position = cell;
+    std::memcpy(position, &(row->id), ID_SIZE);
+    position += ID_SIZE;
+    *position++ = static_cast<char>(username_length);
+    std::memcpy(position, row->username, username_length);
+    position += username_length;
+    *position++ = static_cast<char>(email_length);
+    std::memcpy(position, row->email, email_length);
+    position += email_length;
+    return position - cell;
+}
+
+RowView slotted_view_row(const char *cell) {
+    RowView view;
+    std::memcpy(&(view.id), cell, ID_SIZE);
+    const uint8_t *position = reinterpret_cast<const uint8_t *>(cell) + ID_SIZE;
+    view.username_length = *position++;
+    view.username = reinterpret_cast<const char *>(position);
+    position += view.username_length;
+    view.email_length = *position++;
+    view.email = reinterpret_cast<const char *>(position);
+    return view;
+}
+
+/*
+ * Move every row to the back of the page, packed, so that the space left
+ * behind by rows that moved away can be used again.
+ */
+void slotted_compact(void *node) {
+    char copy[PAGE_SIZE];
+    std::memcpy(copy, node, PAGE_SIZE);
+
+    uint32_t content_start = PAGE_SIZE;
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    for (uint32_t i = 0; i < num_cells; i++) {
+        uint16_t length = *slotted_cell_length(node, i);
+        content_start -= length;
+        std::memcpy(static_cast<char *>(node) + content_start, copy + *slotted_cell_offset(node, i), length);
+        *slotted_cell_offset(node, i) = content_start;
+    }
+    *slotted_content_start(node) = content_start;
+    *slotted_fragmented(node) = 0;
+}
+
+// Insert an encoded row at cell_num, compacting first if it only fits that way.
+void slotted_insert_cell(void *node, uint32_t cell_num, uint32_t key, const char *cell, uint32_t length) {
+    if (slotted_free_space(node) < length + SLOT_SIZE)
+        slotted_compact(node);
+    if (slotted_free_space(node) < length + SLOT_SIZE) {
+        std::cout << "No room for a " << length << " byte row in a slotted leaf." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    std::memmove(slotted_slot(node, cell_num + 1), slotted_slot(node, cell_num), (num_cells - cell_num) * SLOT_SIZE);
+    uint16_t offset = *slotted_content_start(node) - length;
+    std::memcpy(static_cast<char *>(node) + offset, cell, length);
+    *slotted_content_start(node) = offset;
+
+    std::memcpy(slotted_slot(node, cell_num) + SLOT_KEY_OFFSET, &key, SLOT_KEY_SIZE);
+    *slotted_cell_offset(node, cell_num) = offset;
+    *slotted_cell_length(node, cell_num) = length;
+    *leaf_node_num_cells(node) = num_cells + 1;
+}
+
+uint32_t *leaf_node_key(void *node, uint32_t cell_num) {
+    if (get_leaf_layout(node) == LEAF_LAYOUT_PAX)
+        return pax_ids(node) + cell_num;
+    if (get_leaf_layout(node) == LEAF_LAYOUT_SLOTTED)
+        return reinterpret_cast<uint32_t *>(slotted_slot(node, cell_num) + SLOT_KEY_OFFSET);
+    return reinterpret_cast<uint32_t *>(static_cast<char *>(leaf_node_cell(node, cell_num)) + LEAF_NODE_KEY_OFFSET);
+}
+
+void *leaf_node_value(void *node, uint32_t cell_num) {
+    return static_cast<char *>(leaf_node_cell(node, cell_num)) + LEAF_NODE_VALUE_OFFSET;
+}
+
+// Store row, keyed on its id, in cell cell_num of a fixed size leaf.
+void leaf_node_serialize_row(void *node, uint32_t cell_num, Row *row) {
+    if (get_leaf_layout(node) == LEAF_LAYOUT_PAX) {
+        pax_ids(node)[cell_num] = row->id;
+        std::memcpy(pax_username(node, cell_num), row->username, USERNAME_SIZE);
+        std::memcpy(pax_email(node, cell_num), row->email, EMAIL_SIZE);
+        return;
+    }
+    *leaf_node_key(node, cell_num) = row->id;
+    serialize_row(row, leaf_node_value(node, cell_num));
+}
+
+void leaf_node_deserialize_row(void *node, uint32_t cell_num, Row *row) {
+    if (get_leaf_layout(node) == LEAF_LAYOUT_SLOTTED) {
+        RowView view = slotted_view_row(slotted_cell(node, cell_num));
+        row->id = view.id;
+        std::memcpy(row->username, view.username, view.username_length);
+        row->username[view.username_length] = '\0';
+        std::memcpy(row->email, view.email, view.email_length);
+        row->email[view.email_length] = '\0';
+        return;
+    }
+    if (get_leaf_layout(node) == LEAF_LAYOUT_PAX) {
+        row->id = pax_ids(node)[cell_num];
+        std::memcpy(row->username, pax_username(node, cell_num), USERNAME_SIZE);
+        std::memcpy(row->email, pax_email(node, cell_num), EMAIL_SIZE);
+        return;
+    }
+    deserialize_row(leaf_node_value(node, cell_num), row);
+}
+
+RowView leaf_node_row_view(void *node, uint32_t cell_num) {
+    if (get_leaf_layout(node) == LEAF_LAYOUT_SLOTTED)
+        return slotted_view_row(slotted_cell(node, cell_num));
+    if (get_leaf_layout(node) == LEAF_LAYOUT_PAX) {
+        RowView view;
+        view.id = pax_ids(node)[cell_num];
+        view.username = pax_username(node, cell_num);
+        view.username_length = strnlen(view.username, COLUMN_USERNAME_SIZE);
+        view.email = pax_email(node, cell_num);
+        view.email_length = strnlen(view.email, COLUMN_EMAIL_SIZE);
+        return view;
+    }
+    return view_row(leaf_node_value(node, cell_num));
+}
+
+/*
+ * What goes into a leaf: a row of the users table or an index, or the
+ * record of a created table, which is a slotted cell already and can only
+ * go into a slotted leaf.
+ */
+typedef struct {
+    Row *row; // nullptr for a record
+    const char *cell;
+    uint32_t length;
+} LeafValue;
+
+LeafValue leaf_value_row(Row *row) {
+    LeafValue value = {row, nullptr, 0};
+    return value;
+}
+
+// The slotted cell of value and its length, encoding a row into scratch.
+uint32_t leaf_value_cell(const LeafValue *value, char *scratch, const char **cell) {
+    if (value->row == nullptr) {
+        *cell = value->cell;
+        return value->length;
+    }
+    *cell = scratch;
+    return slotted_encode_row(value->row, scratch);
+}
+
+bool leaf_node_value_fits(void *node, const LeafValue *value) {
+    if (get_leaf_layout(node) == LEAF_LAYOUT_SLOTTED) {
+        char scratch[SLOTTED_MAX_CELL_SIZE];
+        const char *cell;
+        uint32_t length = leaf_value_cell(value, scratch, &cell);
+        return slotted_free_space(node) + *slotted_fragmented(node) >= length + SLOT_SIZE;
+    }
+    return *leaf_node_num_cells(node) < LEAF_NODE_MAX_CELLS;
+}
+
+bool leaf_node_has_room(void *node, Row *row) {
+    LeafValue value = leaf_value_row(row);
+    return leaf_node_value_fits(node, &value);
+}
+
+/*
+ * Copy count cells starting at source_cell into destination starting at
+ * destination_cell. Both leaves have the same fixed size layout; they may
+ * be the same leaf, with overlapping ranges.
+ */
+void leaf_node_copy_cells(void *destination, uint32_t destination_cell, void *source, uint32_t source_cell,
+                          uint32_t count) {
+    if (get_leaf_layout(source) == LEAF_LAYOUT_PAX) {
+        std::memmove(pax_ids(destination) + destination_cell, pax_ids(source) + source_cell, count * ID_SIZE);
+        std::memmove(pax_username(destination, destination_cell), pax_username(source, source_cell),
+                     count * USERNAME_SIZE);
+        std::memmove(pax_email(destination, destination_cell), pax_email(source, source_cell), count * EMAIL_SIZE);
+        return;
+    }
+    std::memmove(leaf_node_cell(destination, destination_cell), leaf_node_cell(source, source_cell),
+                 count * LEAF_NODE_CELL_SIZE);
+}
+
+/*
+ * Insert row under key at cell_num, which the caller has checked there is
+ * room for. Only slotted leaves keep the key apart from the row, in the
+ * others key has to be the row's id.
+ */
+void leaf_node_insert_value(void *node, uint32_t cell_num, uint32_t key, const LeafValue *value) {
+    if (get_leaf_layout(node) == LEAF_LAYOUT_SLOTTED) {
+        char scratch[SLOTTED_MAX_CELL_SIZE];
+        const char *cell;
+        uint32_t length = leaf_value_cell(value, scratch, &cell);
+        slotted_insert_cell(node, cell_num, key, cell, length);
+        return;
+    }
+
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (cell_num < num_cells) {
+        // make room for new cell
+        leaf_node_copy_cells(node, cell_num + 1, node, cell_num, num_cells - cell_num);
+    }
+    *leaf_node_num_cells(node) = num_cells + 1;
+    leaf_node_serialize_row(node, cell_num, value->row);
+}
+
+void leaf_node_insert_row(void *node, uint32_t cell_num, uint32_t key, Row *row) {
+    LeafValue value = leaf_value_row(row);
+    leaf_node_insert_value(node, cell_num, key, &value);
+}
+
+// Remove the row at cell_num. In a slotted leaf its bytes stay behind as a hole for slotted_compact().
+void leaf_node_remove_cell(void *node, uint32_t cell_num) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (get_leaf_layout(node) == LEAF_LAYOUT_SLOTTED) {
+        *slotted_fragmented(node) += *slotted_cell_length(node, cell_num);
+        std::memmove(slotted_slot(node, cell_num), slotted_slot(node, cell_num + 1),
+                     (num_cells - cell_num - 1) * SLOT_SIZE);
+    } else {
+        leaf_node_copy_cells(node, cell_num, node, cell_num + 1, num_cells - cell_num - 1);
+    }
+    *leaf_node_num_cells(node) = num_cells - 1;
+}
+
+void initialize_leaf_node(void *node, LeafLayout layout) {
+    std::memset(node, 0, PAGE_SIZE);
+    set_node_type(node, NODE_LEAF);
+    *(static_cast<uint8_t *>(node) + NODE_LAYOUT_OFFSET) = static_cast<uint8_t>(layout);
+    *leaf_node_num_cells(node) = 0;
+    if (layout == LEAF_LAYOUT_SLOTTED) {
+        *slotted_content_start(node) = PAGE_SIZE;
+        *slotted_fragmented(node) = 0;
+    }
+}
+
+uint32_t *internal_node_num_keys(void *node) {
+    return reinterpret_cast<uint32_t *>(static_cast<char *>(node) + INTERNAL_NODE_NUM_KEYS_OFFSET);
+}
+
+uint32_t *internal_node_right_child(void *node) {
+    return reinterpret_cast<uint32_t *>(static_cast<char *>(node) + INTERNAL_NODE_RIGHT_CHILD_OFFSET);
+}
+
+uint32_t *internal_node_cell(void *node, uint32_t cell_num) {
+    return reinterpret_cast<uint32_t *>(
+        static_cast<char *>(node) + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE);
+}
+
+uint32_t *internal_node_child(void *node, uint32_t child_num) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (child_num > num_keys) {
+        std::cout << "Tried to access child_num " << child_num << " > num_keys " << num_keys << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (child_num == num_keys)
+        return internal_node_right_child(node);
+    return internal_node_cell(node, child_num);
+}
+
+uint32_t *internal_node_key(void *node, uint32_t key_num) {
+    return internal_node_cell(node, key_num) + 1;
+}
+
+void initialize_internal_node(void *node) {
+    std::memset(node, 0, PAGE_SIZE);
+    set_node_type(node, NODE_INTERNAL);
+    *internal_node_num_keys(node) = 0;
+}
+
+// Drop child child_num along with its key, so that its right neighbour takes
+// over its range, or for the right child the child to its left does.
+void internal_node_remove_child(void *node, uint32_t child_num) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (child_num == num_keys)
+        *internal_node_right_child(node) = *internal_node_child(node, num_keys - 1);
+    else
+        std::memmove(internal_node_cell(node, child_num), internal_node_cell(node, child_num + 1),
+                     (num_keys - child_num - 1) * INTERNAL_NODE_CELL_SIZE);
+    *internal_node_num_keys(node) = num_keys - 1;
+}
+
+uint32_t *free_page_next(void *node) {
+    return reinterpret_cast<uint32_t *>(static_cast<char *>(node) + FREE_PAGE_NEXT_OFFSET);
+}
+
+
+InputBuffer *new_input_buffer() {
+    auto input_buffer = new InputBuffer();
+    input_buffer->buffer = nullptr;
+    input_buffer->buffer_length = 0;
+    input_buffer->input_length = 0;
+
+    return input_buffer;
+}
+
+void close_input_buffer(InputBuffer *input_buffer) {
+    delete input_buffer->buffer;
+    delete input_buffer;
+}
+
+
+void print_prompt() { printf("db > "); }
+
+void read_input(InputBuffer *input_buffer) {
+    ssize_t bytes_read = getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+
+    if (bytes_read <= 0) {
+        printf("Error reading input\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Ignore trailing newline
+    input_buffer->input_length = bytes_read - 1;
+    input_buffer->buffer[bytes_read - 1] = 0;
+}
+
+
+// A ? token while preparing a statement, which is recorded as its next parameter.
+bool parse_placeholder(const char *token, PreparedStatement *prepared, ParameterSlot slot) {
+    if (prepared == nullptr || std::strcmp(token, "?") != 0 || prepared->num_parameters == MAX_STATEMENT_PARAMETERS)
+        return false;
+    prepared->parameters[prepared->num_parameters++] = slot;
+    return true;
+}
+
+// Copy the next comma separated field of a values tuple, quotes and spaces stripped.
+PrepareResult parse_values_field(char **cursor, char terminator, char *destination, uint32_t size) {
+    char *start = *cursor;
+    char *end = start;
+    while (*end != 0 && *end != terminator)
+        end++;
+    if (*end != terminator)
+        return PREPARE_SYNTAX_ERROR;
+    *cursor = end + 1;
+
+    while (start < end && *start == ' ')
+        start++;
+    while (end > start && end[-1] == ' ')
+        end--;
+    if (end - start >= 2 && *start == '\'' && end[-1] == '\'') {
+        start++;
+        end--;
+    }
+    if (start == end)
+        return PREPARE_SYNTAX_ERROR;
+    if (static_cast<uint32_t>(end - start) > size)
+        return PREPARE_STRING_TOO_LONG;
+    std::memcpy(destination, start, end - start);
+    destination[end - start] = '\0';
+    return PREPARE_SUCCESS;
+}
+
+// insert values (id, username, email), (id, username, email), ... with cursor just past values
+PrepareResult prepare_insert_values(char *cursor, Statement *statement) {
+    statement->type = STATEMENT_INSERT;
+    statement->rows.clear();
+    while (true) {
+        while (*cursor == ' ')
+            cursor++;
+        if (*cursor++ != '(')
+            return PREPARE_SYNTAX_ERROR;
+
+        Row row;
+        char id_string[16];
+        PrepareResult result = parse_values_field(&cursor, ',', id_string, sizeof(id_string) - 1);
+        if (result == PREPARE_STRING_TOO_LONG)
+            result = PREPARE_SYNTAX_ERROR;
+        if (result == PREPARE_SUCCESS)
+            result = parse_values_field(&cursor, ',', row.username, COLUMN_USERNAME_SIZE);
+        if (result == PREPARE_SUCCESS)
+            result = parse_values_field(&cursor, ')', row.email, COLUMN_EMAIL_SIZE);
+        if (result != PREPARE_SUCCESS)
+            return result;
+        int id = std::atoi(id_string);
+        if (id < 0)
+            return PREPARE_NEGATIVE_ID;
+        row.id = id;
+        statement->rows.push_back(row);
+
+        while (*cursor == ' ')
+            cursor++;
+        if (*cursor == 0)
+            return PREPARE_SUCCESS;
+        if (*cursor++ != ',')
+            return PREPARE_SYNTAX_ERROR;
+    }
+}
+
+// prepared is nullptr unless the statement is being prepared, see parse_placeholder().
+PrepareResult prepare_insert(char *text, Statement *statement, PreparedStatement *prepared) {
+    if (std::strncmp(text, "insert values", 13) == 0 && prepared == nullptr)
+        return prepare_insert_values(text + std::strlen("insert values"), statement);
+    statement->type = STATEMENT_INSERT;
+    statement->rows.clear();
+    statement->row_to_insert.id = 0;
+    statement->row_to_insert.username[0] = '\0';
+    statement->row_to_insert.email[0] = '\0';
+
+    std::strtok(text, " ");
+    char* id_string =  strtok(NULL, " ");
+    char* username =  strtok(NULL, " ");
+    char* email =  strtok(NULL, " ");
+
+    if (id_string == nullptr || username == nullptr || email == nullptr) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (!parse_placeholder(id_string, prepared, PARAMETER_INSERT_ID)) {
+        int id = std::atoi(id_string);
+        if (id < 0)
+            return PREPARE_NEGATIVE_ID;
+        statement->row_to_insert.id = id;
+    }
+    if (!parse_placeholder(username, prepared, PARAMETER_INSERT_USERNAME)) {
+        if (std::strlen(username) > COLUMN_USERNAME_SIZE)
+            return PREPARE_STRING_TOO_LONG;
+        std::strcpy(statement->row_to_insert.username, username);
+    }
+    if (!parse_placeholder(email, prepared, PARAMETER_INSERT_EMAIL)) {
+        if (std::strlen(email) > COLUMN_EMAIL_SIZE)
+            return PREPARE_STRING_TOO_LONG;
+        std::strcpy(statement->row_to_insert.email, email);
+    }
+
+    return PREPARE_SUCCESS;
+}
+
+// Table and column names: a letter or _, then letters, digits and _.
+bool parse_name(const char *name, size_t length) {
+    if (length == 0 || length > TABLE_NAME_SIZE || std::isdigit(static_cast<unsigned char>(name[0])))
+        return false;
+    for (size_t i = 0; i < length; i++) {
+        if (!std::isalnum(static_cast<unsigned char>(name[i])) && name[i] != '_')
+            return false;
+    }
+    return true;
+}
+
+// The fields of the next (value, value, ...) tuple of insert into.
+PrepareResult parse_values_tuple(char **cursor, std::vector<std::string> *fields) {
+    while (**cursor == ' ')
+        (*cursor)++;
+    if (*(*cursor)++ != '(')
+        return PREPARE_SYNTAX_ERROR;
+    char terminator = ',';
+    while (terminator == ',') {
+        char *end = std::strpbrk(*cursor, ",)");
+        if (end == nullptr)
+            return PREPARE_SYNTAX_ERROR;
+        terminator = *end;
+        char field[COLUMN_TEXT_MAX_SIZE + 1];
+        PrepareResult result = parse_values_field(cursor, terminator, field, COLUMN_TEXT_MAX_SIZE);
+        if (result != PREPARE_SUCCESS)
+            return result;
+        fields->push_back(field);
+    }
+    return PREPARE_SUCCESS;
+}
+
+/*
+ * insert into <table> values (value, ...), (value, ...), ...
+ *
+ * with the values checked against the columns of the table once it runs.
+ * insert into users takes the rows of insert values.
+ */
+PrepareResult prepare_insert_into(char *text, Statement *statement) {
+    statement->type = STATEMENT_INSERT;
+    statement->rows.clear();
+    statement->records.clear();
+    char *name = text + std::strlen("insert into ");
+    char *cursor = std::strchr(name, ' ');
+    if (cursor == nullptr || std::strncmp(cursor, " values", 7) != 0 || !parse_name(name, cursor - name))
+        return PREPARE_SYNTAX_ERROR;
+    statement->table.assign(name, cursor - name);
+    cursor += std::strlen(" values");
+    if (statement->table == "users") {
+        statement->table.clear();
+        return prepare_insert_values(cursor, statement);
+    }
+
+    while (true) {
+        statement->records.emplace_back();
+        PrepareResult result = parse_values_tuple(&cursor, &(statement->records.back()));
+        if (result != PREPARE_SUCCESS)
+            return result;
+        while (*cursor == ' ')
+            cursor++;
+        if (*cursor == 0)
+            return PREPARE_SUCCESS;
+        if (*cursor++ != ',')
+            return PREPARE_SYNTAX_ERROR;
+    }
+}
+
+bool parse_compare_op(const char *op, CompareOp *result) {
+    static const char *names[] = {"=", "!=", "<", "<=", ">", ">="};
+    for (uint32_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (std::strcmp(op, names[i]) == 0) {
+            *result = static_cast<CompareOp>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * select
+ * select where id <op> N, with <op> one of = != < <= > >=
+ * select where id between A and B
+ * select where username = 'name'
+ * select where email = 'address'
+ *
+ * each optionally followed by order by id [asc|desc] and then limit N, or
+ * with count(*), min(id), max(id) or sum(id) after select
+ *
+ * select * from <table>, optionally followed by where and limit N as
+ * above, with the table's first column in place of id; select * from
+ * users is plain select
+ */
+AccessPath plan_select(const Predicate *where) {
+    if (where->column == PREDICATE_USERNAME || where->column == PREDICATE_EMAIL)
+        return ACCESS_INDEX_LOOKUP;
+    if (where->column != PREDICATE_ID)
+        return ACCESS_FULL_SCAN;
+    return where->op == COMPARE_EQ ? ACCESS_ID_LOOKUP : ACCESS_RANGE_SCAN;
+}
+
+PrepareResult prepare_where(const char *column, char *value, Statement *statement, PreparedStatement *prepared) {
+    if (std::strcmp(column, "id") == 0) {
+        statement->where.column = PREDICATE_ID;
+        statement->where.id = 0;
+        if (parse_placeholder(value, prepared, PARAMETER_WHERE_ID))
+            return PREPARE_SUCCESS;
+        int id = std::atoi(value);
+        if (id < 0)
+            return PREPARE_NEGATIVE_ID;
+        statement->where.id = id;
+        return PREPARE_SUCCESS;
+    }
+
+    bool username = std::strcmp(column, "username") == 0;
+    if ((username || std::strcmp(column, "email") == 0) && statement->where.op == COMPARE_EQ) {
+        statement->where.column = username ? PREDICATE_USERNAME : PREDICATE_EMAIL;
+        statement->where.text[0] = '\0';
+        statement->where.text_length = 0;
+        if (parse_placeholder(value, prepared, username ? PARAMETER_WHERE_USERNAME : PARAMETER_WHERE_EMAIL))
+            return PREPARE_SUCCESS;
+        // the quotes are optional
+        size_t length = std::strlen(value);
+        if (length >= 2 && value[0] == '\'' && value[length - 1] == '\'') {
+            value += 1;
+            length -= 2;
+        }
+        if (length > (username ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE))
+            return PREPARE_STRING_TOO_LONG;
+        std::memcpy(statement->where.text, value, length);
+        statement->where.text[length] = '\0';
+        statement->where.text_length = length;
+        return PREPARE_SUCCESS;
+    }
+
+    return PREPARE_SYNTAX_ERROR;
+}
+
+bool parse_aggregate(const char *name, Aggregate *result) {
+    static const char *names[] = {"count(*)", "min(id)", "max(id)", "sum(id)"};
+    for (uint32_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (std::strcmp(name, names[i]) == 0) {
+            *result = static_cast<Aggregate>(AGGREGATE_COUNT + i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// The upper end of id between A and B, already parsed as id >= A.
+PrepareResult prepare_where_high(char *value, Statement *statement, PreparedStatement *prepared) {
+    statement->where.id_high = 0;
+    if (parse_placeholder(value, prepared, PARAMETER_WHERE_ID_HIGH))
+        return PREPARE_SUCCESS;
+    int id = std::atoi(value);
+    if (id < 0)
+        return PREPARE_NEGATIVE_ID;
+    statement->where.id_high = id;
+    return PREPARE_SUCCESS;
+}
+
+// <column> <op> <value> or id between A and B, the tokens after where.
+PrepareResult prepare_where_clause(Statement *statement, PreparedStatement *prepared) {
+    const char *column = std::strtok(nullptr, " ");
+    char *op = std::strtok(nullptr, " ");
+    char *value = std::strtok(nullptr, " ");
+    if (column == nullptr || op == nullptr || value == nullptr)
+        return PREPARE_SYNTAX_ERROR;
+    // the key column of a created table stands in for id, execute checks its name
+    if (!statement->table.empty()) {
+        statement->where_column = column;
+        column = "id";
+    }
+    if (std::strcmp(op, "between") != 0) {
+        if (!parse_compare_op(op, &(statement->where.op)))
+            return PREPARE_SYNTAX_ERROR;
+        return prepare_where(column, value, statement, prepared);
+    }
+
+    char *conjunction = std::strtok(nullptr, " ");
+    char *high = std::strtok(nullptr, " ");
+    if (std::strcmp(column, "id") != 0 || conjunction == nullptr || high == nullptr ||
+        std::strcmp(conjunction, "and") != 0)
+        return PREPARE_SYNTAX_ERROR;
+    statement->where.op = COMPARE_GE;
+    PrepareResult result = prepare_where(column, value, statement, prepared);
+    PrepareResult high_result = prepare_where_high(high, statement, prepared);
+    return result == PREPARE_SUCCESS ? high_result : result;
+}
+
+PrepareResult prepare_select(char *text, Statement *statement, PreparedStatement *prepared) {
+    statement->type = STATEMENT_SELECT;
+    statement->where.column = PREDICATE_NONE;
+    statement->where.id_high = UINT32_MAX;
+    statement->order.descending = false;
+    statement->order.limit = SELECT_NO_LIMIT;
+    statement->aggregate = AGGREGATE_NONE;
+    statement->access_path = ACCESS_FULL_SCAN;
+    statement->table.clear();
+
+    std::strtok(text, " ");
+    char *token = std::strtok(nullptr, " ");
+    if (token != nullptr && (parse_aggregate(token, &(statement->aggregate)) || std::strcmp(token, "*") == 0))
+        token = std::strtok(nullptr, " ");
+    if (token != nullptr && std::strcmp(token, "from") == 0) {
+        char *name = std::strtok(nullptr, " ");
+        if (name == nullptr || !parse_name(name, std::strlen(name)))
+            return PREPARE_SYNTAX_ERROR;
+        if (std::strcmp(name, "users") != 0)
+            statement->table = name;
+        token = std::strtok(nullptr, " ");
+    }
+    PrepareResult result = PREPARE_SUCCESS;
+    if (token != nullptr && std::strcmp(token, "where") == 0) {
+        result = prepare_where_clause(statement, prepared);
+        if (result == PREPARE_SYNTAX_ERROR)
+            return result;
+        token = std::strtok(nullptr, " ");
+    }
+
+    if (token != nullptr && std::strcmp(token, "order") == 0) {
+        char *by = std::strtok(nullptr, " ");
+        char *column = std::strtok(nullptr, " ");
+        if (by == nullptr || column == nullptr || std::strcmp(by, "by") != 0 || std::strcmp(column, "id") != 0)
+            return PREPARE_SYNTAX_ERROR;
+        token = std::strtok(nullptr, " ");
+        if (token != nullptr && (std::strcmp(token, "asc") == 0 || std::strcmp(token, "desc") == 0)) {
+            statement->order.descending = token[0] == 'd';
+            token = std::strtok(nullptr, " ");
+        }
+    }
+
+    if (token != nullptr && std::strcmp(token, "limit") == 0) {
+        char *limit = std::strtok(nullptr, " ");
+        if (limit == nullptr || limit[0] == '\0' || std::strspn(limit, "0123456789") != std::strlen(limit))
+            return PREPARE_SYNTAX_ERROR;
+        statement->order.limit = std::min(std::strtoull(limit, nullptr, 10), static_cast<unsigned long long>(UINT32_MAX));
+        token = std::strtok(nullptr, " ");
+    }
+
+    // an aggregate has one row to order or limit, and a created table
+    // only comes in key order
+    if (token != nullptr || (statement->aggregate != AGGREGATE_NONE &&
+                             (statement->order.descending || statement->order.limit != SELECT_NO_LIMIT)))
+        return PREPARE_SYNTAX_ERROR;
+    if (!statement->table.empty() && (statement->aggregate != AGGREGATE_NONE || statement->order.descending))
+        return PREPARE_SYNTAX_ERROR;
+    statement->access_path = plan_select(&(statement->where));
+    return result;
+}
+
+// username = 'name' or email = 'address' of update set, the new value going into row_to_insert.
+PrepareResult prepare_set(char *column, char *value, Statement *statement, PreparedStatement *prepared) {
+    bool username = std::strcmp(column, "username") == 0;
+    if (!username && std::strcmp(column, "email") != 0)
+        return PREPARE_SYNTAX_ERROR;
+    if (username)
+        statement->set_username = true;
+    else
+        statement->set_email = true;
+    if (parse_placeholder(value, prepared, username ? PARAMETER_INSERT_USERNAME : PARAMETER_INSERT_EMAIL))
+        return PREPARE_SUCCESS;
+    // the quotes are optional
+    size_t length = std::strlen(value);
+    if (length >= 2 && value[0] == '\'' && value[length - 1] == '\'') {
+        value += 1;
+        length -= 2;
+    }
+    if (length == 0)
+        return PREPARE_SYNTAX_ERROR;
+    if (length > (username ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE))
+        return PREPARE_STRING_TOO_LONG;
+    char *destination = username ? statement->row_to_insert.username : statement->row_to_insert.email;
+    std::memcpy(destination, value, length);
+    destination[length] = '\0';
+    return PREPARE_SUCCESS;
+}
+
+/*
+ * update set <column> = <value>[, <column> = <value>] where ...
+ * delete where ...
+ *
+ * with the same where clauses as select, which also picks the rows the
+ * same way. The where clause is not optional.
+ */
+void prepare_modify(Statement *statement, StatementType type) {
+    statement->type = type;
+    statement->where.column = PREDICATE_NONE;
+    statement->where.id_high = UINT32_MAX;
+    statement->order.descending = false;
+    statement->order.limit = SELECT_NO_LIMIT;
+    statement->aggregate = AGGREGATE_NONE;
+    statement->set_username = false;
+    statement->set_email = false;
+    statement->row_to_insert.id = 0;
+    statement->row_to_insert.username[0] = '\0';
+    statement->row_to_insert.email[0] = '\0';
+    statement->rows.clear();
+}
+
+PrepareResult prepare_update(char *text, Statement *statement, PreparedStatement *prepared) {
+    prepare_modify(statement, STATEMENT_UPDATE);
+    std::strtok(text, " ");
+    char *token = std::strtok(nullptr, " ");
+    if (token == nullptr || std::strcmp(token, "set") != 0)
+        return PREPARE_SYNTAX_ERROR;
+
+    PrepareResult result = PREPARE_SUCCESS;
+    bool more = true;
+    token = std::strtok(nullptr, " ");
+    while (more) {
+        char *column = token;
+        char *equals = std::strtok(nullptr, " ");
+        char *value = std::strtok(nullptr, " ");
+        if (column == nullptr || equals == nullptr || value == nullptr || std::strcmp(equals, "=") != 0)
+            return PREPARE_SYNTAX_ERROR;
+        // the comma ends the value or stands on its own
+        size_t length = std::strlen(value);
+        more = value[length - 1] == ',';
+        if (more)
+            value[length - 1] = '\0';
+        token = std::strtok(nullptr, " ");
+        if (!more && token != nullptr && std::strcmp(token, ",") == 0) {
+            more = true;
+            token = std::strtok(nullptr, " ");
+        }
+        PrepareResult set_result = prepare_set(column, value, statement, prepared);
+        if (set_result == PREPARE_SYNTAX_ERROR)
+            return set_result;
+        if (result == PREPARE_SUCCESS)
+            result = set_result;
+    }
+
+    if (token == nullptr || std::strcmp(token, "where") != 0)
+        return PREPARE_SYNTAX_ERROR;
+    PrepareResult where_result = prepare_where_clause(statement, prepared);
+    if (where_result == PREPARE_SYNTAX_ERROR || std::strtok(nullptr, " ") != nullptr)
+        return PREPARE_SYNTAX_ERROR;
+    statement->access_path = plan_select(&(statement->where));
+    return result == PREPARE_SUCCESS ? where_result : result;
+}
+
+PrepareResult prepare_delete(char *text, Statement *statement, PreparedStatement *prepared) {
+    prepare_modify(statement, STATEMENT_DELETE);
+    std::strtok(text, " ");
+    char *token = std::strtok(nullptr, " ");
+    if (token == nullptr || std::strcmp(token, "where") != 0)
+        return PREPARE_SYNTAX_ERROR;
+    PrepareResult result = prepare_where_clause(statement, prepared);
+    if (result == PREPARE_SYNTAX_ERROR || std::strtok(nullptr, " ") != nullptr)
+        return PREPARE_SYNTAX_ERROR;
+    statement->access_path = plan_select(&(statement->where));
+    return result;
+}
+
+// create index on username|email
+PrepareResult prepare_create_index(char *text, Statement *statement) {
+    statement->type = STATEMENT_CREATE_INDEX;
+    std::strtok(text, " ");
+    char *index = std::strtok(nullptr, " ");
+    char *on = std::strtok(nullptr, " ");
+    char *column = std::strtok(nullptr, " ");
+    if (index == nullptr || on == nullptr || column == nullptr || std::strtok(nullptr, " ") != nullptr ||
+        std::strcmp(index, "index") != 0 || std::strcmp(on, "on") != 0)
+        return PREPARE_SYNTAX_ERROR;
+
+    if (std::strcmp(column, "username") == 0) {
+        statement->index_column = INDEX_USERNAME;
+    } else if (std::strcmp(column, "email") == 0) {
+        statement->index_column = INDEX_EMAIL;
+    } else {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
+
+// int, text(N) or char(N), N from 1 to COLUMN_TEXT_MAX_SIZE
+bool parse_column_type(const char *type, Column *column) {
+    if (std::strcmp(type, "int") == 0) {
+        column->type = COLUMN_INT;
+        column->size = sizeof(int64_t);
+        return true;
+    }
+    if (std::strncmp(type, "text(", 5) == 0)
+        column->type = COLUMN_TEXT;
+    else if (std::strncmp(type, "char(", 5) == 0)
+        column->type = COLUMN_CHAR;
+    else
+        return false;
+    const char *digits = type + 5;
+    size_t count = std::strspn(digits, "0123456789");
+    if (count == 0 || count > 3 || std::strcmp(digits + count, ")") != 0)
+        return false;
+    column->size = std::atoi(digits);
+    return column->size >= 1 && column->size <= COLUMN_TEXT_MAX_SIZE;
+}
+
+/*
+ * create table <name> (<column> <type>, <column> <type>, ...)
+ *
+ * with a type out of parse_column_type(). The first column has to be an
+ * int: it is the key of the table, unique and from 0 to 2^32 - 1.
+ */
+PrepareResult prepare_create_table(char *text, Statement *statement) {
+    statement->type = STATEMENT_CREATE_TABLE;
+    statement->columns.clear();
+    char *name = text + std::strlen("create table ");
+    char *open = std::strchr(name, '(');
+    char *close = std::strrchr(name, ')');
+    if (open == nullptr || close == nullptr || close < open || close[1] != '\0')
+        return PREPARE_SYNTAX_ERROR;
+    char *name_end = open;
+    while (name_end > name && name_end[-1] == ' ')
+        name_end--;
+    if (!parse_name(name, name_end - name))
+        return PREPARE_SYNTAX_ERROR;
+    statement->table.assign(name, name_end - name);
+
+    *close = '\0';
+    uint32_t max_size = 0;
+    for (char *definition = std::strtok(open + 1, ","); definition != nullptr;
+         definition = std::strtok(nullptr, ",")) {
+        Column column;
+        char column_name[64];
+        char type[64];
+        char rest[2];
+        if (statement->columns.size() == MAX_TABLE_COLUMNS ||
+            std::sscanf(definition, " %63s %63s %1s", column_name, type, rest) != 2 ||
+            !parse_name(column_name, std::strlen(column_name)) || !parse_column_type(type, &column))
+            return PREPARE_SYNTAX_ERROR;
+        for (const Column &other : statement->columns) {
+            if (std::strcmp(other.name, column_name) == 0)
+                return PREPARE_SYNTAX_ERROR;
+        }
+        std::strcpy(column.name, column_name);
+        column.offset = 0;
+        max_size += column.size + (column.type == COLUMN_TEXT ? 1 : 0);
+        statement->columns.push_back(column);
+    }
+    if (statement->columns.empty() || statement->columns[0].type != COLUMN_INT)
+        return PREPARE_SYNTAX_ERROR;
+    return max_size > RECORD_MAX_SIZE ? PREPARE_ROW_TOO_LONG : PREPARE_SUCCESS;
+}
+
+PrepareResult parse_statement(char *text, Statement *statement, PreparedStatement *prepared) {
+    if (std::strncmp(text, "insert into ", 12) == 0)
+        return prepare_insert_into(text, statement);
+
+    if (std::strncmp(text, "insert", 6) == 0)
+        return prepare_insert(text, statement, prepared);
+
+
+    if (std::strcmp(text, "select") == 0 || std::strncmp(text, "select ", 7) == 0)
+        return prepare_select(text, statement, prepared);
+
+    if (std::strncmp(text, "create table ", 13) == 0)
+        return prepare_create_table(text, statement);
+
+    if (std::strncmp(text, "create ", 7) == 0)
+        return prepare_create_index(text, statement);
+
+    if (std::strcmp(text, "update") == 0 || std::strncmp(text, "update ", 7) == 0)
+        return prepare_update(text, statement, prepared);
+
+    if (std::strcmp(text, "delete") == 0 || std::strncmp(text, "delete ", 7) == 0)
+        return prepare_delete(text, statement, prepared);
+
+    if (std::strcmp(text, "begin") == 0) {
+        statement->type = STATEMENT_BEGIN;
+        return PREPARE_SUCCESS;
+    }
+    if (std::strcmp(text, "commit") == 0) {
+        statement->type = STATEMENT_COMMIT;
+        return PREPARE_SUCCESS;
+    }
+
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+/*
+ * Parse text into a prepared statement, or find the one it was parsed into
+ * before. Returns nullptr, with the reason in result, if it does not parse.
+ */
+PreparedStatement *statement_cache_prepare(StatementCache *cache, const char *text, PrepareResult *result) {
+    auto entry = cache->by_text.find(text);
+    if (entry != cache->by_text.end()) {
+        *result = PREPARE_SUCCESS;
+        return entry->second;
+    }
+
+    // parsing cuts up its input
+    std::vector<char> copy(text, text + std::strlen(text) + 1);
+    PreparedStatement *prepared = new PreparedStatement();
+    prepared->num_parameters = 0;
+    *result = parse_statement(copy.data(), &(prepared->statement), prepared);
+    if (*result != PREPARE_SUCCESS) {
+        delete prepared;
+        return nullptr;
+    }
+    cache->by_handle.push_back(prepared);
+    prepared->handle = cache->by_handle.size();
+    cache->by_text[text] = prepared;
+    return prepared;
+}
+
+PreparedStatement *statement_cache_find(StatementCache *cache, uint32_t handle) {
+    if (handle == 0 || handle > cache->by_handle.size())
+        return nullptr;
+    return cache->by_handle[handle - 1];
+}
+
+void statement_cache_clear(StatementCache *cache) {
+    for (PreparedStatement *prepared : cache->by_handle)
+        delete prepared;
+    cache->by_handle.clear();
+    cache->by_text.clear();
+}
+
+// Bind id to the index'th placeholder (from 0), which has to stand for an id.
+PrepareResult bind_id(PreparedStatement *prepared, uint32_t index, uint32_t id) {
+    if (index >= prepared->num_parameters)
+        return PREPARE_SYNTAX_ERROR;
+    switch (prepared->parameters[index]) {
+        case PARAMETER_INSERT_ID:
+            prepared->statement.row_to_insert.id = id;
+            return PREPARE_SUCCESS;
+        case PARAMETER_WHERE_ID:
+            prepared->statement.where.id = id;
+            return PREPARE_SUCCESS;
+        case PARAMETER_WHERE_ID_HIGH:
+            prepared->statement.where.id_high = id;
+            return PREPARE_SUCCESS;
+        default:
+            return PREPARE_SYNTAX_ERROR;
+    }
+}
+
+// Bind length bytes of value to the index'th placeholder, which has to stand for a string.
+PrepareResult bind_text(PreparedStatement *prepared, uint32_t index, const char *value, uint32_t length) {
+    if (index >= prepared->num_parameters)
+        return PREPARE_SYNTAX_ERROR;
+    char *destination;
+    uint32_t size;
+    switch (prepared->parameters[index]) {
+        case PARAMETER_INSERT_USERNAME:
+            destination = prepared->statement.row_to_insert.username;
+            size = COLUMN_USERNAME_SIZE;
+            break;
+        case PARAMETER_INSERT_EMAIL:
+            destination = prepared->statement.row_to_insert.email;
+            size = COLUMN_EMAIL_SIZE;
+            break;
+        case PARAMETER_WHERE_USERNAME:
+            destination = prepared->statement.where.text;
+            size = COLUMN_USERNAME_SIZE;
+            break;
+        case PARAMETER_WHERE_EMAIL:
+            destination = prepared->statement.where.text;
+            size = COLUMN_EMAIL_SIZE;
+            break;
+        default:
+            return PREPARE_SYNTAX_ERROR;
+    }
+    if (length > size)
+        return PREPARE_STRING_TOO_LONG;
+    std::memcpy(destination, value, length);
+    destination[length] = '\0';
+    if (prepared->parameters[index] == PARAMETER_WHERE_USERNAME ||
+        prepared->parameters[index] == PARAMETER_WHERE_EMAIL)
+        prepared->statement.where.text_length = length;
+    return PREPARE_SUCCESS;
+}
+
+// execute <handle> <value>..., binding one value per placeholder in order.
+PrepareResult prepare_execute(char *text, Statement *statement, StatementCache *cache) {
+    std::strtok(text, " ");
+    char *handle = std::strtok(nullptr, " ");
+    if (handle == nullptr)
+        return PREPARE_SYNTAX_ERROR;
+    PreparedStatement *prepared = statement_cache_find(cache, std::atoi(handle));
+    if (prepared == nullptr)
+        return PREPARE_NO_SUCH_STATEMENT;
+
+    for (uint32_t i = 0; i < prepared->num_parameters; i++) {
+        char *value = std::strtok(nullptr, " ");
+        if (value == nullptr)
+            return PREPARE_SYNTAX_ERROR;
+        PrepareResult result;
+        ParameterSlot slot = prepared->parameters[i];
+        if (slot == PARAMETER_INSERT_ID || slot == PARAMETER_WHERE_ID || slot == PARAMETER_WHERE_ID_HIGH) {
+            int id = std::atoi(value);
+            if (id < 0)
+                return PREPARE_NEGATIVE_ID;
+            result = bind_id(prepared, i, id);
+        } else {
+            size_t length = std::strlen(value);
+            if (length >= 2 && value[0] == '\'' && value[length - 1] == '\'') {
+                value += 1;
+                length -= 2;
+            }
+            result = bind_text(prepared, i, value, std::min(length, static_cast<size_t>(UINT32_MAX)));
+        }
+        if (result != PREPARE_SUCCESS)
+            return result;
+    }
+    if (std::strtok(nullptr, " ") != nullptr)
+        return PREPARE_SYNTAX_ERROR;
+
+    *statement = prepared->statement;
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement, StatementCache *cache) {
+    if (std::strncmp(input_buffer->buffer, "execute ", 8) == 0)
+        return prepare_execute(input_buffer->buffer, statement, cache);
+    return parse_statement(input_buffer->buffer, statement, nullptr);
+}
+
+typedef void (*RowCallback)(const RowView *row, void *context);
+// the result of an aggregate, nullptr for the min or max of no rows
+typedef void (*ValueCallback)(const uint64_t *value, void *context);
+// a row of a created table, a value per column of schema
+typedef void (*RecordCallback)(const Schema *schema, const Value *values, void *context);
+
+/*
+ * Where the rows of a select go. Rows arrive one at a time in id order, or
+ * an aggregate sends a single value instead; finish() ends the result and
+ * hands over anything still buffered. The rows of a created table come as
+ * records.
+ */
+class ResultSink {
+public:
+    virtual ~ResultSink() {}
+
+    virtual void row(const RowView *row) = 0;
+
+    virtual void value(const uint64_t *value) = 0;
+
+    virtual void record(const Schema *schema, const Value *values) = 0;
+
+    virtual void finish() {}
+};
+
+const uint32_t RESULT_BUFFER_SIZE = 1 << 16;
+// "(id, username, email)\n" at its longest
+const uint32_t TEXT_ROW_MAX_SIZE = 10 + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE + 7;
+
+/*
+ * Rows as "(id, username, email)" lines, formatted straight from the page
+ * bytes into one buffer that goes out with a single fwrite once full. It
+ * shares stdout's stream with the prompt and status lines, so they stay in
+ * order.
+ */
+class TextSink : public ResultSink {
+public:
+    explicit TextSink(FILE *file) : file_(file), used_(0) {}
+
+    ~TextSink() override { finish(); }
+
+    void row(const RowView *row) override {
+        if (used_ + TEXT_ROW_MAX_SIZE > RESULT_BUFFER_SIZE)
+            flush();
+        char *out = buffer_ + used_;
+        *out++ = '(';
+        out = format_number(out, row->id);
+        *out++ = ',';
+        *out++ = ' ';
+        std::memcpy(out, row->username, row->username_length);
+        out += row->username_length;
+        *out++ = ',';
+        *out++ = ' ';
+        std::memcpy(out, row->email, row->email_length);
+        out += row->email_length;
+        *out++ = ')';
+        *out++ = '\n';
+        used_ = out - buffer_;
+    }
+
+    // "(value)", or "(NULL)"
+    void value(const uint64_t *value) override {
+        if (used_ + TEXT_ROW_MAX_SIZE > RESULT_BUFFER_SIZE)
+            flush();
+        char *out = buffer_ + used_;
+        *out++ = '(';
+        if (value != nullptr) {
+            out = format_number(out, *value);
+        } else {
+            std::memcpy(out, "NULL", 4);
+            out += 4;
+        }
+        *out++ = ')';
+        *out++ = '\n';
+        used_ = out - buffer_;
+    }
+
+    // "(value, value, ...)"
+    void record(const Schema *schema, const Value *values) override {
+        // 20 digits and a sign for an int, ", " after every column
+        if (used_ + schema->max_size + schema->num_columns * 23 + 2 > RESULT_BUFFER_SIZE)
+            flush();
+        char *out = buffer_ + used_;
+        *out++ = '(';
+        for (uint32_t i = 0; i < schema->num_columns; i++) {
+            if (i > 0) {
+                *out++ = ',';
+                *out++ = ' ';
+            }
+            if (schema->columns[i].type != COLUMN_INT) {
+                std::memcpy(out, values[i].text, values[i].length);
+                out += values[i].length;
+            } else if (values[i].number < 0) {
+                *out++ = '-';
+                out = format_number(out, 0 - static_cast<uint64_t>(values[i].number));
+            } else {
+                out = format_number(out, values[i].number);
+            }
+        }
+        *out++ = ')';
+        *out++ = '\n';
+        used_ = out - buffer_;
+    }
+
+    void finish() override { flush(); }
+
+private:
+    static char *format_number(char *out, uint64_t number) {
+        char digits[20];
+        uint32_t count = 0;
+        do {
+            digits[count++] = static_cast<char>('0' + number % 10);
+            number /= 10;
+        } while (number != 0);
+        while (count > 0)
+            *out++ = digits[--count];
+        return out;
+    }
+
+    void flush() {
+        if (used_ == 0)
+            return;
+        if (fwrite(buffer_, 1, used_, file_) != used_) {
+            printf("Error writing result: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        used_ = 0;
+    }
+
+    FILE *file_;
+    uint32_t used_;
+    char buffer_[RESULT_BUFFER_SIZE];
+};
+
+const uint32_t COLUMN_BLOCK_ROWS = 1024;
+const uint32_t COLUMN_BLOCK_VALUE = UINT32_MAX;
+const uint32_t COLUMN_BLOCK_RECORDS = UINT32_MAX - 1;
+
+/*
+ * Rows in column blocks of up to COLUMN_BLOCK_ROWS, each laid out as
+ *
+ *   uint32 count
+ *   uint32 id[count]
+ *   uint32 username_length[count]
+ *   uint32 email_length[count]
+ *   the usernames, back to back
+ *   the emails, back to back
+ *
+ * in host byte order. A block with a count of 0 ends the result. The value
+ * of an aggregate takes a block of its own, with a count of
+ * COLUMN_BLOCK_VALUE followed by a uint32 that is 0 for no value and 1
+ * otherwise, and the value as a uint64. The rows of a created table come
+ * in blocks of COLUMN_BLOCK_RECORDS, the row count, and then per column
+ * either int64 value[count] or uint32 length[count] and the texts back to
+ * back.
+ */
+class ColumnSink : public ResultSink {
+public:
+    explicit ColumnSink(FILE *file) : file_(file), schema_(nullptr), records_(0) {}
+
+    void row(const RowView *row) override {
+        ids_.push_back(row->id);
+        username_lengths_.push_back(row->username_length);
+        email_lengths_.push_back(row->email_length);
+        usernames_.insert(usernames_.end(), row->username, row->username + row->username_length);
+        emails_.insert(emails_.end(), row->email, row->email + row->email_length);
+        if (ids_.size() == COLUMN_BLOCK_ROWS)
+            write_block();
+    }
+
+    void value(const uint64_t *value) override {
+        uint32_t present = value != nullptr;
+        uint64_t number = present ? *value : 0;
+        write(&COLUMN_BLOCK_VALUE, sizeof(COLUMN_BLOCK_VALUE));
+        write(&present, sizeof(present));
+        write(&number, sizeof(number));
+    }
+
+    void record(const Schema *schema, const Value *values) override {
+        if (schema != schema_) {
+            write_records();
+            schema_ = schema;
+            record_columns_.assign(schema->num_columns, std::vector<char>());
+            record_lengths_.assign(schema->num_columns, std::vector<uint32_t>());
+        }
+        for (uint32_t i = 0; i < schema->num_columns; i++) {
+            std::vector<char> *column = &(record_columns_[i]);
+            if (schema->columns[i].type == COLUMN_INT) {
+                const char *number = reinterpret_cast<const char *>(&(values[i].number));
+                column->insert(column->end(), number, number + sizeof(int64_t));
+            } else {
+                record_lengths_[i].push_back(values[i].length);
+                column->insert(column->end(), values[i].text, values[i].text + values[i].length);
+            }
+        }
+        records_ += 1;
+        if (records_ == COLUMN_BLOCK_ROWS)
+            write_records();
+    }
+
+    void finish() override {
+        write_records();
+        if (!ids_.empty())
+            write_block();
+        write_block();
+    }
+
+private:
+    void write(const void *data, size_t length) {
+        if (length > 0 && fwrite(data, 1, length, file_) != length) {
+            printf("Error writing result: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    void write_block() {
+        uint32_t count = ids_.size();
+        write(&count, sizeof(count));
+        write(ids_.data(), count * sizeof(uint32_t));
+        write(username_lengths_.data(), count * sizeof(uint32_t));
+        write(email_lengths_.data(), count * sizeof(uint32_t));
+        write(usernames_.data(), usernames_.size());
+        write(emails_.data(), emails_.size());
+        ids_.clear();
+        username_lengths_.clear();
+        email_lengths_.clear();
+        usernames_.clear();
+        emails_.clear();
+    }
+
+    void write_records() {
+        if (records_ == 0)
+            return;
+        write(&COLUMN_BLOCK_RECORDS, sizeof(COLUMN_BLOCK_RECORDS));
+        write(&records_, sizeof(records_));
+        for (uint32_t i = 0; i < schema_->num_columns; i++) {
+            write(record_lengths_[i].data(), record_lengths_[i].size() * sizeof(uint32_t));
+            write(record_columns_[i].data(), record_columns_[i].size());
+            record_lengths_[i].clear();
+            record_columns_[i].clear();
+        }
+        records_ = 0;
+    }
+
+    FILE *file_;
+    std::vector<uint32_t> ids_;
+    std::vector<uint32_t> username_lengths_;
+    std::vector<uint32_t> email_lengths_;
+    std::vector<char> usernames_;
+    std::vector<char> emails_;
+    const Schema *schema_;
+    uint32_t records_;
+    std::vector<std::vector<char>> record_columns_;
+    std::vector<std::vector<uint32_t>> record_lengths_;
+};
+
+// Hands every row to a function, for code that embeds the database.
+class CallbackSink : public ResultSink {
+public:
+    CallbackSink(RowCallback row_callback, ValueCallback value_callback, void *context,
+                 RecordCallback record_callback = nullptr)
+        : row_callback_(row_callback), value_callback_(value_callback), record_callback_(record_callback),
+          context_(context) {}
+
+    void row(const RowView *row) override { row_callback_(row, context_); }
+
+    void value(const uint64_t *value) override { value_callback_(value, context_); }
+
+    // dropped without a record_callback
+    void record(const Schema *schema, const Value *values) override {
+        if (record_callback_ != nullptr)
+            record_callback_(schema, values, context_);
+    }
+
+private:
+    RowCallback row_callback_;
+    ValueCallback value_callback_;
+    RecordCallback record_callback_;
+    void *context_;
+};
+
+void wal_checksum(const char *data, uint32_t length, uint32_t *s0, uint32_t *s1) {
+    // length is always a multiple of 8
+    for (uint32_t i = 0; i < length; i += 2 * sizeof(uint32_t)) {
+        uint32_t x0, x1;
+        std::memcpy(&x0, data + i, sizeof(uint32_t));
+        std::memcpy(&x1, data + i + sizeof(uint32_t), sizeof(uint32_t));
+        *s0 += x0 + *s1;
+        *s1 += x1 + *s0;
+    }
+}
+
+void wal_write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_written = write(fd, data, length);
+        stats_add(STAT_SYSCALLS, 1);
+        if (bytes_written == -1) {
+            if (errno == EINTR)
+                continue;
+            printf("Error writing log: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        stats_add(STAT_BYTES_WRITTEN, bytes_written);
+        data += bytes_written;
+        length -= bytes_written;
+    }
+}
+
+void wal_flusher_main(Wal *wal) {
+    std::unique_lock<std::mutex> guard(wal->lock);
+    while (true) {
+        wal->flush_needed.wait(guard, [wal] {
+            return wal->shutting_down || wal->flush_requested_lsn > wal->durable_lsn;
+        });
+        if (wal->flush_requested_lsn <= wal->durable_lsn)
+            return;
+
+        // take everything appended so far, including commits that arrived
+        // after the one that woke us up
+        wal->flush_buffer.swap(wal->buffer);
+        uint64_t batch_lsn = wal->last_lsn;
+        guard.unlock();
+
+        wal_write_all(wal->file_descriptor, wal->flush_buffer.data(), wal->flush_buffer.size());
+        stats_add(STAT_SYSCALLS, 1);
+        if (fdatasync(wal->file_descriptor) == -1) {
+            printf("Error syncing log: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+
+        guard.lock();
+        wal->file_length += wal->flush_buffer.size();
+        wal->flush_buffer.clear();
+        wal->durable_lsn = batch_lsn;
+        wal->group_commits += 1;
+        wal->flushed.notify_all();
+    }
+}
+
+uint64_t wal_append(Wal *wal, WalRecordType type, uint32_t page_num, const void *page) {
+    std::lock_guard<std::mutex> guard(wal->lock);
+    uint64_t lsn = wal->next_lsn++;
+
+    char header[WAL_RECORD_HEADER_SIZE];
+    uint32_t record_type = type;
+    std::memcpy(header + WAL_RECORD_TYPE_OFFSET, &record_type, WAL_RECORD_TYPE_SIZE);
+    std::memcpy(header + WAL_RECORD_PAGE_NUM_OFFSET, &page_num, WAL_RECORD_PAGE_NUM_SIZE);
+    std::memcpy(header + WAL_RECORD_LSN_OFFSET, &lsn, WAL_RECORD_LSN_SIZE);
+    uint32_t checksum[2] = {0, 0};
+    wal_checksum(header, WAL_RECORD_CHECKSUM_OFFSET, &checksum[0], &checksum[1]);
+    if (page != nullptr)
+        wal_checksum(static_cast<const char *>(page), PAGE_SIZE, &checksum[0], &checksum[1]);
+    std::memcpy(header + WAL_RECORD_CHECKSUM_OFFSET, checksum, WAL_RECORD_CHECKSUM_SIZE);
+
+    wal->buffer.insert(wal->buffer.end(), header, header + WAL_RECORD_HEADER_SIZE);
+    if (page != nullptr)
+        wal->buffer.insert(wal->buffer.end(), static_cast<const char *>(page),
+                           static_cast<const char *>(page) + PAGE_SIZE);
+    wal->last_lsn = lsn;
+
+    return lsn;
+}
+
+// Hand everything up to lsn to the flusher, optionally waiting for it.
+void wal_flush(Wal *wal, uint64_t lsn, bool wait) {
+    std::unique_lock<std::mutex> guard(wal->lock);
+    if (wal->durable_lsn >= lsn)
+        return;
+    if (wal->flush_requested_lsn < lsn) {
+        wal->flush_requested_lsn = lsn;
+        wal->flush_needed.notify_one();
+    }
+    if (wait)
+        wal->flushed.wait(guard, [wal, lsn] { return wal->durable_lsn >= lsn; });
+}
+
+uint64_t wal_size(Wal *wal) {
+    std::lock_guard<std::mutex> guard(wal->lock);
+    return wal->file_length + wal->buffer.size() + wal->flush_buffer.size();
+}
+
+// Only called once every page in the log has reached the db file.
+void wal_truncate(Wal *wal) {
+    wal_flush(wal, wal->last_lsn, true);
+    std::lock_guard<std::mutex> guard(wal->lock);
+    if (ftruncate(wal->file_descriptor, 0) == -1 || lseek(wal->file_descriptor, 0, SEEK_SET) == -1) {
+        printf("Error truncating log: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    wal->file_length = 0;
+}
+
+/*
+ * Apply every committed page image left in the log to the db file. A torn
+ * or half-written tail fails its checksum and, having no commit record
+ * after it, is dropped along with the rest of that statement.
+ */
+void wal_recover(Wal *wal, int db_file_descriptor, IoBackend *io) {
+    off_t length = lseek(wal->file_descriptor, 0, SEEK_END);
+    if (length <= 0)
+        return;
+
+    std::vector<char> log(length);
+    if (pread(wal->file_descriptor, log.data(), length, 0) != length) {
+        printf("Error reading log: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<uint64_t> pending; // offsets of page records not committed yet
+    uint64_t last_lsn = 0;
+    uint64_t offset = 0;
+    while (offset + WAL_RECORD_HEADER_SIZE <= static_cast<uint64_t>(length)) {
+        const char *header = log.data() + offset;
+        uint32_t type;
+        uint64_t lsn;
+        uint32_t checksum[2];
+        std::memcpy(&type, header + WAL_RECORD_TYPE_OFFSET, WAL_RECORD_TYPE_SIZE);
+        std::memcpy(&lsn, header + WAL_RECORD_LSN_OFFSET, WAL_RECORD_LSN_SIZE);
+        std::memcpy(checksum, header + WAL_RECORD_CHECKSUM_OFFSET, WAL_RECORD_CHECKSUM_SIZE);
+
+        uint64_t record_size = WAL_RECORD_HEADER_SIZE + (type == WAL_RECORD_PAGE ? PAGE_SIZE : 0);
+        if ((type != WAL_RECORD_PAGE && type != WAL_RECORD_COMMIT) || lsn <= last_lsn ||
+            offset + record_size > static_cast<uint64_t>(length))
+            break;
+
+        uint32_t expected[2] = {0, 0};
+        wal_checksum(header, WAL_RECORD_CHECKSUM_OFFSET, &expected[0], &expected[1]);
+        if (type == WAL_RECORD_PAGE)
+            wal_checksum(header + WAL_RECORD_HEADER_SIZE, PAGE_SIZE, &expected[0], &expected[1]);
+        if (expected[0] != checksum[0] || expected[1] != checksum[1])
+            break;
+
+        if (type == WAL_RECORD_PAGE) {
+            pending.push_back(offset);
+        } else {
+            for (uint64_t record_offset : pending) {
+                const char *record = log.data() + record_offset;
+                PageRequest request;
+                std::memcpy(&(request.page_num), record + WAL_RECORD_PAGE_NUM_OFFSET, WAL_RECORD_PAGE_NUM_SIZE);
+                request.buffer = log.data() + record_offset + WAL_RECORD_HEADER_SIZE;
+                request.tag = 0;
+                io->write_pages(db_file_descriptor, &request, 1);
+            }
+            pending.clear();
+        }
+        last_lsn = lsn;
+        offset += record_size;
+    }
+
+    io->sync(db_file_descriptor);
+    wal_truncate(wal);
+}
+
+Wal *wal_open(const char *db_filename, bool synchronous) {
+    Wal *wal = new Wal();
+    wal->filename = std::string(db_filename) + "-wal";
+    wal->file_descriptor = open(wal->filename.c_str(), O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    if (wal->file_descriptor == -1) {
+        std::cout << "Unable to open log file\n";
+        exit(EXIT_FAILURE);
+    }
+    wal->synchronous = synchronous;
+    wal->file_length = 0;
+    wal->next_lsn = 1;
+    wal->last_lsn = 0;
+    wal->durable_lsn = 0;
+    wal->flush_requested_lsn = 0;
+    wal->shutting_down = false;
+    wal->group_commits = 0;
+    wal->flusher = std::thread(wal_flusher_main, wal);
+
+    return wal;
+}
+
+// Expects a checkpoint to have emptied the log, which is then removed. With
+// keep set the log is left as it is, for the next open to recover from.
+void wal_close(Wal *wal, bool keep) {
+    {
+        std::lock_guard<std::mutex> guard(wal->lock);
+        wal->shutting_down = true;
+        wal->flush_needed.notify_one();
+    }
+    wal->flusher.join();
+    close(wal->file_descriptor);
+    if (!keep)
+        unlink(wal->filename.c_str());
+    delete wal;
+}
+
+
+uint32_t page_table_slot(Pager *pager, uint32_t page_num) {
+    // Fibonacci hashing keeps consecutive page numbers apart
+    return (page_num * 2654435769u) & pager->page_table_mask;
+}
+
+uint32_t page_table_find(Pager *pager, uint32_t page_num) {
+    uint32_t slot = page_table_slot(pager, page_num);
+    while (pager->page_table[slot].page_num != INVALID_PAGE_NUM) {
+        if (pager->page_table[slot].page_num == page_num)
+            return pager->page_table[slot].frame_num;
+        slot = (slot + 1) & pager->page_table_mask;
+    }
+    return INVALID_PAGE_NUM;
+}
+
+void page_table_insert(Pager *pager, uint32_t page_num, uint32_t frame_num) {
+    uint32_t slot = page_table_slot(pager, page_num);
+    while (pager->page_table[slot].page_num != INVALID_PAGE_NUM)
+        slot = (slot + 1) & pager->page_table_mask;
+    pager->page_table[slot].page_num = page_num;
+    pager->page_table[slot].frame_num = frame_num;
+}
+
+void page_table_remove(Pager *pager, uint32_t page_num) {
+    uint32_t mask = pager->page_table_mask;
+    uint32_t hole = page_table_slot(pager, page_num);
+    while (pager->page_table[hole].page_num != page_num)
+        hole = (hole + 1) & mask;
+
+    // Shift later entries of the same probe run back into the hole so that
+    // lookups never stop early at an empty slot.
+    uint32_t slot = hole;
+    while (true) {
+        slot = (slot + 1) & mask;
+        if (pager->page_table[slot].page_num == INVALID_PAGE_NUM)
+            break;
+        uint32_t home = page_table_slot(pager, pager->page_table[slot].page_num);
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            pager->page_table[hole] = pager->page_table[slot];
+            hole = slot;
+        }
+    }
+    pager->page_table[hole].page_num = INVALID_PAGE_NUM;
+}
+
+// Extend the mapping over whatever the file has grown by.
+void pager_map_grow(Pager *pager) {
+    if (pager->map == nullptr || pager->file_length <= pager->map_length ||
+        pager->file_length > MMAP_RESERVE_BYTES)
+        return;
+
+    void *address = mmap(pager->map + pager->map_length, pager->file_length - pager->map_length, PROT_READ,
+                         MAP_SHARED | MAP_FIXED, pager->file_descriptor, pager->map_length);
+    if (address == MAP_FAILED) {
+        printf("Error mapping db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    pager->map_length = pager->file_length;
+}
+
+// Hint the kernel about the access pattern of the mapped pages.
+void pager_advise(Pager *pager, int advice) {
+    // a reader's eviction can grow the map meanwhile
+    std::lock_guard<std::recursive_mutex> guard(pager->latch);
+    if (pager->map != nullptr && pager->map_length > 0) {
+        madvise(pager->map, pager->map_length, advice);
+        stats_add(STAT_SYSCALLS, 1);
+    }
+}
+
+/*
+ * Write the given frames, sorted by page number, through the I/O backend,
+ * which turns each run of adjacent pages into a single request.
+ */
+void pager_write_frames(Pager *pager, const uint32_t *frame_nums, uint32_t count) {
+    std::vector<PageRequest> requests(count);
+    uint64_t end = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        Frame *frame = &(pager->frames[frame_nums[i]]);
+        if (i > 0 && frame->page_num <= requests[i - 1].page_num) {
+            printf("Tried to flush page %u out of order\n", frame->page_num);
+            exit(EXIT_FAILURE);
+        }
+        requests[i].page_num = frame->page_num;
+        requests[i].buffer = static_cast<char *>(frame->data);
+        requests[i].tag = frame_nums[i];
+        end = (static_cast<uint64_t>(frame->page_num) + 1) * PAGE_SIZE;
+    }
+
+    pager->stats.write_calls += pager->io->write_pages(pager->file_descriptor, requests.data(), count);
+
+    if (end > pager->file_length) {
+        pager->file_length = end;
+        pager_map_grow(pager);
+    }
+    for (uint32_t i = 0; i < count; i++)
+        pager->frames[frame_nums[i]].dirty = false;
+    pager->stats.pages_written += count;
+}
+
+void pager_flush(Pager *pager, uint32_t frame_num) {
+    Frame *frame = &(pager->frames[frame_num]);
+    if (frame->page_num == INVALID_PAGE_NUM) {
+        printf("Tried to flush null page\n");
+        exit(EXIT_FAILURE);
+    }
+    pager_write_frames(pager, &frame_num, 1);
+}
+
+/*
+ * Write back every dirty frame and nothing else. Frames are sorted by page
+ * number first so that adjacent dirty pages go out as a single request.
+ */
+void pager_flush_dirty(Pager *pager) {
+    std::vector<uint32_t> dirty_frames;
+    uint64_t max_page_lsn = 0;
+    for (uint32_t i = 0; i < pager->frames_in_use; i++) {
+        if (pager->frames[i].dirty) {
+            dirty_frames.push_back(i);
+            max_page_lsn = std::max(max_page_lsn, pager->frames[i].page_lsn);
+        }
+    }
+    if (dirty_frames.empty())
+        return;
+
+    if (pager->wal != nullptr)
+        wal_flush(pager->wal, max_page_lsn, true);
+
+    Frame *frames = pager->frames;
+    std::sort(dirty_frames.begin(), dirty_frames.end(),
+              [frames](uint32_t a, uint32_t b) { return frames[a].page_num < frames[b].page_num; });
+    pager_write_frames(pager, dirty_frames.data(), dirty_frames.size());
+}
+
+// Wait for at least one outstanding read and mark its frame ready.
+void pager_reap_reads(Pager *pager) {
+    uint32_t tags[URING_ENTRIES];
+    uint32_t count = pager->io->wait_reads(tags, URING_ENTRIES);
+    for (uint32_t i = 0; i < count; i++)
+        pager->frames[tags[i]].io_pending = false;
+    pager->reads_in_flight -= count;
+}
+
+void pager_wait_read(Pager *pager, uint32_t frame_num) {
+    while (pager->frames[frame_num].io_pending)
+        pager_reap_reads(pager);
+}
+
+/*
+ * Pick a frame for a new page: an unused one while the pool is filling up,
+ * then the first unpinned frame the CLOCK hand finds without its referenced
+ * bit set. A dirty victim is written back before it is reused. Returns
+ * INVALID_PAGE_NUM when every frame is pinned or still being read into.
+ */
+uint32_t pager_evict(Pager *pager) {
+    if (pager->frames_in_use < pager->num_frames)
+        return pager->frames_in_use++;
+
+    // two full turns: the first one may only be clearing referenced bits
+    for (uint32_t i = 0; i < 2 * pager->num_frames; i++) {
+        uint32_t frame_num = pager->clock_hand;
+        pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+        Frame *frame = &(pager->frames[frame_num]);
+        if (frame->pin_count > 0 || frame->io_pending)
+            continue;
+        if (frame->referenced) {
+            frame->referenced = false;
+            continue;
+        }
+
+        if (frame->dirty) {
+            // the log has to be on disk up to the page's last change
+            if (pager->wal != nullptr)
+                wal_flush(pager->wal, frame->page_lsn, true);
+            pager_flush(pager, frame_num);
+            pager->stats.writebacks += 1;
+        }
+        page_table_remove(pager, frame->page_num);
+        frame->page_num = INVALID_PAGE_NUM;
+        pager->stats.evictions += 1;
+        return frame_num;
+    }
+
+    return INVALID_PAGE_NUM;
+}
+
+// Set frame_num up to hold page_num, not pinned and not dirty.
+void pager_assign_frame(Pager *pager, uint32_t frame_num, uint32_t page_num) {
+    Frame *frame = &(pager->frames[frame_num]);
+    frame->data = frame->buffer;
+    frame->mapped = false;
+    frame->page_num = page_num;
+    frame->pin_count = 0;
+    frame->dirty = false;
+    frame->in_write_set = false;
+    frame->image_saved = false;
+    frame->page_lsn = 0;
+    frame->io_pending = false;
+    page_table_insert(pager, page_num, frame_num);
+
+    if (page_num >= pager->num_pages)
+        pager->num_pages = page_num + 1;
+}
+
+/*
+ * Start reading pages that are about to be needed, without waiting for
+ * them. Pages already in the pool, past the end of the file, or in the
+ * mapping are skipped, and so is the rest of the batch once no frame can
+ * be freed up without waiting.
+ */
+void pager_prefetch(Pager *pager, const uint32_t *page_nums, uint32_t count) {
+    std::lock_guard<std::recursive_mutex> guard(pager->latch);
+    if (pager->map != nullptr)
+        return;
+
+    uint32_t num_pages = pager->file_length / PAGE_SIZE;
+    std::vector<PageRequest> requests;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t page_num = page_nums[i];
+        if (page_num >= num_pages || page_table_find(pager, page_num) != INVALID_PAGE_NUM)
+            continue;
+        uint32_t frame_num = pager_evict(pager);
+        if (frame_num == INVALID_PAGE_NUM)
+            break;
+        pager_assign_frame(pager, frame_num, page_num);
+        Frame *frame = &(pager->frames[frame_num]);
+        frame->io_pending = true;
+        // survive one sweep of the clock hand before it is used
+        frame->referenced = true;
+        PageRequest request = {page_num, frame->buffer, frame_num};
+        requests.push_back(request);
+    }
+    if (requests.empty())
+        return;
+
+    pager->io->submit_reads(pager->file_descriptor, requests.data(), requests.size());
+    pager->reads_in_flight += requests.size();
+    pager->stats.reads += requests.size();
+    pager->stats.prefetches += requests.size();
+}
+
+/*
+ * Pin a page in the buffer pool and return its contents. With a mapping,
+ * pages that are only read are served straight from it: the frame just
+ * points there and its own buffer is left untouched. A page is copied into
+ * the frame's buffer the first time somebody writes to it.
+ */
+void *pager_fetch(Pager *pager, uint32_t page_num, bool for_write) {
+    uint32_t frame_num = page_table_find(pager, page_num);
+    uint32_t mapped_pages = pager->map_length / PAGE_SIZE;
+
+    if (frame_num == INVALID_PAGE_NUM) {
+        // cache miss, find a frame and load from file.
+        pager->stats.misses += 1;
+        stats_add(STAT_PAGE_MISSES, 1);
+        frame_num = pager_evict(pager);
+        while (frame_num == INVALID_PAGE_NUM && pager->reads_in_flight > 0) {
+            // prefetched pages still in flight hold the only free frames
+            pager_reap_reads(pager);
+            frame_num = pager_evict(pager);
+        }
+        if (frame_num == INVALID_PAGE_NUM) {
+            std::cout << "All " << pager->num_frames << " buffer pool frames are pinned." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        uint32_t num_pages = pager->file_length / PAGE_SIZE;
+        pager_assign_frame(pager, frame_num, page_num);
+        Frame *frame = &(pager->frames[frame_num]);
+
+        if (page_num < mapped_pages && !for_write) {
+            frame->data = pager->map + static_cast<uint64_t>(page_num) * PAGE_SIZE;
+            frame->mapped = true;
+            pager->stats.mapped_reads += 1;
+            // read by a page fault rather than a system call, but read all the same
+            stats_add(STAT_BYTES_READ, PAGE_SIZE);
+        } else if (page_num < mapped_pages) {
+            std::memcpy(frame->buffer, pager->map + static_cast<uint64_t>(page_num) * PAGE_SIZE, PAGE_SIZE);
+            stats_add(STAT_BYTES_READ, PAGE_SIZE);
+        } else if (page_num < num_pages) {
+            frame->io_pending = true;
+            PageRequest request = {page_num, frame->buffer, frame_num};
+            pager->io->submit_reads(pager->file_descriptor, &request, 1);
+            pager->reads_in_flight += 1;
+            pager->stats.reads += 1;
+            pager_wait_read(pager, frame_num);
+        } else {
+            std::memset(frame->buffer, 0, PAGE_SIZE);
+        }
+    } else {
+        pager->stats.hits += 1;
+        stats_add(STAT_PAGE_HITS, 1);
+        pager_wait_read(pager, frame_num);
+    }
+
+    Frame *frame = &(pager->frames[frame_num]);
+    if (for_write && frame->mapped) {
+        std::memcpy(frame->buffer, frame->data, PAGE_SIZE);
+        frame->data = frame->buffer;
+        frame->mapped = false;
+    }
+    frame->pin_count += 1;
+    frame->referenced = true;
+    return frame->data;
+
+}
+
+// Pin a page in the buffer pool for reading. Every call must be paired
+// with unpin_page() once the caller is done with the pointer.
+void *get_page(Pager *pager, uint32_t page_num) {
+    std::lock_guard<std::recursive_mutex> guard(pager->latch);
+    return pager_fetch(pager, page_num, false);
+}
+
+char *pager_alloc_buffer(Pager *pager) {
+    if (!pager->spare_buffers.empty()) {
+        char *buffer = pager->spare_buffers.back();
+        pager->spare_buffers.pop_back();
+        return buffer;
+    }
+    char *buffer = new char[PAGE_SIZE];
+    pager->page_buffers.push_back(buffer);
+    return buffer;
+}
+
+/*
+ * The page as a reader with a snapshot taken at snapshot_lsn sees it: the
+ * oldest version replaced after that commit if there is one, otherwise the
+ * page in the pool, pinned. Versions are not pinned, they stay put until
+ * the snapshot is closed.
+ */
+void *get_page_version(Pager *pager, uint32_t page_num, uint64_t snapshot_lsn, bool *pinned) {
+    std::lock_guard<std::recursive_mutex> guard(pager->latch);
+    auto entry = pager->versions.find(page_num);
+    if (entry != pager->versions.end()) {
+        for (const PageVersion &version : entry->second) {
+            if (version.end_lsn > snapshot_lsn) {
+                *pinned = false;
+                return version.image;
+            }
+        }
+    }
+    *pinned = true;
+    return pager_fetch(pager, page_num, false);
+}
+
+// Drop the versions no open snapshot is old enough to see.
+void pager_collect_versions(Pager *pager) {
+    uint64_t oldest = pager->snapshot_lsns.empty() ? pager->committed_lsn : *pager->snapshot_lsns.begin();
+    for (auto entry = pager->versions.begin(); entry != pager->versions.end();) {
+        std::vector<PageVersion> &chain = entry->second;
+        size_t expired = 0;
+        while (expired < chain.size() && chain[expired].end_lsn <= oldest)
+            pager->spare_buffers.push_back(chain[expired++].image);
+        chain.erase(chain.begin(), chain.begin() + expired);
+        if (chain.empty())
+            entry = pager->versions.erase(entry);
+        else
+            ++entry;
+    }
+}
+
+/*
+ * Pin a page that the caller is about to modify. The page also stays pinned
+ * until the next commit has logged it, so it never reaches the db file
+ * before its log record does. The returned pointer can differ from one an
+ * earlier get_page() gave out for the same page.
+ */
+void *get_page_for_write(Pager *pager, uint32_t page_num) {
+    std::lock_guard<std::recursive_mutex> guard(pager->latch);
+    void *page = pager_fetch(pager, page_num, true);
+    Frame *frame = &(pager->frames[page_table_find(pager, page_num)]);
+    if (pager->in_statement && !frame->image_saved && page_num < pager->statement_num_pages) {
+        PageImage saved = {page_num, pager_alloc_buffer(pager), frame->dirty};
+        std::memcpy(saved.image, frame->data, PAGE_SIZE);
+        pager->statement_images.push_back(saved);
+        frame->image_saved = true;
+    }
+    frame->dirty = true;
+    if (pager->wal != nullptr && !frame->in_write_set) {
+        frame->in_write_set = true;
+        frame->pin_count += 1;
+        pager->write_set.push_back(page_num);
+
+        if (pager->versioned) {
+            // readers may be in the middle of the committed image, so it
+            // becomes a version and the statement goes on in a copy
+            char *copy = pager_alloc_buffer(pager);
+            std::memcpy(copy, frame->data, PAGE_SIZE);
+            PageVersion version = {VERSION_PENDING, frame->buffer};
+            pager->versions[page_num].push_back(version);
+            pager->pending_versions.push_back(page_num);
+            frame->buffer = copy;
+            frame->data = copy;
+            page = copy;
+        }
+    }
+    return page;
+}
+
+void unpin_page(Pager *pager, uint32_t page_num) {
+    std::lock_guard<std::recursive_mutex> guard(pager->latch);
+    uint32_t frame_num = page_table_find(pager, page_num);
+    if (frame_num == INVALID_PAGE_NUM || pager->frames[frame_num].pin_count == 0) {
+        std::cout << "Tried to unpin page " << page_num << " that is not pinned." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    pager->frames[frame_num].pin_count -= 1;
+}
+
+/*
+ * Statements. Between pager_statement_begin() and pager_statement_end()
+ * the pager keeps the image of every page the statement changes from
+ * before its first change, and remembers how far the write set and the
+ * file went, so that pager_statement_rollback() can take a statement that
+ * failed part way back out again. A commit in the middle of a statement is
+ * as far back as it goes.
+ */
+void pager_statement_forget(Pager *pager) {
+    for (const PageImage &saved : pager->statement_images) {
+        uint32_t frame_num = page_table_find(pager, saved.page_num);
+        if (frame_num != INVALID_PAGE_NUM)
+            pager->frames[frame_num].image_saved = false;
+        pager->spare_buffers.push_back(saved.image);
+    }
+    pager->statement_images.clear();
+    pager->statement_write_set = pager->write_set.size();
+    pager->statement_versions = pager->pending_versions.size();
+    pager->statement_num_pages = pager->num_pages;
+}
+
+void pager_statement_begin(Pager *pager) {
+    std::lock_guard<std::recursive_mutex> guard(pager->latch);
+    pager_statement_forget(pager);
+    pager->in_statement = true;
+}
+
+void pager_statement_end(Pager *pager) {
+    std::lock_guard<std::recursive_mutex> guard(pager->latch);
+    pager_statement_forget(pager);
+    pager->in_statement = false;
+}
+
+/*
+ * Undo every change of the open statement since it began or last
+ * committed: the pages it changed get their old images back, those it
+ * added to the write set leave it, and pages it took past the end of the
+ * file are dropped. Returns false if there was nothing to undo.
+ */
+bool pager_statement_rollback(Pager *pager) {
+    std::lock_guard<std::recursive_mutex> guard(pager->latch);
+    if (pager->statement_images.empty() && pager->write_set.size() == pager->statement_write_set &&
+        pager->num_pages == pager->statement_num_pages)
+        return false;
+    for (const PageImage &saved : pager->statement_images) {
+        Frame *frame = &(pager->frames[page_table_find(pager, saved.page_num)]);
+        std::memcpy(frame->data, saved.image, PAGE_SIZE);
+        frame->dirty = saved.dirty;
+    }
+
+    // the pending version of a page holds the image the statement started from
+    for (size_t i = pager->pending_versions.size(); i > pager->statement_versions; i--) {
+        uint32_t page_num = pager->pending_versions[i - 1];
+        std::vector<PageVersion> &chain = pager->versions[page_num];
+        Frame *frame = &(pager->frames[page_table_find(pager, page_num)]);
+        pager->spare_buffers.push_back(frame->buffer);
+        frame->buffer = chain.back().image;
+        frame->data = frame->buffer;
+        chain.pop_back();
+        if (chain.empty())
+            pager->versions.erase(page_num);
+    }
+    pager->pending_versions.resize(pager->statement_versions);
+
+    for (size_t i = pager->write_set.size(); i > pager->statement_write_set; i--) {
+        Frame *frame = &(pager->frames[page_table_find(pager, pager->write_set[i - 1])]);
+        frame->in_write_set = false;
+        frame->pin_count -= 1;
+    }
+    pager->write_set.resize(pager->statement_write_set);
+
+    for (uint32_t i = 0; i < pager->frames_in_use; i++) {
+        Frame *frame = &(pager->frames[i]);
+        if (frame->page_num == INVALID_PAGE_NUM || frame->page_num < pager->statement_num_pages)
+            continue;
+        page_table_remove(pager, frame->page_num);
+        frame->page_num = INVALID_PAGE_NUM;
+        frame->dirty = false;
+        frame->referenced = false;
+    }
+    pager->num_pages = pager->statement_num_pages;
+    pager_statement_forget(pager);
+    return true;
+}
+
+/*
+ * Write every dirty page to the db file and sync it, after which the log
+ * has nothing left that the db file does not, and can start over.
+ */
+void pager_checkpoint(Pager *pager) {
+    std::lock_guard<std::recursive_mutex> guard(pager->latch);
+    pager_flush_dirty(pager);
+    pager->io->sync(pager->file_descriptor);
+    wal_truncate(pager->wal);
+    pager->stats.checkpoints += 1;
+}
+
+/*
+ * Checkpoint whenever a commit asks for it. The checkpoint holds the latch,
+ * so a statement only waits for it once it needs the pool, not on commit.
+ * The pages of a statement or transaction that has not committed yet are
+ * not in the log, so a checkpoint would put them in the db file with no
+ * way to take them back out; it waits for the next commit to ask again.
+ * So does one while a snapshot is open, which may be reading from the
+ * mapping the checkpoint would write through.
+ */
+void pager_checkpointer_main(Pager *pager) {
+    std::unique_lock<std::recursive_mutex> guard(pager->latch);
+    while (true) {
+        pager->checkpoint_needed.wait(guard, [pager] { return pager->closing || pager->checkpoint_requested; });
+        if (pager->closing)
+            return;
+        pager->checkpoint_requested = false;
+        if (pager->write_set.empty() && pager->snapshot_lsns.empty())
+            pager_checkpoint(pager);
+    }
+}
+
+// Stop the checkpointer, leaving the last checkpoint to the caller.
+void pager_stop_checkpointer(Pager *pager) {
+    {
+        std::lock_guard<std::recursive_mutex> guard(pager->latch);
+        pager->closing = true;
+        pager->checkpoint_needed.notify_one();
+    }
+    pager->checkpointer.join();
+}
+
+/*
+ * Make the running statement's changes durable: log an image of each page
+ * it changed plus a commit record, then release the pages for eviction.
+ */
+void pager_commit(Pager *pager) {
+    std::unique_lock<std::recursive_mutex> guard(pager->latch);
+    if (pager->write_set.empty())
+        return;
+
+    Wal *wal = pager->wal;
+    for (uint32_t page_num : pager->write_set) {
+        uint32_t frame_num = page_table_find(pager, page_num);
+        wal_append(wal, WAL_RECORD_PAGE, page_num, pager->frames[frame_num].data);
+    }
+    uint64_t commit_lsn = wal_append(wal, WAL_RECORD_COMMIT, 0, nullptr);
+    // readers carry on while the log is synced
+    guard.unlock();
+    wal_flush(wal, commit_lsn, wal->synchronous);
+    guard.lock();
+
+    for (uint32_t page_num : pager->write_set) {
+        Frame *frame = &(pager->frames[page_table_find(pager, page_num)]);
+        frame->in_write_set = false;
+        frame->page_lsn = commit_lsn;
+        unpin_page(pager, page_num);
+    }
+    pager->write_set.clear();
+
+    for (uint32_t page_num : pager->pending_versions)
+        pager->versions[page_num].back().end_lsn = commit_lsn;
+    pager->pending_versions.clear();
+    pager->committed_lsn = commit_lsn;
+    pager_collect_versions(pager);
+    if (pager->in_statement)
+        pager_statement_forget(pager);
+
+    // a checkpoint would write pages that open snapshots read from the mapping
+    if (wal_size(wal) > WAL_CHECKPOINT_BYTES && pager->snapshot_lsns.empty()) {
+        pager->checkpoint_requested = true;
+        pager->checkpoint_needed.notify_one();
+    }
+}
+
+/*
+ * Cut the db file down to its first num_pages pages, none of which the
+ * caller has left anything pointing past. Only done right after a
+ * checkpoint, so the frames dropped are clean and the log holds none of
+ * their pages.
+ */
+void pager_truncate(Pager *pager, uint32_t num_pages) {
+    std::lock_guard<std::recursive_mutex> guard(pager->latch);
+    while (pager->reads_in_flight > 0)
+        pager_reap_reads(pager);
+    for (uint32_t i = 0; i < pager->frames_in_use; i++) {
+        Frame *frame = &(pager->frames[i]);
+        if (frame->page_num == INVALID_PAGE_NUM || frame->page_num < num_pages)
+            continue;
+        page_table_remove(pager, frame->page_num);
+        frame->page_num = INVALID_PAGE_NUM;
+        frame->referenced = false;
+    }
+    pager->io->truncate(pager->file_descriptor, num_pages);
+    pager->num_pages = num_pages;
+    pager->file_length = std::min(pager->file_length, static_cast<uint64_t>(num_pages) * PAGE_SIZE);
+    pager->map_length = std::min(pager->map_length, pager->file_length);
+}
+
+/*
+ * A page for a new node: the first one on the free list, or else one past
+ * the end of the file. Taking a page off the list changes the header, so
+ * that goes into the same commit as whatever the page is used for.
+ */
+uint32_t get_unused_page_num(Pager *pager) {
+    uint32_t page_num;
+    void *header = get_page(pager, DB_HEADER_PAGE_NUM);
+    std::memcpy(&page_num, static_cast<char *>(header) + DB_HEADER_FREE_PAGE_OFFSET, DB_HEADER_FREE_PAGE_SIZE);
+    unpin_page(pager, DB_HEADER_PAGE_NUM);
+    if (page_num == 0)
+        return pager->num_pages;
+
+    void *page = get_page(pager, page_num);
+    uint32_t next = *free_page_next(page);
+    unpin_page(pager, page_num);
+    header = get_page_for_write(pager, DB_HEADER_PAGE_NUM);
+    std::memcpy(static_cast<char *>(header) + DB_HEADER_FREE_PAGE_OFFSET, &next, DB_HEADER_FREE_PAGE_SIZE);
+    unpin_page(pager, DB_HEADER_PAGE_NUM);
+    return page_num;
+}
+
+// Put a page no B+tree uses any more at the front of the free list.
+void free_page(Pager *pager, uint32_t page_num) {
+    void *header = get_page_for_write(pager, DB_HEADER_PAGE_NUM);
+    void *page = get_page_for_write(pager, page_num);
+    std::memset(page, 0, PAGE_SIZE);
+    set_node_type(page, NODE_FREE);
+    std::memcpy(free_page_next(page), static_cast<char *>(header) + DB_HEADER_FREE_PAGE_OFFSET,
+                DB_HEADER_FREE_PAGE_SIZE);
+    std::memcpy(static_cast<char *>(header) + DB_HEADER_FREE_PAGE_OFFSET, &page_num, DB_HEADER_FREE_PAGE_SIZE);
+    unpin_page(pager, page_num);
+    unpin_page(pager, DB_HEADER_PAGE_NUM);
+}
+
+
+/*
+ * Index of the first key that is >= key, or > key when upper is set.
+ * Returns num_keys when the search should continue in the right child.
+ */
+uint32_t internal_node_find_child(void *node, uint32_t key, bool upper) {
+    uint32_t min_index = 0;
+    uint32_t max_index = *internal_node_num_keys(node);
+
+    while (min_index != max_index) {
+        uint32_t index = min_index + (max_index - min_index) / 2;
+        uint32_t key_at_index = *internal_node_key(node, index);
+        if (key_at_index > key || (!upper && key_at_index == key))
+            max_index = index;
+        else
+            min_index = index + 1;
+    }
+
+    return min_index;
+}
+
+// Same search over the cells of a leaf.
+uint32_t leaf_node_find_cell(void *node, uint32_t key, bool upper) {
+    uint32_t min_index = 0;
+    uint32_t max_index = *leaf_node_num_cells(node);
+
+    while (min_index != max_index) {
+        uint32_t index = min_index + (max_index - min_index) / 2;
+        uint32_t key_at_index = *leaf_node_key(node, index);
+        if (key_at_index > key || (!upper && key_at_index == key))
+            max_index = index;
+        else
+            min_index = index + 1;
+    }
+
+    return min_index;
+}
+
+/*
+ * Ask for the leaves to the right of child_num before the scan gets there.
+ * A batch is only sent once the scan has used up half of the previous one,
+ * so the pager sees a few larger batches rather than one page at a time.
+ */
+void cursor_prefetch_leaves(Cursor *cursor, uint32_t parent_page_num, void *parent, uint32_t child_num) {
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    uint32_t first = child_num + 1;
+    if (cursor->prefetch_parent == parent_page_num) {
+        if (child_num + cursor->readahead / 2 < cursor->prefetch_until)
+            return;
+        first = std::max(first, cursor->prefetch_until);
+    }
+    uint32_t last = std::min(child_num + cursor->readahead, num_keys);
+
+    uint32_t page_nums[MAX_READAHEAD_PAGES];
+    uint32_t count = 0;
+    for (uint32_t i = first; i <= last; i++)
+        page_nums[count++] = *internal_node_child(parent, i);
+    pager_prefetch(cursor->table->pager, page_nums, count);
+
+    cursor->prefetch_parent = parent_page_num;
+    cursor->prefetch_until = last + 1;
+}
+
+// Pin a page of the table, or find the version snapshot sees when given.
+void *table_get_page(Table *table, const Snapshot *snapshot, uint32_t page_num, bool *pinned) {
+    if (snapshot == nullptr) {
+        *pinned = true;
+        return get_page(table->pager, page_num);
+    }
+    return get_page_version(table->pager, page_num, snapshot->lsn, pinned);
+}
+
+void table_put_page(Table *table, uint32_t page_num, bool pinned) {
+    if (pinned)
+        unpin_page(table->pager, page_num);
+}
+
+void *cursor_get_page(Cursor *cursor, uint32_t page_num, bool *pinned) {
+    return table_get_page(cursor->table, cursor->snapshot, page_num, pinned);
+}
+
+void cursor_put_page(Cursor *cursor, uint32_t page_num, bool pinned) {
+    table_put_page(cursor->table, page_num, pinned);
+}
+
+/*
+ * Walk from the node at page_num down to a leaf, recording the path in the
+ * cursor starting at the cursor's current depth. Ids are unique, but the
+ * hash keys of an index are not, so a lookup lands on the first cell with
+ * an equal key while an insert lands after the last one.
+ */
+void cursor_descend(Cursor *cursor, uint32_t page_num, uint32_t key, bool upper) {
+    bool pinned;
+    void *node = cursor_get_page(cursor, page_num, &pinned);
+
+    while (get_node_type(node) == NODE_INTERNAL) {
+        if (cursor->depth >= BTREE_MAX_DEPTH) {
+            std::cout << "B+tree deeper than " << BTREE_MAX_DEPTH << " levels." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        uint32_t child_num = internal_node_find_child(node, key, upper);
+        cursor->path_page_num[cursor->depth] = page_num;
+        cursor->path_child_num[cursor->depth] = child_num;
+        cursor->depth += 1;
+
+        // the parent stays pinned until we know whether the child is a leaf
+        bool child_pinned;
+        void *child = cursor_get_page(cursor, *internal_node_child(node, child_num), &child_pinned);
+        if (cursor->readahead > 0 && get_node_type(child) == NODE_LEAF)
+            cursor_prefetch_leaves(cursor, page_num, node, child_num);
+        uint32_t child_page_num = *internal_node_child(node, child_num);
+        cursor_put_page(cursor, page_num, pinned);
+        page_num = child_page_num;
+        node = child;
+        pinned = child_pinned;
+    }
+
+    cursor->page_num = page_num;
+    cursor->page = node;
+    cursor->page_pinned = pinned;
+    cursor->cell_num = leaf_node_find_cell(node, key, upper);
+}
+
+/*
+ * Move the cursor to the first cell of the next leaf by going back up the
+ * path until some ancestor still has a child to the right.
+ */
+void cursor_next_leaf(Cursor *cursor) {
+    cursor_put_page(cursor, cursor->page_num, cursor->page_pinned);
+    cursor->page = nullptr;
+
+    while (cursor->depth > 0) {
+        uint32_t level = cursor->depth - 1;
+        uint32_t parent_page_num = cursor->path_page_num[level];
+        uint32_t child_num = cursor->path_child_num[level];
+        bool pinned;
+        void *parent = cursor_get_page(cursor, parent_page_num, &pinned);
+        bool has_next_child = child_num < *internal_node_num_keys(parent);
+        uint32_t next_page_num = has_next_child ? *internal_node_child(parent, child_num + 1) : INVALID_PAGE_NUM;
+        // leaves all sit at the same depth, so this parent's children are leaves
+        if (has_next_child && cursor->readahead > 0 && level == cursor->depth - 1)
+            cursor_prefetch_leaves(cursor, parent_page_num, parent, child_num + 1);
+        cursor_put_page(cursor, parent_page_num, pinned);
+
+        if (has_next_child) {
+            cursor->path_child_num[level] = child_num + 1;
+            cursor_descend(cursor, next_page_num, 0, false);
+            return;
+        }
+        cursor->depth -= 1;
+    }
+
+    cursor->end_of_table = true;
+}
+
+// The mirror image of cursor_next_leaf(), leaving the cursor past the last cell.
+void cursor_prev_leaf(Cursor *cursor) {
+    cursor_put_page(cursor, cursor->page_num, cursor->page_pinned);
+    cursor->page = nullptr;
+
+    while (cursor->depth > 0) {
+        uint32_t level = cursor->depth - 1;
+        uint32_t parent_page_num = cursor->path_page_num[level];
+        uint32_t child_num = cursor->path_child_num[level];
+        bool pinned;
+        void *parent = cursor_get_page(cursor, parent_page_num, &pinned);
+        uint32_t prev_page_num = child_num > 0 ? *internal_node_child(parent, child_num - 1) : INVALID_PAGE_NUM;
+        cursor_put_page(cursor, parent_page_num, pinned);
+
+        if (child_num > 0) {
+            cursor->path_child_num[level] = child_num - 1;
+            cursor_descend(cursor, prev_page_num, UINT32_MAX, true);
+            return;
+        }
+        cursor->depth -= 1;
+    }
+
+    cursor->end_of_table = true;
+}
+
+// Step over leaves that have nothing left at or after the current cell.
+void cursor_skip_exhausted_leaves(Cursor *cursor) {
+    while (!cursor->end_of_table && cursor->cell_num >= *leaf_node_num_cells(cursor->page))
+        cursor_next_leaf(cursor);
+}
+
+// The root of table, or of one of its indexes, as of snapshot.
+uint32_t snapshot_root(const Snapshot *snapshot, const Table *table) {
+    for (uint32_t column = 0; column < INDEX_COLUMNS; column++) {
+        if (snapshot->table->indexes[column] == table)
+            return snapshot->index_root_page_nums[column];
+    }
+    return snapshot->root_page_num;
+}
+
+// A cursor on the latest version of the table, or on snapshot when given.
+Cursor *table_seek(Table *table, const Snapshot *snapshot, uint32_t key, bool upper, uint32_t readahead) {
+    Cursor *cursor = new Cursor();
+    cursor->table = table;
+    cursor->snapshot = snapshot;
+    cursor->end_of_table = false;
+    cursor->page = nullptr;
+    cursor->depth = 0;
+    cursor->readahead = std::min(readahead, static_cast<uint32_t>(MAX_READAHEAD_PAGES));
+    cursor->prefetch_parent = INVALID_PAGE_NUM;
+    cursor->prefetch_until = 0;
+    cursor_descend(cursor, snapshot != nullptr ? snapshot_root(snapshot, table) : table->root_page_num, key, upper);
+
+    return cursor;
+}
+
+// Position of the first row with an id >= key.
+Cursor *table_find(Table *table, const Snapshot *snapshot, uint32_t key) {
+    Cursor *cursor = table_seek(table, snapshot, key, false, 0);
+    cursor_skip_exhausted_leaves(cursor);
+
+    return cursor;
+}
+
+// Like table_find(), for a scan that goes on from there, reading ahead of itself.
+Cursor *table_scan_from(Table *table, const Snapshot *snapshot, uint32_t key) {
+    Cursor *cursor = table_seek(table, snapshot, key, false, table->pager->readahead_pages);
+    cursor_skip_exhausted_leaves(cursor);
+
+    return cursor;
+}
+
+Cursor *table_start(Table *table) { return table_scan_from(table, nullptr, 0); }
+
+void cursor_close(Cursor *cursor) {
+    if (cursor->page != nullptr)
+        cursor_put_page(cursor, cursor->page_num, cursor->page_pinned);
+    delete cursor;
+}
+
+
+uint32_t cursor_key(Cursor *cursor) {
+    return *leaf_node_key(cursor->page, cursor->cell_num);
+}
+
+RowView cursor_row_view(Cursor *cursor) {
+    return leaf_node_row_view(cursor->page, cursor->cell_num);
+}
+
+void cursor_advance(Cursor *cursor) {
+    cursor->cell_num += 1;
+    cursor_skip_exhausted_leaves(cursor);
+}
+
+/*
+ * Hand out the rest of the current leaf as one batch. The leaf stays
+ * pinned until the next call, which moves on to the following leaf, so a
+ * scan pays for the page lookup once per leaf instead of once per row.
+ * Returns 0 at the end of the table.
+ */
+uint32_t cursor_next_batch(Cursor *cursor, RowBatch *batch) {
+    cursor_skip_exhausted_leaves(cursor);
+    if (cursor->end_of_table) {
+        batch->node = nullptr;
+        batch->count = 0;
+        return 0;
+    }
+
+    uint32_t num_cells = *leaf_node_num_cells(cursor->page);
+    batch->node = cursor->page;
+    batch->first_cell = cursor->cell_num;
+    batch->count = num_cells - cursor->cell_num;
+    cursor->cell_num = num_cells;
+    return batch->count;
+}
+
+/*
+ * Like cursor_next_batch(), going backwards: hand out the cells of the
+ * current leaf before the cursor, and on the next call those of the leaf
+ * before it. Returns 0 at the start of the table.
+ */
+uint32_t cursor_prev_batch(Cursor *cursor, RowBatch *batch) {
+    while (!cursor->end_of_table && cursor->cell_num == 0)
+        cursor_prev_leaf(cursor);
+    if (cursor->end_of_table) {
+        batch->node = nullptr;
+        batch->count = 0;
+        return 0;
+    }
+
+    batch->node = cursor->page;
+    batch->first_cell = 0;
+    batch->count = cursor->cell_num;
+    cursor->cell_num = 0;
+    return batch->count;
+}
+
+/*
+ * The ids of a batch as one packed array. A PAX leaf already stores them
+ * that way and is returned as is, other leaves are gathered into scratch,
+ * which must have room for LEAF_NODE_MAX_ROWS ids.
+ */
+const uint32_t *row_batch_ids(const RowBatch *batch, uint32_t *scratch) {
+    if (get_leaf_layout(batch->node) == LEAF_LAYOUT_PAX)
+        return pax_ids(batch->node) + batch->first_cell;
+    for (uint32_t i = 0; i < batch->count; i++)
+        scratch[i] = *leaf_node_key(batch->node, batch->first_cell + i);
+    return scratch;
+}
+
+RowView row_batch_view(const RowBatch *batch, uint32_t index) {
+    return leaf_node_row_view(batch->node, batch->first_cell + index);
+}
+
+
+void table_set_root(Table *table, uint32_t root_page_num) {
+    table->root_page_num = root_page_num;
+    if (table->root_offset == 0)
+        return;
+    void *header = get_page_for_write(table->pager, DB_HEADER_PAGE_NUM);
+    std::memcpy(static_cast<char *>(header) + table->root_offset, &root_page_num, sizeof(root_page_num));
+    unpin_page(table->pager, DB_HEADER_PAGE_NUM);
+}
+
+// The old root split into left and right, grow the tree by one level.
+void create_new_root(Table *table, uint32_t left_page_num, uint32_t key, uint32_t right_page_num) {
+    uint32_t root_page_num = get_unused_page_num(table->pager);
+    void *root = get_page_for_write(table->pager, root_page_num);
+    initialize_internal_node(root);
+    *internal_node_num_keys(root) = 1;
+    *internal_node_child(root, 0) = left_page_num;
+    *internal_node_key(root, 0) = key;
+    *internal_node_right_child(root) = right_page_num;
+    unpin_page(table->pager, root_page_num);
+    table_set_root(table, root_page_num);
+}
+
+void internal_node_insert(Cursor *cursor, uint32_t level, uint32_t left_page_num, uint32_t key,
+                          uint32_t right_page_num);
+
+/*
+ * The node at the given level of the cursor's path (the leaf is at
+ * cursor->depth) was split into left_page_num, whose keys are all <= key,
+ * and right_page_num. Hook the new right sibling into the parent.
+ */
+void btree_insert_into_parent(Cursor *cursor, uint32_t level, uint32_t left_page_num, uint32_t key,
+                              uint32_t right_page_num) {
+    if (level == 0) {
+        create_new_root(cursor->table, left_page_num, key, right_page_num);
+        return;
+    }
+    internal_node_insert(cursor, level - 1, left_page_num, key, right_page_num);
+}
+
+void internal_node_insert(Cursor *cursor, uint32_t level, uint32_t left_page_num, uint32_t key,
+                          uint32_t right_page_num) {
+    Pager *pager = cursor->table->pager;
+    uint32_t page_num = cursor->path_page_num[level];
+    uint32_t index = cursor->path_child_num[level];
+    void *node = get_page_for_write(pager, page_num);
+    uint32_t num_keys = *internal_node_num_keys(node);
+
+    if (num_keys < INTERNAL_NODE_MAX_KEYS) {
+        for (uint32_t i = num_keys; i > index; i--)
+            std::memcpy(internal_node_cell(node, i), internal_node_cell(node, i - 1), INTERNAL_NODE_CELL_SIZE);
+        *internal_node_num_keys(node) = num_keys + 1;
+        *internal_node_child(node, index) = left_page_num;
+        *internal_node_key(node, index) = key;
+        *internal_node_child(node, index + 1) = right_page_num;
+        unpin_page(pager, page_num);
+        return;
+    }
+
+    // Full: lay out all keys and children with the new entry in place, keep
+    // the lower half here, move the upper half to a new node and push the
+    // middle key up a level.
+    uint32_t keys[INTERNAL_NODE_MAX_KEYS + 1];
+    uint32_t children[INTERNAL_NODE_MAX_KEYS + 2];
+    for (uint32_t i = 0; i < num_keys; i++) {
+        keys[i] = *internal_node_key(node, i);
+        children[i] = *internal_node_child(node, i);
+    }
+    children[num_keys] = *internal_node_right_child(node);
+
+    for (uint32_t i = num_keys; i > index; i--)
+        keys[i] = keys[i - 1];
+    keys[index] = key;
+    for (uint32_t i = num_keys + 1; i > index + 1; i--)
+        children[i] = children[i - 1];
+    children[index] = left_page_num;
+    children[index + 1] = right_page_num;
+
+    uint32_t total_keys = INTERNAL_NODE_MAX_KEYS + 1;
+    uint32_t left_keys = total_keys / 2;
+    uint32_t right_keys = total_keys - left_keys - 1;
+
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void *new_node = get_page_for_write(pager, new_page_num);
+    initialize_internal_node(new_node);
+
+    *internal_node_num_keys(node) = left_keys;
+    for (uint32_t i = 0; i < left_keys; i++) {
+        *internal_node_child(node, i) = children[i];
+        *internal_node_key(node, i) = keys[i];
+    }
+    *internal_node_right_child(node) = children[left_keys];
+
+    *internal_node_num_keys(new_node) = right_keys;
+    for (uint32_t i = 0; i < right_keys; i++) {
+        *internal_node_child(new_node, i) = children[left_keys + 1 + i];
+        *internal_node_key(new_node, i) = keys[left_keys + 1 + i];
+    }
+    *internal_node_right_child(new_node) = children[total_keys];
+
+    unpin_page(pager, new_page_num);
+    unpin_page(pager, page_num);
+    btree_insert_into_parent(cursor, level, page_num, keys[left_keys], new_page_num);
+}
+
+// True when the cursor sits past the last cell of the rightmost leaf.
+bool cursor_at_table_end(Cursor *cursor) {
+    Pager *pager = cursor->table->pager;
+    if (cursor->cell_num != *leaf_node_num_cells(cursor->page))
+        return false;
+    for (uint32_t level = 0; level < cursor->depth; level++) {
+        uint32_t parent_page_num = cursor->path_page_num[level];
+        void *parent = get_page(pager, parent_page_num);
+        bool rightmost = cursor->path_child_num[level] == *internal_node_num_keys(parent);
+        unpin_page(pager, parent_page_num);
+        if (!rightmost)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Divide the rows of a full slotted leaf plus the new one between old_node
+ * (left) and new_node (right) so that each gets about half of the bytes.
+ * The rows that move leave holes behind in old_node, to be compacted away
+ * once it runs out of free space. Returns the largest key left in old_node.
+ */
+uint32_t slotted_split_and_insert(void *old_node, void *new_node, uint32_t cell_num, uint32_t key,
+                                  const LeafValue *value) {
+    char scratch[SLOTTED_MAX_CELL_SIZE];
+    const char *new_cell;
+    uint32_t new_length = leaf_value_cell(value, scratch, &new_cell);
+    uint32_t num_cells = *leaf_node_num_cells(old_node);
+    uint32_t total = num_cells + 1;
+
+    // size of the row at index i in the combined order
+    auto cell_size = [&](uint32_t i) -> uint32_t {
+        if (i == cell_num)
+            return new_length + SLOT_SIZE;
+        return *slotted_cell_length(old_node, i < cell_num ? i : i - 1) + SLOT_SIZE;
+    };
+    uint32_t total_bytes = 0;
+    for (uint32_t i = 0; i < total; i++)
+        total_bytes += cell_size(i);
+    uint32_t left_count = 0;
+    uint32_t left_bytes = 0;
+    while (left_count < total - 1 && (left_count == 0 || left_bytes + cell_size(left_count) / 2 < total_bytes / 2)) {
+        left_bytes += cell_size(left_count);
+        left_count++;
+    }
+
+    for (uint32_t i = left_count; i < total; i++) {
+        if (i == cell_num) {
+            slotted_insert_cell(new_node, i - left_count, key, new_cell, new_length);
+        } else {
+            uint32_t old_cell_num = i < cell_num ? i : i - 1;
+            slotted_insert_cell(new_node, i - left_count, *leaf_node_key(old_node, old_cell_num),
+                                slotted_cell(old_node, old_cell_num), *slotted_cell_length(old_node, old_cell_num));
+        }
+    }
+
+    uint32_t kept = cell_num < left_count ? left_count - 1 : left_count;
+    for (uint32_t i = kept; i < num_cells; i++)
+        *slotted_fragmented(old_node) += *slotted_cell_length(old_node, i);
+    *leaf_node_num_cells(old_node) = kept;
+    if (cell_num < left_count)
+        slotted_insert_cell(old_node, cell_num, key, new_cell, new_length);
+
+    return *leaf_node_key(old_node, left_count - 1);
+}
+
+void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, const LeafValue *value) {
+    Pager *pager = cursor->table->pager;
+    bool append = cursor_at_table_end(cursor);
+    void *old_node = get_page_for_write(pager, cursor->page_num);
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void *new_node = get_page_for_write(pager, new_page_num);
+    initialize_leaf_node(new_node, get_leaf_layout(old_node));
+    uint32_t split_key;
+
+    if (append) {
+        // Appending ids in increasing order is the common case, splitting
+        // in half there would leave every leaf half empty forever.
+        leaf_node_insert_value(new_node, 0, key, value);
+        split_key = *leaf_node_key(old_node, *leaf_node_num_cells(old_node) - 1);
+    } else if (get_leaf_layout(old_node) == LEAF_LAYOUT_SLOTTED) {
+        split_key = slotted_split_and_insert(old_node, new_node, cursor->cell_num, key, value);
+    } else {
+        // All existing keys plus the new one are divided evenly between the
+        // old (left) and new (right) nodes.
+        uint32_t cell_num = cursor->cell_num;
+        if (cell_num >= LEAF_NODE_LEFT_SPLIT_COUNT) {
+            uint32_t new_cell_num = cell_num - LEAF_NODE_LEFT_SPLIT_COUNT;
+            leaf_node_copy_cells(new_node, 0, old_node, LEAF_NODE_LEFT_SPLIT_COUNT, new_cell_num);
+            leaf_node_serialize_row(new_node, new_cell_num, value->row);
+            leaf_node_copy_cells(new_node, new_cell_num + 1, old_node, cell_num, LEAF_NODE_MAX_CELLS - cell_num);
+        } else {
+            leaf_node_copy_cells(new_node, 0, old_node, LEAF_NODE_LEFT_SPLIT_COUNT - 1, LEAF_NODE_RIGHT_SPLIT_COUNT);
+            leaf_node_copy_cells(old_node, cell_num + 1, old_node, cell_num, LEAF_NODE_LEFT_SPLIT_COUNT - 1 - cell_num);
+            leaf_node_serialize_row(old_node, cell_num, value->row);
+        }
+
+        *leaf_node_num_cells(old_node) = LEAF_NODE_LEFT_SPLIT_COUNT;
+        *leaf_node_num_cells(new_node) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+        split_key = *leaf_node_key(old_node, LEAF_NODE_LEFT_SPLIT_COUNT - 1);
+    }
+
+    unpin_page(pager, new_page_num);
+    unpin_page(pager, cursor->page_num);
+    btree_insert_into_parent(cursor, cursor->depth, cursor->page_num, split_key, new_page_num);
+}
+
+// Insert value under key at the cursor's position.
+void leaf_node_insert(Cursor *cursor, uint32_t key, const LeafValue *value) {
+    Pager *pager = cursor->table->pager;
+    if (!leaf_node_value_fits(cursor->page, value)) {
+        leaf_node_split_and_insert(cursor, key, value);
+        return;
+    }
+
+    void *node = get_page_for_write(pager, cursor->page_num);
+    leaf_node_insert_value(node, cursor->cell_num, key, value);
+    unpin_page(pager, cursor->page_num);
+}
+
+// Insert value under key into the B+tree of table, which may be an index.
+ExecuteResult btree_insert_value(Table *table, uint32_t key, const LeafValue *value) {
+    Cursor *cursor = table_seek(table, nullptr, key, true, 0);
+
+    // A split can cascade all the way up and add a new root.
+    if (!leaf_node_value_fits(cursor->page, value) &&
+        static_cast<uint64_t>(table->pager->num_pages) + cursor->depth + 2 >= INVALID_PAGE_NUM) {
+        cursor_close(cursor);
+        return EXECUTE_TABLE_FULL;
+    }
+
+    leaf_node_insert(cursor, key, value);
+    cursor_close(cursor);
+
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult btree_insert(Table *table, uint32_t key, Row *value) {
+    LeafValue leaf_value = leaf_value_row(value);
+    return btree_insert_value(table, key, &leaf_value);
+}
+
+/*
+ * The node at the given level of the cursor's path (the leaf is at
+ * cursor->depth) has nothing left under it. Take it out of its parent and
+ * put its page on the free list. A parent left without children goes the
+ * same way, except for the root, which turns back into an empty leaf.
+ */
+void btree_remove_node(Cursor *cursor, uint32_t level) {
+    Table *table = cursor->table;
+    Pager *pager = table->pager;
+    if (level == 0) {
+        void *root = get_page_for_write(pager, table->root_page_num);
+        initialize_leaf_node(root, static_cast<LeafLayout>(table->leaf_layout));
+        unpin_page(pager, table->root_page_num);
+        return;
+    }
+    free_page(pager, level == cursor->depth ? cursor->page_num : cursor->path_page_num[level]);
+
+    uint32_t parent_page_num = cursor->path_page_num[level - 1];
+    void *parent = get_page_for_write(pager, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    if (num_keys > 0)
+        internal_node_remove_child(parent, cursor->path_child_num[level - 1]);
+    unpin_page(pager, parent_page_num);
+    if (num_keys == 0)
+        btree_remove_node(cursor, level - 1);
+}
+
+// While the root is an internal node with a single child, make that child the root.
+void btree_collapse_root(Table *table) {
+    Pager *pager = table->pager;
+    while (true) {
+        uint32_t root_page_num = table->root_page_num;
+        void *root = get_page(pager, root_page_num);
+        bool single_child = get_node_type(root) == NODE_INTERNAL && *internal_node_num_keys(root) == 0;
+        uint32_t child_page_num = *internal_node_right_child(root);
+        unpin_page(pager, root_page_num);
+        if (!single_child)
+            return;
+        table_set_root(table, child_page_num);
+        free_page(pager, root_page_num);
+    }
+}
+
+/*
+ * Remove the row under a cursor on the latest version of the tree, after
+ * which the cursor is only good for cursor_close(). Leaves are not merged:
+ * one that is left empty goes to the free list, and a leaf that is merely
+ * sparse waits for a vacuum.
+ */
+void btree_delete(Cursor *cursor) {
+    Pager *pager = cursor->table->pager;
+    cursor_put_page(cursor, cursor->page_num, cursor->page_pinned);
+    cursor->page = nullptr;
+
+    void *node = get_page_for_write(pager, cursor->page_num);
+    leaf_node_remove_cell(node, cursor->cell_num);
+    bool empty = *leaf_node_num_cells(node) == 0;
+    unpin_page(pager, cursor->page_num);
+    if (empty && cursor->depth > 0) {
+        btree_remove_node(cursor, cursor->depth);
+        btree_collapse_root(cursor->table);
+    }
+}
+
+/*
+ * A transaction keeps every page it changes pinned until it commits, so it
+ * has to stop short of filling the buffer pool. Statements outside of one
+ * commit on their own well before that.
+ */
+bool transaction_full(Table *table) {
+    return table->pager->write_set.size() >= table->pager->num_frames / 2;
+}
+
+/*
+ * Secondary indexes on username and email. An index is a B+tree of its own
+ * in the same file, with slotted leaves keyed on a hash of the value. Its
+ * entries are rows that hold the id of the indexed row and the value, so a
+ * lookup can pass over entries that merely share the hash without going to
+ * the table for them.
+ */
+uint32_t index_hash(const char *value, uint32_t length) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < length; i++) {
+        hash ^= static_cast<uint8_t>(value[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Fill in the entry for a row with this id and value, and return its key.
+uint32_t index_entry(IndexColumn column, uint32_t id, const char *value, uint32_t length, Row *entry) {
+    entry->id = id;
+    entry->username[0] = '\0';
+    entry->email[0] = '\0';
+    char *destination = column == INDEX_USERNAME ? entry->username : entry->email;
+    std::memcpy(destination, value, length);
+    destination[length] = '\0';
+    return index_hash(value, length);
+}
+
+ExecuteResult index_insert_row(Table *table, Row *row) {
+    for (uint32_t column = 0; column < INDEX_COLUMNS; column++) {
+        if (table->indexes[column] == nullptr)
+            continue;
+        Row entry;
+        uint32_t key;
+        if (column == INDEX_USERNAME)
+            key = index_entry(INDEX_USERNAME, row->id, row->username, strnlen(row->username, COLUMN_USERNAME_SIZE),
+                              &entry);
+        else
+            key = index_entry(INDEX_EMAIL, row->id, row->email, strnlen(row->email, COLUMN_EMAIL_SIZE), &entry);
+        ExecuteResult result = btree_insert(table->indexes[column], key, &entry);
+        if (result != EXECUTE_SUCCESS)
+            return result;
+    }
+    return EXECUTE_SUCCESS;
+}
+
+// Remove the entries index_insert_row() made for row.
+void index_delete_row(Table *table, const Row *row) {
+    for (uint32_t column = 0; column < INDEX_COLUMNS; column++) {
+        if (table->indexes[column] == nullptr)
+            continue;
+        const char *value = column == INDEX_USERNAME ? row->username : row->email;
+        uint32_t length = strnlen(value, column == INDEX_USERNAME ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE);
+        uint32_t key = index_hash(value, length);
+        Cursor *cursor = table_find(table->indexes[column], nullptr, key);
+        while (!cursor->end_of_table && cursor_key(cursor) == key) {
+            RowView entry = cursor_row_view(cursor);
+            const char *entry_value = column == INDEX_USERNAME ? entry.username : entry.email;
+            uint32_t entry_length = column == INDEX_USERNAME ? entry.username_length : entry.email_length;
+            if (entry.id == row->id && entry_length == length && std::memcmp(entry_value, value, length) == 0) {
+                btree_delete(cursor);
+                break;
+            }
+            cursor_advance(cursor);
+        }
+        cursor_close(cursor);
+    }
+}
+
+// Set up the fields every table starts with: no rows counted yet, no
+// indexes, no output and no scan workers. The caller sets what differs.
+void table_init(Table *table, Pager *pager, uint32_t root_offset, uint32_t root_page_num, LeafLayout leaf_layout) {
+    table->root_page_num = root_page_num;
+    table->root_offset = root_offset;
+    table->leaf_layout = leaf_layout;
+    table->pager = pager;
+    table->scan_pool = nullptr;
+    table->in_transaction = false;
+    table->output = nullptr;
+    table->num_rows = ROW_COUNT_UNKNOWN;
+    table->row_count_stale = true;
+    table->ids = nullptr;
+    for (uint32_t i = 0; i < INDEX_COLUMNS; i++)
+        table->indexes[i] = nullptr;
+    table->schema = nullptr;
+}
+
+// Set up the in memory side of the index on column, whose root is root_page_num.
+Table *index_open(Table *table, IndexColumn column, uint32_t root_page_num) {
+    Table *index = new Table();
+    table_init(index, table->pager, DB_HEADER_INDEX_ROOT_OFFSET + column * DB_HEADER_INDEX_ROOT_SIZE, root_page_num,
+               LEAF_LAYOUT_SLOTTED);
+    return index;
+}
+
+/*
+ * The catalog: an entry per created table, back to back from
+ * DB_HEADER_CATALOG_OFFSET, each
+ *
+ *   uint32 root page
+ *   uint8 name length, the name
+ *   uint8 number of columns
+ *   per column: uint8 type, uint8 size, uint8 name length, the name
+ *
+ * Entries never move once written, so the root page of each is kept up to
+ * date in place, like that of the users table, see table_set_root().
+ */
+char *catalog_put_name(char *position, const char *name) {
+    uint8_t length = std::strlen(name);
+    *position++ = static_cast<char>(length);
+    std::memcpy(position, name, length);
+    return position + length;
+}
+
+const char *catalog_get_name(const char *position, char *name) {
+    uint8_t length = static_cast<uint8_t>(*position++);
+    if (length > TABLE_NAME_SIZE) {
+        std::cout << "Corrupt catalog.\n";
+        exit(EXIT_FAILURE);
+    }
+    std::memcpy(name, position, length);
+    name[length] = '\0';
+    return position + length;
+}
+
+uint32_t catalog_entry_size(const Schema *schema) {
+    uint32_t size = sizeof(uint32_t) + 1 + std::strlen(schema->name) + 1;
+    for (uint32_t i = 0; i < schema->num_columns; i++)
+        size += 3 + std::strlen(schema->columns[i].name);
+    return size;
+}
+
+void catalog_write_entry(char *entry, const Schema *schema, uint32_t root_page_num) {
+    std::memcpy(entry, &root_page_num, sizeof(root_page_num));
+    char *position = catalog_put_name(entry + sizeof(root_page_num), schema->name);
+    *position++ = static_cast<char>(schema->num_columns);
+    for (uint32_t i = 0; i < schema->num_columns; i++) {
+        const Column *column = &(schema->columns[i]);
+        *position++ = static_cast<char>(column->type);
+        *position++ = static_cast<char>(column->size);
+        position = catalog_put_name(position, column->name);
+    }
+}
+
+// Set up the in memory side of a created table, whose root the header keeps at root_offset.
+Table *catalog_open_table(Table *table, Schema *schema, uint32_t root_offset, uint32_t root_page_num) {
+    Table *created = new Table();
+    table_init(created, table->pager, root_offset, root_page_num, LEAF_LAYOUT_SLOTTED);
+    schema_prepare(schema);
+    created->schema = schema;
+    table->tables.push_back(created);
+    return created;
+}
+
+// Open every table of the catalog in header.
+void catalog_load(Table *table, const char *header) {
+    uint32_t size;
+    std::memcpy(&size, header + DB_HEADER_CATALOG_SIZE_OFFSET, DB_HEADER_CATALOG_SIZE_SIZE);
+    if (size > PAGE_SIZE - DB_HEADER_CATALOG_OFFSET) {
+        std::cout << "Corrupt catalog.\n";
+        exit(EXIT_FAILURE);
+    }
+    uint32_t offset = DB_HEADER_CATALOG_OFFSET;
+    while (offset < DB_HEADER_CATALOG_OFFSET + size) {
+        Schema *schema = new Schema();
+        uint32_t root_page_num;
+        std::memcpy(&root_page_num, header + offset, sizeof(root_page_num));
+        const char *position = catalog_get_name(header + offset + sizeof(root_page_num), schema->name);
+        schema->num_columns = static_cast<uint8_t>(*position++);
+        if (schema->num_columns == 0 || schema->num_columns > MAX_TABLE_COLUMNS) {
+            std::cout << "Corrupt catalog.\n";
+            exit(EXIT_FAILURE);
+        }
+        for (uint32_t i = 0; i < schema->num_columns; i++) {
+            Column *column = &(schema->columns[i]);
+            column->type = static_cast<ColumnType>(static_cast<uint8_t>(*position++));
+            column->size = static_cast<uint8_t>(*position++);
+            position = catalog_get_name(position, column->name);
+        }
+        catalog_open_table(table, schema, offset, root_page_num);
+        offset = position - header;
+    }
+}
+
+Table *catalog_find_table(Table *table, const std::string &name) {
+    for (Table *created : table->tables) {
+        if (name == created->schema->name)
+            return created;
+    }
+    return nullptr;
+}
+
+/*
+ * create table: give the new table an empty root leaf and add its entry
+ * to the catalog, both of which commit with the statement.
+ */
+ExecuteResult catalog_create_table(Table *table, const std::string &name, const std::vector<Column> &columns) {
+    if (name == "users" || catalog_find_table(table, name) != nullptr)
+        return EXECUTE_TABLE_EXISTS;
+    if (table->in_transaction && transaction_full(table))
+        return EXECUTE_TRANSACTION_FULL;
+
+    Schema *schema = new Schema();
+    std::strcpy(schema->name, name.c_str());
+    schema->num_columns = columns.size();
+    std::copy(columns.begin(), columns.end(), schema->columns);
+
+    Pager *pager = table->pager;
+    uint32_t size = catalog_entry_size(schema);
+    uint32_t used;
+    char *header = static_cast<char *>(get_page(pager, DB_HEADER_PAGE_NUM));
+    std::memcpy(&used, header + DB_HEADER_CATALOG_SIZE_OFFSET, DB_HEADER_CATALOG_SIZE_SIZE);
+    unpin_page(pager, DB_HEADER_PAGE_NUM);
+    if (DB_HEADER_CATALOG_OFFSET + used + size > PAGE_SIZE) {
+        delete schema;
+        return EXECUTE_CATALOG_FULL;
+    }
+
+    uint32_t root_page_num = get_unused_page_num(pager);
+    void *root = get_page_for_write(pager, root_page_num);
+    initialize_leaf_node(root, LEAF_LAYOUT_SLOTTED);
+    unpin_page(pager, root_page_num);
+
+    uint32_t offset = DB_HEADER_CATALOG_OFFSET + used;
+    header = static_cast<char *>(get_page_for_write(pager, DB_HEADER_PAGE_NUM));
+    catalog_write_entry(header + offset, schema, root_page_num);
+    used += size;
+    std::memcpy(header + DB_HEADER_CATALOG_SIZE_OFFSET, &used, DB_HEADER_CATALOG_SIZE_SIZE);
+    unpin_page(pager, DB_HEADER_PAGE_NUM);
+    catalog_open_table(table, schema, offset, root_page_num);
+    return EXECUTE_SUCCESS;
+}
+
+// An index entry waiting to be inserted, see index_insert_entries().
+typedef struct {
+    uint32_t key;
+    uint32_t id;
+    std::string value;
+} IndexEntry;
+
+void index_add_entry(std::vector<IndexEntry> *entries, uint32_t id, const char *value, uint32_t length) {
+    IndexEntry entry;
+    entry.value.assign(value, length);
+    entry.key = index_hash(entry.value.data(), entry.value.size());
+    entry.id = id;
+    entries->push_back(entry);
+}
+
+/*
+ * Insert many entries into an index at once. Sorted by key they are
+ * appended to the index leaf after leaf rather than scattered over it.
+ * Outside of a transaction they are committed in pieces, like a bulk load.
+ */
+ExecuteResult index_insert_entries(Table *table, Table *index, IndexColumn column, std::vector<IndexEntry> *entries) {
+    Pager *pager = table->pager;
+    std::sort(entries->begin(), entries->end(), [](const IndexEntry &a, const IndexEntry &b) {
+        return a.key < b.key || (a.key == b.key && a.id < b.id);
+    });
+    for (const IndexEntry &entry : *entries) {
+        if (table->in_transaction && transaction_full(table))
+            return EXECUTE_TRANSACTION_FULL;
+        if (!table->in_transaction && pager->write_set.size() >= std::max(pager->num_frames / 4, 1u))
+            pager_commit(pager);
+        Row row;
+        index_entry(column, entry.id, entry.value.data(), entry.value.size(), &row);
+        ExecuteResult result = btree_insert(index, entry.key, &row);
+        if (result != EXECUTE_SUCCESS)
+            return result;
+    }
+    return EXECUTE_SUCCESS;
+}
+
+void id_set_init(IdSet *set, uint64_t capacity) {
+    uint32_t log2_slots = 0;
+    while ((1ULL << log2_slots) < std::max(2 * capacity, static_cast<uint64_t>(ID_SET_MIN_SLOTS)))
+        log2_slots += 1;
+    set->slots.assign(1ULL << log2_slots, ID_SET_EMPTY);
+    set->shift = 64 - log2_slots;
+    set->count = 0;
+    set->has_empty_id = false;
+}
+
+// Fibonacci hashing, so that runs of consecutive ids spread over the slots.
+uint64_t id_set_slot(const IdSet *set, uint32_t id) {
+    return (static_cast<uint64_t>(id) * 0x9E3779B97F4A7C15ULL) >> set->shift;
+}
+
+bool id_set_contains(const IdSet *set, uint32_t id) {
+    if (id == ID_SET_EMPTY)
+        return set->has_empty_id;
+    uint64_t mask = set->slots.size() - 1;
+    for (uint64_t slot = id_set_slot(set, id);; slot = (slot + 1) & mask) {
+        if (set->slots[slot] == id)
+            return true;
+        if (set->slots[slot] == ID_SET_EMPTY)
+            return false;
+    }
+}
+
+// Add id, false if it was there already.
+bool id_set_insert(IdSet *set, uint32_t id) {
+    if (id == ID_SET_EMPTY) {
+        bool added = !set->has_empty_id;
+        set->has_empty_id = true;
+        return added;
+    }
+    if (2 * (set->count + 1) > set->slots.size()) {
+        std::vector<uint32_t> old_slots;
+        old_slots.swap(set->slots);
+        id_set_init(set, old_slots.size());
+        bool has_empty_id = set->has_empty_id;
+        for (uint32_t old_id : old_slots) {
+            if (old_id != ID_SET_EMPTY)
+                id_set_insert(set, old_id);
+        }
+        set->has_empty_id = has_empty_id;
+    }
+    uint64_t mask = set->slots.size() - 1;
+    for (uint64_t slot = id_set_slot(set, id);; slot = (slot + 1) & mask) {
+        if (set->slots[slot] == id)
+            return false;
+        if (set->slots[slot] == ID_SET_EMPTY) {
+            set->slots[slot] = id;
+            set->count += 1;
+            return true;
+        }
+    }
+}
+
+// Remove id, false if it was not there.
+bool id_set_erase(IdSet *set, uint32_t id) {
+    if (id == ID_SET_EMPTY) {
+        bool removed = set->has_empty_id;
+        set->has_empty_id = false;
+        return removed;
+    }
+    uint64_t mask = set->slots.size() - 1;
+    uint64_t hole = id_set_slot(set, id);
+    while (set->slots[hole] != id) {
+        if (set->slots[hole] == ID_SET_EMPTY)
+            return false;
+        hole = (hole + 1) & mask;
+    }
+
+    // Shift later ids of the same probe run back into the hole so that
+    // lookups never stop early at an empty slot.
+    for (uint64_t slot = (hole + 1) & mask; set->slots[slot] != ID_SET_EMPTY; slot = (slot + 1) & mask) {
+        uint64_t home = id_set_slot(set, set->slots[slot]);
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            set->slots[hole] = set->slots[slot];
+            hole = slot;
+        }
+    }
+    set->slots[hole] = ID_SET_EMPTY;
+    set->count -= 1;
+    return true;
+}
+
+/*
+ * The ids of the table, which inserts check to keep them unique. The set
+ * is built from the leaves by the first insert of a session, so opening
+ * the db to read it costs nothing extra. Ids repeated in a file written
+ * before they had to be unique stay as they are.
+ */
+IdSet *table_id_set(Table *table) {
+    if (table->ids != nullptr)
+        return table->ids;
+    table->ids = new IdSet();
+    id_set_init(table->ids, table->num_rows != ROW_COUNT_UNKNOWN ? table->num_rows : 0);
+    Cursor *cursor = table_start(table);
+    RowBatch batch;
+    while (cursor_next_batch(cursor, &batch) > 0) {
+        for (uint32_t i = 0; i < batch.count; i++)
+            id_set_insert(table->ids, *leaf_node_key(batch.node, batch.first_cell + i));
+    }
+    cursor_close(cursor);
+    return table->ids;
+}
+
+/*
+ * The header holds the row count as of the last clean close only, so the
+ * first change of a session marks it unknown, committed along with the
+ * change, and db_close() writes it back.
+ */
+void table_row_count_changed(Table *table) {
+    if (table->row_count_stale)
+        return;
+    uint64_t unknown = 0;
+    void *header = get_page_for_write(table->pager, DB_HEADER_PAGE_NUM);
+    std::memcpy(static_cast<char *>(header) + DB_HEADER_ROW_COUNT_OFFSET, &unknown, DB_HEADER_ROW_COUNT_SIZE);
+    unpin_page(table->pager, DB_HEADER_PAGE_NUM);
+    table->row_count_stale = true;
+}
+
+// Account for a row that went into the table.
+void table_add_row(Table *table, uint32_t id) {
+    id_set_insert(table_id_set(table), id);
+    table_row_count_changed(table);
+    if (table->num_rows != ROW_COUNT_UNKNOWN)
+        table->num_rows += 1;
+}
+
+// Account for a row that left the table.
+void table_remove_row(Table *table, uint32_t id) {
+    if (table->ids != nullptr)
+        id_set_erase(table->ids, id);
+    table_row_count_changed(table);
+    if (table->num_rows != ROW_COUNT_UNKNOWN)
+        table->num_rows -= 1;
+}
+
+// Insert row into the table and every index it has, unless its id is taken.
+ExecuteResult table_insert(Table *table, Row *row_to_insert) {
+    if (id_set_contains(table_id_set(table), row_to_insert->id))
+        return EXECUTE_DUPLICATE_KEY;
+    ExecuteResult result = btree_insert(table, row_to_insert->id, row_to_insert);
+    if (result != EXECUTE_SUCCESS)
+        return result;
+    table_add_row(table, row_to_insert->id);
+    return index_insert_row(table, row_to_insert);
+}
+
+// The id every row of the cursor's leaf is below, false for the rightmost leaf.
+bool cursor_leaf_upper_bound(Cursor *cursor, uint32_t *bound) {
+    Pager *pager = cursor->table->pager;
+    for (uint32_t level = cursor->depth; level > 0; level--) {
+        uint32_t page_num = cursor->path_page_num[level - 1];
+        void *node = get_page(pager, page_num);
+        uint32_t child_num = cursor->path_child_num[level - 1];
+        bool found = child_num < *internal_node_num_keys(node);
+        if (found)
+            *bound = *internal_node_key(node, child_num);
+        unpin_page(pager, page_num);
+        if (found)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Insert rows, sorting them by id first. All the rows that belong in the
+ * same leaf go in under a single pin of it, and only a row that needs a
+ * split takes the one row at a time path. Outside of a transaction the
+ * rows are committed in pieces if they would pin too much of the pool.
+ * An id that is taken, or given twice, turns away all of the rows.
+ */
+ExecuteResult table_insert_rows(Table *table, std::vector<Row> *rows) {
+    Pager *pager = table->pager;
+    std::sort(rows->begin(), rows->end(), [](const Row &a, const Row &b) { return a.id < b.id; });
+    IdSet *ids = table_id_set(table);
+    for (size_t i = 0; i < rows->size(); i++) {
+        if (id_set_contains(ids, (*rows)[i].id) || (i > 0 && (*rows)[i].id == (*rows)[i - 1].id))
+            return EXECUTE_DUPLICATE_KEY;
+    }
+
+    size_t next = 0;
+    while (next < rows->size()) {
+        if (table->in_transaction && transaction_full(table))
+            return EXECUTE_TRANSACTION_FULL;
+        if (!table->in_transaction && pager->write_set.size() >= std::max(pager->num_frames / 4, 1u))
+            pager_commit(pager);
+
+        Row *row = &((*rows)[next]);
+        Cursor *cursor = table_seek(table, nullptr, row->id, true, 0);
+        if (!leaf_node_has_room(cursor->page, row)) {
+            cursor_close(cursor);
+            ExecuteResult result = table_insert(table, row);
+            if (result != EXECUTE_SUCCESS)
+                return result;
+            next += 1;
+            continue;
+        }
+
+        uint32_t bound;
+        bool bounded = cursor_leaf_upper_bound(cursor, &bound);
+        void *node = get_page_for_write(pager, cursor->page_num);
+        size_t first = next;
+        while (next < rows->size()) {
+            row = &((*rows)[next]);
+            if ((bounded && row->id >= bound) || !leaf_node_has_room(node, row))
+                break;
+            leaf_node_insert_row(node, leaf_node_find_cell(node, row->id, true), row->id, row);
+            table_add_row(table, row->id);
+            next += 1;
+        }
+        unpin_page(pager, cursor->page_num);
+        cursor_close(cursor);
+
+        // the index entries of the rows just added to the leaf
+        for (size_t i = first; i < next; i++) {
+            ExecuteResult result = index_insert_row(table, &((*rows)[i]));
+            if (result != EXECUTE_SUCCESS)
+                return result;
+        }
+    }
+    return EXECUTE_SUCCESS;
+}
+
+// The fields of a row of insert into as values for the columns of schema, false if they do not fit.
+bool record_parse(const Schema *schema, const std::vector<std::string> &fields, Value *values) {
+    if (fields.size() != schema->num_columns)
+        return false;
+    for (uint32_t i = 0; i < schema->num_columns; i++) {
+        const Column *column = &(schema->columns[i]);
+        const std::string &field = fields[i];
+        if (column->type != COLUMN_INT) {
+            if (field.size() > column->size)
+                return false;
+            values[i].text = field.data();
+            values[i].length = field.size();
+            continue;
+        }
+        const char *digits = field.c_str() + (field[0] == '-' ? 1 : 0);
+        if (*digits == '\0' || std::strspn(digits, "0123456789") != std::strlen(digits))
+            return false;
+        errno = 0;
+        values[i].number = std::strtoll(field.c_str(), nullptr, 10);
+        if (errno == ERANGE)
+            return false;
+    }
+    // the first column is the key
+    return values[0].number >= 0 && values[0].number <= UINT32_MAX;
+}
+
+// A row of insert into, encoded, see table_insert_records().
+typedef struct {
+    uint32_t key;
+    std::string record;
+} EncodedRecord;
+
+/*
+ * insert into a created table. Every row is encoded up front, so that one
+ * that does not fit the columns, or a key that is taken or given twice,
+ * turns away all of them. Outside of a transaction the rows are committed
+ * in pieces, as in table_insert_rows().
+ */
+ExecuteResult table_insert_records(Table *table, Table *created, const std::vector<std::vector<std::string>> &rows) {
+    const Schema *schema = created->schema;
+    std::vector<EncodedRecord> records(rows.size());
+    for (size_t i = 0; i < rows.size(); i++) {
+        Value values[MAX_TABLE_COLUMNS];
+        char record[RECORD_MAX_SIZE];
+        if (!record_parse(schema, rows[i], values))
+            return EXECUTE_BAD_VALUES;
+        records[i].key = values[0].number;
+        records[i].record.assign(record, schema->encode(schema, values, record));
+    }
+    std::sort(records.begin(), records.end(),
+              [](const EncodedRecord &a, const EncodedRecord &b) { return a.key < b.key; });
+    IdSet *ids = table_id_set(created);
+    for (size_t i = 0; i < records.size(); i++) {
+        if (id_set_contains(ids, records[i].key) || (i > 0 && records[i].key == records[i - 1].key))
+            return EXECUTE_DUPLICATE_KEY;
+    }
+
+    Pager *pager = table->pager;
+    for (const EncodedRecord &record : records) {
+        if (table->in_transaction && transaction_full(table))
+            return EXECUTE_TRANSACTION_FULL;
+        if (!table->in_transaction && pager->write_set.size() >= std::max(pager->num_frames / 4, 1u))
+            pager_commit(pager);
+        LeafValue value = {nullptr, record.record.data(), static_cast<uint32_t>(record.record.size())};
+        ExecuteResult result = btree_insert_value(created, record.key, &value);
+        if (result != EXECUTE_SUCCESS)
+            return result;
+        table_add_row(created, record.key);
+    }
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_insert(Statement *statement, Table *table) {
+    if (table->in_transaction && transaction_full(table))
+        return EXECUTE_TRANSACTION_FULL;
+    if (!statement->table.empty()) {
+        Table *created = catalog_find_table(table, statement->table);
+        if (created == nullptr)
+            return EXECUTE_NO_SUCH_TABLE;
+        return table_insert_records(table, created, statement->records);
+    }
+    if (!statement->rows.empty())
+        return table_insert_rows(table, &(statement->rows));
+    return table_insert(table, &(statement->row_to_insert));
+}
+
+/*
+ * Bulk loading. Rows loaded into an empty table in id order are appended
+ * to leaves that are filled to the brim and never split, and the internal
+ * levels are built bottom-up from the finished leaves at the end. The
+ * first row that comes out of order finishes that tree, and it and the
+ * rest go through the usual insert path. Either way the load commits a
+ * batch at a time, whenever the pages it has written fill a quarter of
+ * the buffer pool, rather than once per row.
+ */
+typedef struct {
+    Table *table;
+    bool bottom_up;
+    uint32_t leaf_page_num; // leaf being filled, pinned
+    void *leaf;
+    std::vector<uint32_t> level_pages; // finished leaves and their largest keys
+    std::vector<uint32_t> level_keys;
+    uint32_t last_id;
+    uint64_t rows;
+    std::vector<IndexEntry> index_entries[INDEX_COLUMNS]; // of rows loaded bottom-up
+} BulkLoader;
+
+void bulk_load_maybe_commit(BulkLoader *loader) {
+    Pager *pager = loader->table->pager;
+    if (pager->write_set.size() >= std::max(pager->num_frames / 4, 1u))
+        pager_commit(pager);
+}
+
+// A new page, off the free list or from the end of the file, pinned for write.
+void *bulk_load_new_page(BulkLoader *loader, uint32_t *page_num) {
+    *page_num = get_unused_page_num(loader->table->pager);
+    return get_page_for_write(loader->table->pager, *page_num);
+}
+
+// The leaf being filled is full, start the next one.
+void bulk_load_next_leaf(BulkLoader *loader) {
+    Table *table = loader->table;
+    loader->level_pages.push_back(loader->leaf_page_num);
+    loader->level_keys.push_back(loader->last_id);
+    unpin_page(table->pager, loader->leaf_page_num);
+    bulk_load_maybe_commit(loader);
+    loader->leaf = bulk_load_new_page(loader, &(loader->leaf_page_num));
+    initialize_leaf_node(loader->leaf, static_cast<LeafLayout>(table->leaf_layout));
+}
+
+// Stack the internal levels on top of the finished leaves and make the result the root.
+void bulk_load_build_tree(BulkLoader *loader) {
+    Table *table = loader->table;
+    Pager *pager = table->pager;
+    loader->level_pages.push_back(loader->leaf_page_num);
+    loader->level_keys.push_back(loader->last_id);
+    unpin_page(pager, loader->leaf_page_num);
+    loader->leaf = nullptr;
+
+    std::vector<uint32_t> pages;
+    std::vector<uint32_t> keys;
+    while (loader->level_pages.size() > 1) {
+        // spread the children evenly, so no node ends up with a single one
+        uint32_t count = loader->level_pages.size();
+        uint32_t num_nodes = (count + INTERNAL_NODE_MAX_KEYS) / (INTERNAL_NODE_MAX_KEYS + 1);
+        pages.clear();
+        keys.clear();
+        for (uint32_t node_num = 0; node_num < num_nodes; node_num++) {
+            uint32_t first = static_cast<uint64_t>(count) * node_num / num_nodes;
+            uint32_t last = static_cast<uint64_t>(count) * (node_num + 1) / num_nodes;
+            uint32_t page_num;
+            void *node = bulk_load_new_page(loader, &page_num);
+            initialize_internal_node(node);
+            *internal_node_num_keys(node) = last - first - 1;
+            for (uint32_t child = first; child < last - 1; child++) {
+                *internal_node_child(node, child - first) = loader->level_pages[child];
+                *internal_node_key(node, child - first) = loader->level_keys[child];
+            }
+            *internal_node_right_child(node) = loader->level_pages[last - 1];
+            unpin_page(pager, page_num);
+            pages.push_back(page_num);
+            keys.push_back(loader->level_keys[last - 1]);
+            bulk_load_maybe_commit(loader);
+        }
+        loader->level_pages.swap(pages);
+        loader->level_keys.swap(keys);
+    }
+    table_set_root(table, loader->level_pages[0]);
+    loader->level_pages.clear();
+    loader->level_keys.clear();
+    loader->bottom_up = false;
+}
+
+BulkLoader *bulk_load_begin(Table *table) {
+    // before the loader pins a leaf of its own
+    table_id_set(table);
+    BulkLoader *loader = new BulkLoader();
+    loader->table = table;
+    loader->rows = 0;
+    loader->last_id = 0;
+    loader->leaf = nullptr;
+
+    void *root = get_page(table->pager, table->root_page_num);
+    loader->bottom_up = get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+    unpin_page(table->pager, table->root_page_num);
+    if (loader->bottom_up) {
+        // the empty root becomes the first leaf
+        loader->leaf_page_num = table->root_page_num;
+        loader->leaf = get_page_for_write(table->pager, loader->leaf_page_num);
+        initialize_leaf_node(loader->leaf, static_cast<LeafLayout>(table->leaf_layout));
+    }
+    return loader;
+}
+
+ExecuteResult bulk_load_row(BulkLoader *loader, Row *row) {
+    Table *table = loader->table;
+    if (loader->bottom_up && loader->rows > 0 && row->id < loader->last_id)
+        bulk_load_build_tree(loader);
+
+    if (!loader->bottom_up) {
+        ExecuteResult result = table_insert(table, row);
+        if (result == EXECUTE_SUCCESS)
+            loader->rows += 1;
+        bulk_load_maybe_commit(loader);
+        return result;
+    }
+
+    if (id_set_contains(table_id_set(table), row->id))
+        return EXECUTE_DUPLICATE_KEY;
+    if (!leaf_node_has_room(loader->leaf, row)) {
+        // room for the next leaf and, at worst, one internal node per leaf
+        if (static_cast<uint64_t>(table->pager->num_pages) + loader->level_pages.size() + BTREE_MAX_DEPTH >=
+            INVALID_PAGE_NUM)
+            return EXECUTE_TABLE_FULL;
+        bulk_load_next_leaf(loader);
+    }
+    leaf_node_insert_row(loader->leaf, *leaf_node_num_cells(loader->leaf), row->id, row);
+    loader->last_id = row->id;
+    loader->rows += 1;
+    table_add_row(table, row->id);
+    // committing now would cut into the leaf being filled, index the row at the end
+    for (uint32_t column = 0; column < INDEX_COLUMNS; column++) {
+        if (table->indexes[column] != nullptr)
+            index_add_entry(&(loader->index_entries[column]), row->id, column == INDEX_USERNAME ? row->username : row->email,
+                            column == INDEX_USERNAME ? strnlen(row->username, COLUMN_USERNAME_SIZE)
+                                                     : strnlen(row->email, COLUMN_EMAIL_SIZE));
+    }
+    return EXECUTE_SUCCESS;
+}
+
+// Finish the tree and commit the rest. Returns the number of rows loaded.
+uint64_t bulk_load_end(BulkLoader *loader) {
+    Table *table = loader->table;
+    if (loader->bottom_up) {
+        if (loader->rows > 0)
+            bulk_load_build_tree(loader);
+        else
+            unpin_page(table->pager, loader->leaf_page_num);
+    }
+    for (uint32_t column = 0; column < INDEX_COLUMNS; column++) {
+        if (!loader->index_entries[column].empty())
+            index_insert_entries(table, table->indexes[column], static_cast<IndexColumn>(column),
+                                 &(loader->index_entries[column]));
+    }
+    pager_commit(table->pager);
+    uint64_t rows = loader->rows;
+    delete loader;
+    return rows;
+}
+
+// One "id,username,email" line of a csv file.
+ImportResult import_parse_csv_line(char *line, Row *row) {
+    size_t length = std::strlen(line);
+    if (length > 0 && line[length - 1] == '\r')
+        line[--length] = 0;
+    char *username = std::strchr(line, ',');
+    if (username == nullptr)
+        return IMPORT_SYNTAX_ERROR;
+    *username++ = 0;
+    char *email = std::strchr(username, ',');
+    if (email == nullptr)
+        return IMPORT_SYNTAX_ERROR;
+    *email++ = 0;
+
+    if (line[0] == '-')
+        return IMPORT_NEGATIVE_ID;
+    char *end;
+    errno = 0;
+    unsigned long id = std::strtoul(line, &end, 10);
+    if (end == line || *end != 0 || errno != 0 || id > UINT32_MAX)
+        return IMPORT_SYNTAX_ERROR;
+    if (*username == 0 || *email == 0 || std::strchr(email, ',') != nullptr)
+        return IMPORT_SYNTAX_ERROR;
+    if (std::strlen(username) > COLUMN_USERNAME_SIZE || std::strlen(email) > COLUMN_EMAIL_SIZE)
+        return IMPORT_STRING_TOO_LONG;
+
+    row->id = id;
+    std::strcpy(row->username, username);
+    std::strcpy(row->email, email);
+    return IMPORT_SUCCESS;
+}
+
+/*
+ * One record of a binary file: the id as a host order uint32_t, then the
+ * username and the email, each a length byte followed by that many bytes.
+ * Returns the bytes it took up, 0 if the data ends before the record does.
+ */
+uint32_t import_parse_binary_record(const char *data, size_t length, Row *row, ImportResult *result) {
+    if (length < ID_SIZE + 1)
+        return 0;
+    uint32_t username_length = static_cast<uint8_t>(data[ID_SIZE]);
+    if (length < ID_SIZE + 1 + username_length + 1)
+        return 0;
+    uint32_t email_length = static_cast<uint8_t>(data[ID_SIZE + 1 + username_length]);
+    uint32_t record_length = ID_SIZE + 1 + username_length + 1 + email_length;
+    if (length < record_length)
+        return 0;
+
+    if (username_length > COLUMN_USERNAME_SIZE || email_length > COLUMN_EMAIL_SIZE) {
+        *result = IMPORT_STRING_TOO_LONG;
+        return record_length;
+    }
+    std::memcpy(&(row->id), data, ID_SIZE);
+    std::memcpy(row->username, data + ID_SIZE + 1, username_length);
+    row->username[username_length] = 0;
+    std::memcpy(row->email, data + ID_SIZE + 1 + username_length + 1, email_length);
+    row->email[email_length] = 0;
+    *result = IMPORT_SUCCESS;
+    return record_length;
+}
+
+/*
+ * Load every row of a csv or binary file through a BulkLoader, reading the
+ * file a block at a time. A bad record stops the import; the rows before
+ * it stay loaded. rows is set to the number loaded and record to the
+ * (1-based) line or record the import stopped at.
+ */
+ImportResult table_import(Table *table, const char *filename, ImportFormat format, uint64_t *rows,
+                          uint64_t *record) {
+    *rows = 0;
+    *record = 0;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return IMPORT_FILE_ERROR;
+
+    BulkLoader *loader = bulk_load_begin(table);
+    ImportResult result = IMPORT_SUCCESS;
+    // one byte spare, to terminate a csv line that ends the file without a newline
+    std::vector<char> block(IMPORT_BLOCK_SIZE + 1);
+    size_t filled = 0;
+    bool end_of_file = false;
+    Row row;
+    while (!end_of_file && result == IMPORT_SUCCESS) {
+        ssize_t bytes_read = read(fd, block.data() + filled, IMPORT_BLOCK_SIZE - filled);
+        if (bytes_read == -1) {
+            result = IMPORT_FILE_ERROR;
+            break;
+        }
+        filled += bytes_read;
+        end_of_file = bytes_read == 0;
+
+        size_t offset = 0;
+        while (offset < filled && result == IMPORT_SUCCESS) {
+            char *start = block.data() + offset;
+            uint32_t consumed;
+            if (format == IMPORT_CSV) {
+                char *newline = static_cast<char *>(std::memchr(start, '\n', filled - offset));
+                if (newline == nullptr && !end_of_file)
+                    break;
+                if (newline == nullptr)
+                    newline = block.data() + filled;
+                *newline = 0;
+                consumed = newline - start + 1;
+                *record += 1;
+                // blank lines, and an optional header line naming the columns
+                if (start[0] == 0 || (start[0] == '\r' && start[1] == 0) ||
+                    (*record == 1 && std::strncmp(start, "id,", 3) == 0)) {
+                    offset += consumed;
+                    continue;
+                }
+                result = import_parse_csv_line(start, &row);
+            } else {
+                consumed = import_parse_binary_record(start, filled - offset, &row, &result);
+                if (consumed == 0) {
+                    // a record cut short by the end of the file
+                    if (end_of_file) {
+                        *record += 1;
+                        result = IMPORT_SYNTAX_ERROR;
+                    }
+                    break;
+                }
+                *record += 1;
+            }
+            offset += std::min(static_cast<size_t>(consumed), filled - offset);
+            if (result == IMPORT_SUCCESS) {
+                ExecuteResult load_result = bulk_load_row(loader, &row);
+                if (load_result == EXECUTE_TABLE_FULL)
+                    result = IMPORT_TABLE_FULL;
+                else if (load_result == EXECUTE_DUPLICATE_KEY)
+                    result = IMPORT_DUPLICATE_KEY;
+            }
+        }
+
+        std::memmove(block.data(), block.data() + offset, filled - offset);
+        filled -= offset;
+        // a csv line longer than a whole block
+        if (filled == IMPORT_BLOCK_SIZE && result == IMPORT_SUCCESS) {
+            *record += 1;
+            result = IMPORT_SYNTAX_ERROR;
+        }
+    }
+
+    *rows = bulk_load_end(loader);
+    close(fd);
+    return result;
+}
+
+/*
+ * Predicate evaluation, one leaf at a time. The ids of a batch are compared
+ * against the predicate's value as a packed array, eight at a time with
+ * AVX2 or four with SSE2 when the CPU has them, and the result is a
+ * selection bitmap with bit i set when row i of the batch matches.
+ * Unsigned comparisons are done as signed ones on ids with the top bit
+ * flipped, since SSE and AVX2 only compare signed integers.
+ */
+bool compare_id(uint32_t id, CompareOp op, uint32_t value) {
+    switch (op) {
+        case COMPARE_EQ:
+            return id == value;
+        case COMPARE_NE:
+            return id != value;
+        case COMPARE_LT:
+            return id < value;
+        case COMPARE_LE:
+            return id <= value;
+        case COMPARE_GT:
+            return id > value;
+        case COMPARE_GE:
+            return id >= value;
+    }
+    return false;
+}
+
+uint32_t filter_ids_scalar(const uint32_t *ids, uint32_t first, uint32_t count, CompareOp op, uint32_t value,
+                           uint64_t *selection) {
+    uint32_t matches = 0;
+    for (uint32_t i = first; i < count; i++) {
+        if (compare_id(ids[i], op, value)) {
+            selection[i / 64] |= 1ULL << (i % 64);
+            matches += 1;
+        }
+    }
+    return matches;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) uint32_t filter_ids_sse2(const uint32_t *ids, uint32_t count, CompareOp op,
+                                                           uint32_t value, uint64_t *selection) {
+    const __m128i bias = _mm_set1_epi32(INT32_MIN);
+    const __m128i target = _mm_xor_si128(_mm_set1_epi32(value), bias);
+    const __m128i ones = _mm_set1_epi32(-1);
+    uint32_t matches = 0;
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i x = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ids + i)), bias);
+        __m128i eq = _mm_cmpeq_epi32(x, target);
+        __m128i gt = _mm_cmpgt_epi32(x, target);
+        __m128i mask = eq;
+        switch (op) {
+            case COMPARE_EQ: mask = eq; break;
+            case COMPARE_NE: mask = _mm_xor_si128(eq, ones); break;
+            case COMPARE_LT: mask = _mm_xor_si128(_mm_or_si128(gt, eq), ones); break;
+            case COMPARE_LE: mask = _mm_xor_si128(gt, ones); break;
+            case COMPARE_GT: mask = gt; break;
+            case COMPARE_GE: mask = _mm_or_si128(gt, eq); break;
+        }
+        uint64_t bits = _mm_movemask_ps(_mm_castsi128_ps(mask));
+        selection[i / 64] |= bits << (i % 64);
+        matches += __builtin_popcountll(bits);
+    }
+    return matches + filter_ids_scalar(ids, i, count, op, value, selection);
+}
+
+__attribute__((target("avx2"))) uint32_t filter_ids_avx2(const uint32_t *ids, uint32_t count, CompareOp op,
+                                                           uint32_t value, uint64_t *selection) {
+    const __m256i bias = _mm256_set1_epi32(INT32_MIN);
+    const __m256i target = _mm256_xor_si256(_mm256_set1_epi32(value), bias);
+    const __m256i ones = _mm256_set1_epi32(-1);
+    uint32_t matches = 0;
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(ids + i)), bias);
+        __m256i eq = _mm256_cmpeq_epi32(x, target);
+        __m256i gt = _mm256_cmpgt_epi32(x, target);
+        __m256i mask = eq;
+        switch (op) {
+            case COMPARE_EQ: mask = eq; break;
+            case COMPARE_NE: mask = _mm256_xor_si256(eq, ones); break;
+            case COMPARE_LT: mask = _mm256_xor_si256(_mm256_or_si256(gt, eq), ones); break;
+            case COMPARE_LE: mask = _mm256_xor_si256(gt, ones); break;
+            case COMPARE_GT: mask = gt; break;
+            case COMPARE_GE: mask = _mm256_or_si256(gt, eq); break;
+        }
+        uint64_t bits = _mm256_movemask_ps(_mm256_castsi256_ps(mask));
+        selection[i / 64] |= bits << (i % 64);
+        matches += __builtin_popcountll(bits);
+    }
+    return matches + filter_ids_scalar(ids, i, count, op, value, selection);
+}
+#endif
+
+typedef uint32_t (*FilterIdsFunction)(const uint32_t *, uint32_t, CompareOp, uint32_t, uint64_t *);
+
+uint32_t filter_ids_portable(const uint32_t *ids, uint32_t count, CompareOp op, uint32_t value,
+                             uint64_t *selection) {
+    return filter_ids_scalar(ids, 0, count, op, value, selection);
+}
+
+// The widest kernel this CPU can run, picked once.
+FilterIdsFunction pick_filter_ids() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return filter_ids_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return filter_ids_sse2;
+#endif
+    return filter_ids_portable;
+}
+
+// Set the bit of every id that satisfies <op> value, return how many did.
+uint32_t filter_ids(const uint32_t *ids, uint32_t count, CompareOp op, uint32_t value, uint64_t *selection) {
+    static const FilterIdsFunction kernel = pick_filter_ids();
+    std::memset(selection, 0, SELECTION_WORDS * sizeof(uint64_t));
+    return kernel(ids, count, op, value, selection);
+}
+
+/*
+ * Usernames and emails are compared by length first, then by their first
+ * eight bytes as a single word, and only then in full. Strings in slotted
+ * leaves are not padded to a fixed width, so there is no safe way to load
+ * a whole column slice at once.
+ */
+uint32_t filter_strings(const RowBatch *batch, PredicateColumn column, const char *value, uint32_t length,
+                        uint64_t *selection) {
+    uint64_t prefix = 0;
+    uint32_t prefix_length = std::min(length, static_cast<uint32_t>(sizeof(prefix)));
+    std::memcpy(&prefix, value, prefix_length);
+
+    std::memset(selection, 0, SELECTION_WORDS * sizeof(uint64_t));
+    uint32_t matches = 0;
+    for (uint32_t i = 0; i < batch->count; i++) {
+        RowView row = row_batch_view(batch, i);
+        const char *text = column == PREDICATE_USERNAME ? row.username : row.email;
+        uint32_t text_length = column == PREDICATE_USERNAME ? row.username_length : row.email_length;
+        if (text_length != length)
+            continue;
+        uint64_t row_prefix = 0;
+        std::memcpy(&row_prefix, text, prefix_length);
+        if (row_prefix != prefix ||
+            std::memcmp(text + prefix_length, value + prefix_length, length - prefix_length) != 0)
+            continue;
+        selection[i / 64] |= 1ULL << (i % 64);
+        matches += 1;
+    }
+    return matches;
+}
+
+// Fill selection with the rows of batch that satisfy where.
+uint32_t select_rows(const Predicate *where, const RowBatch *batch, uint64_t *selection) {
+    if (where->column == PREDICATE_ID) {
+        uint32_t scratch[LEAF_NODE_MAX_ROWS];
+        const uint32_t *ids = row_batch_ids(batch, scratch);
+        uint32_t matches = filter_ids(ids, batch->count, where->op, where->id, selection);
+        if (where->id_high == UINT32_MAX || matches == 0)
+            return matches;
+        // between takes a second pass for its upper end
+        uint64_t below_high[SELECTION_WORDS];
+        filter_ids(ids, batch->count, COMPARE_LE, where->id_high, below_high);
+        matches = 0;
+        for (uint32_t word = 0; word < SELECTION_WORDS; word++) {
+            selection[word] &= below_high[word];
+            matches += __builtin_popcountll(selection[word]);
+        }
+        return matches;
+    }
+    if (where->column == PREDICATE_USERNAME || where->column == PREDICATE_EMAIL)
+        return filter_strings(batch, where->column, where->text, where->text_length, selection);
+
+    std::memset(selection, 0, SELECTION_WORDS * sizeof(uint64_t));
+    for (uint32_t i = 0; i < batch->count; i++)
+        selection[i / 64] |= 1ULL << (i % 64);
+    return batch->count;
+}
+
+// Ids come out of the tree sorted, so no row after one with this id can match.
+bool id_predicate_exhausted(const Predicate *where, uint32_t id) {
+    if (where->column != PREDICATE_ID)
+        return false;
+    if (id > where->id_high)
+        return true;
+    switch (where->op) {
+        case COMPARE_EQ:
+        case COMPARE_LE:
+            return id > where->id;
+        case COMPARE_LT:
+            return id >= where->id;
+        default:
+            return false;
+    }
+}
+
+// The smallest id where could match, false if it cannot match any.
+bool id_predicate_first_key(const Predicate *where, uint32_t *first_key) {
+    *first_key = 0;
+    if (where->column == PREDICATE_ID && (where->op == COMPARE_EQ || where->op == COMPARE_GE))
+        *first_key = where->id;
+    if (where->column == PREDICATE_ID && where->op == COMPARE_GT) {
+        if (where->id == UINT32_MAX)
+            return false;
+        *first_key = where->id + 1;
+    }
+    return where->column != PREDICATE_ID || *first_key <= where->id_high;
+}
+
+// The largest id where could match, false if it cannot match any.
+bool id_predicate_last_key(const Predicate *where, uint32_t *last_key) {
+    *last_key = UINT32_MAX;
+    if (where->column != PREDICATE_ID)
+        return true;
+    if (where->op == COMPARE_EQ || where->op == COMPARE_LE)
+        *last_key = where->id;
+    if (where->op == COMPARE_LT) {
+        if (where->id == 0)
+            return false;
+        *last_key = where->id - 1;
+    }
+    *last_key = std::min(*last_key, where->id_high);
+    return true;
+}
+
+// Hand the first count rows set in selection to callback, in cell order.
+void emit_selected_rows(const RowBatch *batch, const uint64_t *selection, uint32_t count, RowCallback callback,
+                        void *context) {
+    for (uint32_t word = 0; word < SELECTION_WORDS && count > 0; word++) {
+        for (uint64_t bits = selection[word]; bits != 0 && count > 0; bits &= bits - 1) {
+            RowView row = row_batch_view(batch, word * 64 + __builtin_ctzll(bits));
+            callback(&row, context);
+            count -= 1;
+        }
+    }
+}
+
+// Same, for the last count rows set in selection, from the last cell back.
+void emit_selected_rows_reverse(const RowBatch *batch, const uint64_t *selection, uint32_t count,
+                                RowCallback callback, void *context) {
+    for (uint32_t word = SELECTION_WORDS; word > 0 && count > 0; word--) {
+        for (uint64_t bits = selection[word - 1]; bits != 0 && count > 0;) {
+            uint32_t bit = 63 - __builtin_clzll(bits);
+            bits &= ~(1ULL << bit);
+            RowView row = row_batch_view(batch, (word - 1) * 64 + bit);
+            callback(&row, context);
+            count -= 1;
+        }
+    }
+}
+
+bool row_text_matches(const Predicate *where, const RowView *row) {
+    const char *text = where->column == PREDICATE_USERNAME ? row->username : row->email;
+    uint32_t length = where->column == PREDICATE_USERNAME ? row->username_length : row->email_length;
+    return length == where->text_length && std::memcmp(text, where->text, length) == 0;
+}
+
+// The index that can answer where, nullptr if there is none (as of snapshot).
+Table *table_predicate_index(Table *table, const Snapshot *snapshot, const Predicate *where) {
+    IndexColumn column = where->column == PREDICATE_USERNAME ? INDEX_USERNAME : INDEX_EMAIL;
+    if (snapshot != nullptr && snapshot->index_root_page_nums[column] == 0)
+        return nullptr;
+    return table->indexes[column];
+}
+
+/*
+ * Equality on an indexed column: collect the ids of the matching entries,
+ * then look each of them up in the table and check the row itself. Rows
+ * come out in id order, as they would from a scan.
+ */
+ExecuteResult scan_index(Table *table, Table *index, const Snapshot *snapshot, const Predicate *where,
+                         const SelectOrder *order, RowCallback callback, void *context) {
+    pager_advise(table->pager, MADV_RANDOM);
+    uint32_t key = index_hash(where->text, where->text_length);
+    std::vector<uint32_t> ids;
+    Cursor *cursor = table_find(index, snapshot, key);
+    while (!cursor->end_of_table && cursor_key(cursor) == key) {
+        RowView entry = cursor_row_view(cursor);
+        if (row_text_matches(where, &entry))
+            ids.push_back(entry.id);
+        cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+    // rows that share an id are all found by the first lookup of it
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    if (order->descending)
+        std::reverse(ids.begin(), ids.end());
+
+    uint32_t remaining = order->limit;
+    for (uint32_t i = 0; i < ids.size() && remaining > 0; i++) {
+        cursor = table_find(table, snapshot, ids[i]);
+        while (!cursor->end_of_table && cursor_key(cursor) == ids[i] && remaining > 0) {
+            RowView row = cursor_row_view(cursor);
+            stats_add(STAT_ROWS_SCANNED, 1);
+            if (row_text_matches(where, &row)) {
+                stats_add(STAT_ROWS_RETURNED, 1);
+                callback(&row, context);
+                remaining -= 1;
+            }
+            cursor_advance(cursor);
+        }
+        cursor_close(cursor);
+    }
+    pager_advise(table->pager, MADV_NORMAL);
+
+    return EXECUTE_SUCCESS;
+}
+
+/*
+ * order by id desc: seek to the largest id where could match and walk the
+ * leaves backwards from there, until the limit or the lower end of where.
+ */
+ExecuteResult scan_table_descending(Table *table, const Snapshot *snapshot, const Predicate *where,
+                                    uint32_t limit, RowCallback callback, void *context) {
+    uint32_t first_key;
+    uint32_t last_key;
+    if (!id_predicate_first_key(where, &first_key) || !id_predicate_last_key(where, &last_key))
+        return EXECUTE_SUCCESS;
+
+    pager_advise(table->pager, MADV_RANDOM);
+    Cursor *cursor = table_seek(table, snapshot, last_key, true, 0);
+    RowBatch batch;
+    uint64_t selection[SELECTION_WORDS];
+    while (limit > 0 && cursor_prev_batch(cursor, &batch) > 0) {
+        stats_add(STAT_ROWS_SCANNED, batch.count);
+        uint32_t matches = std::min(select_rows(where, &batch, selection), limit);
+        if (matches > 0) {
+            stats_add(STAT_ROWS_RETURNED, matches);
+            emit_selected_rows_reverse(&batch, selection, matches, callback, context);
+            limit -= matches;
+        }
+        if (*leaf_node_key(batch.node, batch.first_cell) < first_key)
+            break;
+    }
+    cursor_close(cursor);
+    pager_advise(table->pager, MADV_NORMAL);
+
+    return EXECUTE_SUCCESS;
+}
 
-typedef enum { PREPARE_SUCCESS, PREPARE_SYNTAX_ERROR, PREPARE_STRING_TOO_LONG, PREPARE_NEGATIVE_ID, PREPARE_UNRECOGNIZED_STATEMENT } PrepareResult;
+/*
+ * Hand every row that satisfies where to callback, in id order, reading
+ * either the latest version of the table or a snapshot of it. With order
+ * the rows can come in descending id order instead, and stop at a limit;
+ * nullptr is ascending without a limit.
+ */
+ExecuteResult scan_table(Table *table, const Snapshot *snapshot, const Predicate *where, AccessPath access_path,
+                         const SelectOrder *order, RowCallback callback, void *context) {
+    SelectOrder id_order = {false, SELECT_NO_LIMIT};
+    if (order == nullptr)
+        order = &id_order;
+    if (order->limit == 0)
+        return EXECUTE_SUCCESS;
 
-typedef enum { STATEMENT_INSERT, STATEMENT_SELECT } StatementType;
+    if (access_path == ACCESS_INDEX_LOOKUP) {
+        Table *index = table_predicate_index(table, snapshot, where);
+        if (index != nullptr)
+            return scan_index(table, index, snapshot, where, order, callback, context);
+    }
+    if (order->descending)
+        return scan_table_descending(table, snapshot, where, order->limit, callback, context);
 
-typedef enum { EXECUTE_SUCCESS, EXECUTE_TABLE_FULL } ExecuteResult;
+    // an id predicate with a lower bound lets the scan start there
+    uint32_t first_key;
+    if (!id_predicate_first_key(where, &first_key))
+        return EXECUTE_SUCCESS;
 
-typedef struct {
-    StatementType type;
-    Row row_to_insert;
-} Statement;
+    Cursor *cursor;
+    if (access_path == ACCESS_ID_LOOKUP) {
+        pager_advise(table->pager, MADV_RANDOM);
+        cursor = table_find(table, snapshot, first_key);
+    } else {
+        pager_advise(table->pager, MADV_SEQUENTIAL);
+        cursor = table_scan_from(table, snapshot, first_key);
+    }
 
+    RowBatch batch;
+    uint64_t selection[SELECTION_WORDS];
+    uint32_t remaining = order->limit;
+    while (remaining > 0 && cursor_next_batch(cursor, &batch) > 0) {
+        stats_add(STAT_ROWS_SCANNED, batch.count);
+        uint32_t matches = std::min(select_rows(where, &batch, selection), remaining);
+        if (matches > 0) {
+            stats_add(STAT_ROWS_RETURNED, matches);
+            emit_selected_rows(&batch, selection, matches, callback, context);
+            remaining -= matches;
+        }
+        if (id_predicate_exhausted(where, *leaf_node_key(batch.node, batch.first_cell + batch.count - 1)))
+            break;
+    }
+    cursor_close(cursor);
+    pager_advise(table->pager, MADV_NORMAL);
 
-#define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
+    return EXECUTE_SUCCESS;
+}
 
-const uint32_t ID_SIZE = size_of_attribute(Row, id);
-const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
-const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
-const uint32_t ID_OFFSET = 0;
-const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
+void worker_pool_main(WorkerPool *pool, uint32_t worker) {
+    while (true) {
+        Task task;
+        bool found = false;
+        for (uint32_t i = 0; i < pool->num_threads && !found; i++) {
+            WorkQueue *queue = &(pool->queues[(worker + i) % pool->num_threads]);
+            std::lock_guard<std::mutex> guard(queue->lock);
+            if (queue->tasks.empty())
+                continue;
+            if (i == 0) {
+                task = queue->tasks.front();
+                queue->tasks.pop_front();
+            } else {
+                task = queue->tasks.back();
+                queue->tasks.pop_back();
+            }
+            found = true;
+        }
 
+        std::unique_lock<std::mutex> guard(pool->lock);
+        if (found) {
+            pool->queued -= 1;
+            guard.unlock();
+            task.run(task.context, task.index);
+            continue;
+        }
+        pool->work_available.wait(guard, [pool] { return pool->shutting_down || pool->queued > 0; });
+        if (pool->shutting_down)
+            return;
+    }
+}
 
-void serialize_row(Row *row, void *destination) {
-    std::memcpy(static_cast<char *>(destination) + ID_OFFSET, &(row->id), ID_SIZE);
-    std::memcpy(static_cast<char *>(destination) + USERNAME_OFFSET, &(row->username), USERNAME_SIZE);
-    std::memcpy(static_cast<char *>(destination) + EMAIL_OFFSET, &(row->email), EMAIL_SIZE);
+WorkerPool *worker_pool_open(uint32_t num_threads) {
+    WorkerPool *pool = new WorkerPool();
+    pool->num_threads = num_threads;
+    pool->queues = new WorkQueue[num_threads];
+    pool->queued = 0;
+    pool->shutting_down = false;
+    for (uint32_t i = 0; i < num_threads; i++)
+        pool->threads.push_back(std::thread(worker_pool_main, pool, i));
+    return pool;
 }
 
-void deserialize_row(void *source, Row *destination) {
-    std::memcpy(&(destination->id), static_cast<char *>(source) + ID_OFFSET, ID_SIZE);
-    std::memcpy(&(destination->username), static_cast<char *>(source) + USERNAME_OFFSET, USERNAME_SIZE);
-    std::memcpy(&(destination->email), static_cast<char *>(source) + EMAIL_OFFSET, EMAIL_SIZE);
+// Queue run(context, i) for every i below count, in contiguous runs per worker.
+void worker_pool_run(WorkerPool *pool, void (*run)(void *, uint32_t), void *context, uint32_t count) {
+    for (uint32_t worker = 0; worker < pool->num_threads; worker++) {
+        uint32_t first = static_cast<uint64_t>(count) * worker / pool->num_threads;
+        uint32_t last = static_cast<uint64_t>(count) * (worker + 1) / pool->num_threads;
+        std::lock_guard<std::mutex> guard(pool->queues[worker].lock);
+        for (uint32_t i = first; i < last; i++) {
+            Task task = {run, context, i};
+            pool->queues[worker].tasks.push_back(task);
+        }
+    }
+    std::lock_guard<std::mutex> guard(pool->lock);
+    pool->queued += count;
+    pool->work_available.notify_all();
 }
 
+// Waits for the workers to finish whatever they are running, queued tasks are dropped.
+void worker_pool_close(WorkerPool *pool) {
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        pool->shutting_down = true;
+        pool->work_available.notify_all();
+    }
+    for (std::thread &thread : pool->threads)
+        thread.join();
+    delete[] pool->queues;
+    delete pool;
+}
 
-const uint32_t PAGE_SIZE = 4096;
-#define TABLE_MAX_PAGES 100
-const uint32_t ROWS_PER_PAGE = PAGE_SIZE / ROW_SIZE;
-const uint32_t TABLE_MAX_ROWS = ROWS_PER_PAGE * TABLE_MAX_PAGES;
+// Append the leaves under page_num that may hold rows matching where, left to right.
+void table_collect_leaves(Table *table, const Snapshot *snapshot, uint32_t page_num, const Predicate *where,
+                          uint32_t first_key, std::vector<uint32_t> *leaves) {
+    bool pinned;
+    void *node = table_get_page(table, snapshot, page_num, &pinned);
+    if (get_node_type(node) == NODE_LEAF) {
+        table_put_page(table, page_num, pinned);
+        leaves->push_back(page_num);
+        return;
+    }
 
-typedef struct {
-    int file_descriptor;
-    uint32_t file_length;
-    void *pages[TABLE_MAX_PAGES];
-} Pager;
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+        // child i holds no key above key i, and the ones after it none below
+        if (i < num_keys && *internal_node_key(node, i) < first_key)
+            continue;
+        table_collect_leaves(table, snapshot, *internal_node_child(node, i), where, first_key, leaves);
+        if (i < num_keys && id_predicate_exhausted(where, *internal_node_key(node, i)))
+            break;
+    }
+    table_put_page(table, page_num, pinned);
+}
 
 typedef struct {
-    uint32_t num_rows;
-    Pager *pager;
-} Table;
+    Table *table;
+    const Snapshot *snapshot;
+    const Predicate *where;
+    bool ordered;
+    RowCallback callback;
+    void *context;
+    std::vector<uint32_t> leaves;
+    std::vector<std::vector<Row>> results; // matching rows of each morsel, for ordered scans
+    std::mutex lock;
+    std::condition_variable morsel_done;
+    std::vector<bool> done;
+    uint32_t remaining;
+} ParallelScan;
 
+void parallel_scan_morsel(void *context, uint32_t morsel) {
+    ParallelScan *scan = static_cast<ParallelScan *>(context);
+    Table *table = scan->table;
+    uint32_t first = morsel * SCAN_MORSEL_LEAVES;
+    uint32_t last = std::min(first + SCAN_MORSEL_LEAVES, static_cast<uint32_t>(scan->leaves.size()));
+    if (table->pager->readahead_pages > 0)
+        pager_prefetch(table->pager, &(scan->leaves[first]), std::min(last - first, table->pager->readahead_pages));
 
+    uint64_t selection[SELECTION_WORDS];
+    for (uint32_t leaf = first; leaf < last; leaf++) {
+        uint32_t page_num = scan->leaves[leaf];
+        bool pinned;
+        RowBatch batch;
+        batch.node = table_get_page(table, scan->snapshot, page_num, &pinned);
+        batch.first_cell = 0;
+        batch.count = *leaf_node_num_cells(batch.node);
+        stats_add(STAT_ROWS_SCANNED, batch.count);
+        uint32_t matches = batch.count > 0 ? select_rows(scan->where, &batch, selection) : 0;
+        if (matches > 0) {
+            stats_add(STAT_ROWS_RETURNED, matches);
+            for (uint32_t word = 0; word < SELECTION_WORDS; word++) {
+                for (uint64_t bits = selection[word]; bits != 0; bits &= bits - 1) {
+                    uint32_t cell_num = word * 64 + __builtin_ctzll(bits);
+                    if (scan->ordered) {
+                        scan->results[morsel].push_back(Row());
+                        leaf_node_deserialize_row(batch.node, cell_num, &(scan->results[morsel].back()));
+                    } else {
+                        RowView row = row_batch_view(&batch, cell_num);
+                        scan->callback(&row, scan->context);
+                    }
+                }
+            }
+        }
+        table_put_page(table, page_num, pinned);
+    }
 
+    std::lock_guard<std::mutex> guard(scan->lock);
+    scan->done[morsel] = true;
+    scan->remaining -= 1;
+    scan->morsel_done.notify_all();
+}
 
+/*
+ * Like scan_table(), with the leaves split into morsels that the scan pool
+ * filters side by side. An ordered scan hands the rows to callback on the
+ * calling thread in id order, a morsel as soon as the ones before it are
+ * done. Otherwise callback runs on the workers as they find rows, so it has
+ * to be safe to call from several threads at once.
+ */
+ExecuteResult parallel_scan(Table *table, const Snapshot *snapshot, const Predicate *where, bool ordered,
+                            RowCallback callback, void *context) {
+    uint32_t first_key;
+    if (!id_predicate_first_key(where, &first_key))
+        return EXECUTE_SUCCESS;
+    if (table->scan_pool == nullptr)
+        return scan_table(table, snapshot, where, plan_select(where), nullptr, callback, context);
 
-InputBuffer *new_input_buffer() {
-    auto input_buffer = new InputBuffer();
-    input_buffer->buffer = nullptr;
-    input_buffer->buffer_length = 0;
-    input_buffer->input_length = 0;
+    ParallelScan *scan = new ParallelScan();
+    scan->table = table;
+    scan->snapshot = snapshot;
+    scan->where = where;
+    scan->ordered = ordered;
+    scan->callback = callback;
+    scan->context = context;
+    table_collect_leaves(table, snapshot, snapshot != nullptr ? snapshot->root_page_num : table->root_page_num,
+                         where, first_key, &(scan->leaves));
+    uint32_t num_morsels = (scan->leaves.size() + SCAN_MORSEL_LEAVES - 1) / SCAN_MORSEL_LEAVES;
+    scan->results.resize(ordered ? num_morsels : 0);
+    scan->done.resize(num_morsels, false);
+    scan->remaining = num_morsels;
+    worker_pool_run(table->scan_pool, parallel_scan_morsel, scan, num_morsels);
 
-    return input_buffer;
+    std::unique_lock<std::mutex> guard(scan->lock);
+    if (ordered) {
+        for (uint32_t morsel = 0; morsel < num_morsels; morsel++) {
+            scan->morsel_done.wait(guard, [scan, morsel] { return scan->done[morsel]; });
+            guard.unlock();
+            for (const Row &row : scan->results[morsel]) {
+                RowView view = {row.id, row.username, static_cast<uint32_t>(std::strlen(row.username)), row.email,
+                                static_cast<uint32_t>(std::strlen(row.email))};
+                callback(&view, context);
+            }
+            std::vector<Row>().swap(scan->results[morsel]);
+            guard.lock();
+        }
+    }
+    scan->morsel_done.wait(guard, [scan] { return scan->remaining == 0; });
+    guard.unlock();
+    delete scan;
+
+    return EXECUTE_SUCCESS;
 }
 
-void close_input_buffer(InputBuffer *input_buffer) {
-    delete input_buffer->buffer;
-    delete input_buffer;
+void sink_row_callback(const RowView *row, void *context) { static_cast<ResultSink *>(context)->row(row); }
+
+void count_row_callback(const RowView *, void *context) { *static_cast<uint64_t *>(context) += 1; }
+
+void sum_row_callback(const RowView *row, void *context) { *static_cast<uint64_t *>(context) += row->id; }
+
+void last_id_callback(const RowView *row, void *context) { *static_cast<uint64_t *>(context) = row->id; }
+
+// Whether every id from low to high satisfies where.
+bool predicate_covers_ids(const Predicate *where, uint32_t low, uint32_t high) {
+    if (where->column == PREDICATE_NONE)
+        return true;
+    if (where->column != PREDICATE_ID || where->op == COMPARE_NE || high > where->id_high)
+        return false;
+    return compare_id(low, where->op, where->id) && compare_id(high, where->op, where->id);
 }
 
+/*
+ * count(*) where. The ids at either end of a leaf bound all of its rows,
+ * so a leaf whose first and last id satisfy an id range counts as a whole
+ * without looking at the rows in between.
+ */
+uint64_t scan_count(Table *table, const Snapshot *snapshot, const Predicate *where, AccessPath access_path) {
+    uint64_t count = 0;
+    if (access_path == ACCESS_INDEX_LOOKUP) {
+        scan_table(table, snapshot, where, access_path, nullptr, count_row_callback, &count);
+        return count;
+    }
 
-void print_prompt() { printf("db > "); }
+    uint32_t first_key;
+    if (!id_predicate_first_key(where, &first_key))
+        return 0;
+    pager_advise(table->pager, MADV_SEQUENTIAL);
+    Cursor *cursor = table_scan_from(table, snapshot, first_key);
+    RowBatch batch;
+    uint64_t selection[SELECTION_WORDS];
+    while (cursor_next_batch(cursor, &batch) > 0) {
+        uint32_t first = *leaf_node_key(batch.node, batch.first_cell);
+        uint32_t last = *leaf_node_key(batch.node, batch.first_cell + batch.count - 1);
+        if (predicate_covers_ids(where, first, last)) {
+            count += batch.count;
+        } else {
+            stats_add(STAT_ROWS_SCANNED, batch.count);
+            count += select_rows(where, &batch, selection);
+        }
+        if (id_predicate_exhausted(where, last))
+            break;
+    }
+    cursor_close(cursor);
+    pager_advise(table->pager, MADV_NORMAL);
 
-void read_input(InputBuffer *input_buffer) {
-    ssize_t bytes_read = getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+    return count;
+}
 
-    if (bytes_read <= 0) {
-        printf("Error reading input\n");
-        exit(EXIT_FAILURE);
+/*
+ * Work out the value of an aggregate select, reading the latest version of
+ * the table or a snapshot of it. Returns false for the min or max of no
+ * rows. min(id) and max(id) are the first row of a scan in either order,
+ * which seeks straight to it when where is on id.
+ */
+bool table_aggregate(Table *table, const Snapshot *snapshot, const Statement *statement, uint64_t *value) {
+    const Predicate *where = &(statement->where);
+    *value = 0;
+    switch (statement->aggregate) {
+        case AGGREGATE_COUNT:
+            if (where->column != PREDICATE_NONE || snapshot != nullptr) {
+                *value = scan_count(table, snapshot, where, statement->access_path);
+            } else {
+                if (table->num_rows == ROW_COUNT_UNKNOWN)
+                    table->num_rows = scan_count(table, nullptr, where, statement->access_path);
+                *value = table->num_rows;
+            }
+            return true;
+        case AGGREGATE_SUM:
+            scan_table(table, snapshot, where, statement->access_path, nullptr, sum_row_callback, value);
+            return true;
+        case AGGREGATE_MIN:
+        case AGGREGATE_MAX: {
+            SelectOrder order = {statement->aggregate == AGGREGATE_MAX, 1};
+            *value = UINT64_MAX; // ids are 32 bits
+            scan_table(table, snapshot, where, statement->access_path, &order, last_id_callback, value);
+            return *value != UINT64_MAX;
+        }
+        default:
+            return false;
     }
+}
 
-    // Ignore trailing newline
-    input_buffer->input_length = bytes_read - 1;
-    input_buffer->buffer[bytes_read - 1] = 0;
+// Hand the first count records set in selection to sink, in cell order.
+void emit_selected_records(const RowBatch *batch, const uint64_t *selection, uint32_t count, const Schema *schema,
+                           ResultSink *sink) {
+    Value values[MAX_TABLE_COLUMNS];
+    for (uint32_t word = 0; word < SELECTION_WORDS && count > 0; word++) {
+        for (uint64_t bits = selection[word]; bits != 0 && count > 0; bits &= bits - 1) {
+            uint32_t cell_num = batch->first_cell + word * 64 + __builtin_ctzll(bits);
+            schema->decode(schema, slotted_cell(batch->node, cell_num), values);
+            sink->record(schema, values);
+            count -= 1;
+        }
+    }
 }
 
+/*
+ * The rows of a created table in key order, as a forward scan_table() would
+ * go about it. The key takes the place of id in where.
+ */
+ExecuteResult scan_records(Table *created, const Predicate *where, uint32_t limit, ResultSink *sink) {
+    uint32_t first_key;
+    if (limit == 0 || !id_predicate_first_key(where, &first_key))
+        return EXECUTE_SUCCESS;
+    Cursor *cursor = where->column == PREDICATE_ID && where->op == COMPARE_EQ
+                         ? table_find(created, nullptr, first_key)
+                         : table_scan_from(created, nullptr, first_key);
 
-PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
-    statement->type = STATEMENT_INSERT;
+    RowBatch batch;
+    uint64_t selection[SELECTION_WORDS];
+    uint32_t remaining = limit;
+    while (remaining > 0 && cursor_next_batch(cursor, &batch) > 0) {
+        stats_add(STAT_ROWS_SCANNED, batch.count);
+        uint32_t matches = std::min(select_rows(where, &batch, selection), remaining);
+        if (matches > 0) {
+            stats_add(STAT_ROWS_RETURNED, matches);
+            emit_selected_records(&batch, selection, matches, created->schema, sink);
+            remaining -= matches;
+        }
+        if (id_predicate_exhausted(where, *leaf_node_key(batch.node, batch.first_cell + batch.count - 1)))
+            break;
+    }
+    cursor_close(cursor);
+    return EXECUTE_SUCCESS;
+}
 
-    char* keyword = std::strtok(input_buffer->buffer, " ");
-    char* id_string =  strtok(NULL, " ");
-    char* username =  strtok(NULL, " ");
-    char* email =  strtok(NULL, " ");
+// select from a created table.
+ExecuteResult execute_select_records(Statement *statement, Table *table) {
+    Table *created = catalog_find_table(table, statement->table);
+    if (created == nullptr)
+        return EXECUTE_NO_SUCH_TABLE;
+    if (statement->where.column != PREDICATE_NONE && statement->where_column != created->schema->columns[0].name)
+        return EXECUTE_WHERE_NOT_KEY;
+    ExecuteResult result = scan_records(created, &(statement->where), statement->order.limit, table->output);
+    table->output->finish();
+    return result;
+}
 
-    if (id_string == nullptr || username == nullptr || email == nullptr) {
-        return PREPARE_SYNTAX_ERROR;
+ExecuteResult execute_select(Statement *statement, Table *table) {
+    if (!statement->table.empty())
+        return execute_select_records(statement, table);
+    if (statement->aggregate != AGGREGATE_NONE) {
+        uint64_t value;
+        bool found = table_aggregate(table, nullptr, statement, &value);
+        table->output->value(found ? &value : nullptr);
+        table->output->finish();
+        return EXECUTE_SUCCESS;
     }
 
-    int id = std::atoi(id_string);
-    if (id < 0)
-        return PREPARE_NEGATIVE_ID;
-    if (std::strlen(username) > COLUMN_USERNAME_SIZE)
-        return PREPARE_STRING_TOO_LONG;
-    if (std::strlen(email) > COLUMN_EMAIL_SIZE)
-        return PREPARE_STRING_TOO_LONG;
+    const Predicate *where = &(statement->where);
+    bool lookup = statement->access_path == ACCESS_ID_LOOKUP ||
+                  (statement->access_path == ACCESS_INDEX_LOOKUP && table_predicate_index(table, nullptr, where));
+    bool whole_range = statement->order.limit == SELECT_NO_LIMIT && !statement->order.descending;
+    ExecuteResult result;
+    // a lookup touches a leaf or two, and a scan with a limit stops after a
+    // few, neither is worth waking the workers for
+    if (table->scan_pool != nullptr && !lookup && whole_range)
+        result = parallel_scan(table, nullptr, where, true, sink_row_callback, table->output);
+    else
+        result = scan_table(table, nullptr, where, statement->access_path, &(statement->order), sink_row_callback,
+                            table->output);
+    table->output->finish();
+    return result;
+}
 
-    statement->row_to_insert.id = id;
-    std::strcpy(statement->row_to_insert.username, username);
-    std::strcpy(statement->row_to_insert.email, email);
+void collect_id_callback(const RowView *row, void *context) {
+    static_cast<std::vector<uint32_t> *>(context)->push_back(row->id);
+}
 
-    return PREPARE_SUCCESS;
+// Take every row with this id out of the table and its indexes, and hand them back in removed.
+void table_remove_id(Table *table, uint32_t id, std::vector<Row> *removed) {
+    while (true) {
+        Cursor *cursor = table_find(table, nullptr, id);
+        if (cursor->end_of_table || cursor_key(cursor) != id) {
+            cursor_close(cursor);
+            return;
+        }
+        Row row;
+        leaf_node_deserialize_row(cursor->page, cursor->cell_num, &row);
+        btree_delete(cursor);
+        cursor_close(cursor);
+        index_delete_row(table, &row);
+        removed->push_back(row);
+    }
 }
 
-PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement) {
-    if (std::strncmp(input_buffer->buffer, "insert", 6) == 0)
-        return prepare_insert(input_buffer, statement);
+/*
+ * update and delete. The rows are found the way a select would find them,
+ * then changed one id at a time: an update takes the row out and puts the
+ * new version back in, in its leaf or wherever it fits now. Outside of a
+ * transaction the changes are committed in pieces, like a multi row insert.
+ */
+ExecuteResult execute_modify(Statement *statement, Table *table) {
+    Pager *pager = table->pager;
+    std::vector<uint32_t> ids;
+    ExecuteResult result =
+        scan_table(table, nullptr, &(statement->where), statement->access_path, nullptr, collect_id_callback, &ids);
+    if (result != EXECUTE_SUCCESS)
+        return result;
+    // an index hands them out of order, and a file from before ids were
+    // unique can repeat them
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
 
+    std::vector<Row> rows;
+    for (uint32_t id : ids) {
+        if (table->in_transaction && transaction_full(table))
+            return EXECUTE_TRANSACTION_FULL;
+        if (!table->in_transaction && pager->write_set.size() >= std::max(pager->num_frames / 4, 1u))
+            pager_commit(pager);
 
-    if (std::strcmp(input_buffer->buffer, "select") == 0) {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+        rows.clear();
+        table_remove_id(table, id, &rows);
+        for (Row &row : rows) {
+            if (statement->type == STATEMENT_DELETE) {
+                table_remove_row(table, row.id);
+                continue;
+            }
+            if (statement->set_username)
+                std::strcpy(row.username, statement->row_to_insert.username);
+            if (statement->set_email)
+                std::strcpy(row.email, statement->row_to_insert.email);
+            result = btree_insert(table, row.id, &row);
+            if (result == EXECUTE_SUCCESS)
+                result = index_insert_row(table, &row);
+            if (result != EXECUTE_SUCCESS)
+                return result;
+        }
     }
-
-    return PREPARE_UNRECOGNIZED_STATEMENT;
+    return EXECUTE_SUCCESS;
 }
 
+typedef struct {
+    IndexColumn column;
+    std::vector<IndexEntry> entries;
+} IndexBuild;
 
-void print_row(Row *row) {
-    std::cout << "("<< row->id << ", " << row->username << ", " << row->email << ")\n";
-    // printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+void index_build_callback(const RowView *row, void *context) {
+    IndexBuild *build = static_cast<IndexBuild *>(context);
+    if (build->column == INDEX_USERNAME)
+        index_add_entry(&(build->entries), row->id, row->username, row->username_length);
+    else
+        index_add_entry(&(build->entries), row->id, row->email, row->email_length);
 }
 
-void* get_page(Pager* pager, uint32_t page_num) {
-    if (page_num >= TABLE_MAX_PAGES) {
-        std::cout << "Tried to fetch page number out of bounds. "<< page_num << " > " << TABLE_MAX_PAGES << std::endl;
-        exit(EXIT_FAILURE);
-    }
+/*
+ * create index on <column>: index the rows already in the table, after
+ * which every insert keeps the index up to date. The header only records
+ * the index once it is complete, so a build cut short leaves nothing but
+ * unreachable pages behind.
+ */
+ExecuteResult table_create_index(Table *table, IndexColumn column) {
+    if (table->indexes[column] != nullptr)
+        return EXECUTE_INDEX_EXISTS;
 
-    if (pager->pages[page_num] == nullptr) {
-        // cache miss, allocate memory and load from file.
-        void* page = new char[PAGE_SIZE];
-        uint32_t num_pages = pager->file_length / PAGE_SIZE;
+    IndexBuild build;
+    build.column = column;
+    Predicate everything;
+    everything.column = PREDICATE_NONE;
+    scan_table(table, nullptr, &everything, ACCESS_FULL_SCAN, nullptr, index_build_callback, &build);
+
+    Pager *pager = table->pager;
+    uint32_t root_page_num = get_unused_page_num(pager);
+    void *root = get_page_for_write(pager, root_page_num);
+    initialize_leaf_node(root, LEAF_LAYOUT_SLOTTED);
+    unpin_page(pager, root_page_num);
+
+    Table *index = index_open(table, column, root_page_num);
+    uint32_t root_offset = index->root_offset;
+    index->root_offset = 0;
+    ExecuteResult result = index_insert_entries(table, index, column, &(build.entries));
+    if (result != EXECUTE_SUCCESS) {
+        delete index;
+        return result;
+    }
+    index->root_offset = root_offset;
+    table_set_root(index, index->root_page_num);
+    table->indexes[column] = index;
+    return EXECUTE_SUCCESS;
+}
 
-        // we might save a partial page at the end of the file
-        if (pager->file_length % PAGE_SIZE)
-            num_pages += 1;
+/*
+ * Copy the rows of a B+tree, in order, into leaves filled to the brim, stack
+ * the internal levels on top as a bulk load does, and make that the tree.
+ * The pages of the old tree are left where they are. Returns the number of
+ * rows.
+ */
+uint64_t btree_rebuild(Table *tree) {
+    BulkLoader loader;
+    loader.table = tree;
+    loader.bottom_up = true;
+    loader.last_id = 0;
+    loader.rows = 0;
+    loader.leaf = bulk_load_new_page(&loader, &(loader.leaf_page_num));
+    initialize_leaf_node(loader.leaf, static_cast<LeafLayout>(tree->leaf_layout));
 
-        if (page_num <= num_pages) {
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-            if (bytes_read == -1) {
-                std::cout << "Error reading file: " << errno << std::endl;
-                exit(EXIT_FAILURE);
+    Cursor *cursor = table_start(tree);
+    RowBatch batch;
+    while (cursor_next_batch(cursor, &batch) > 0) {
+        for (uint32_t i = 0; i < batch.count; i++) {
+            uint32_t cell_num = batch.first_cell + i;
+            uint32_t key = *leaf_node_key(batch.node, cell_num);
+            Row row;
+            LeafValue value = leaf_value_row(&row);
+            if (tree->schema != nullptr) {
+                // records are copied as they are
+                value.row = nullptr;
+                value.cell = slotted_cell(batch.node, cell_num);
+                value.length = *slotted_cell_length(batch.node, cell_num);
+            } else {
+                leaf_node_deserialize_row(batch.node, cell_num, &row);
             }
+            if (!leaf_node_value_fits(loader.leaf, &value))
+                bulk_load_next_leaf(&loader);
+            leaf_node_insert_value(loader.leaf, *leaf_node_num_cells(loader.leaf), key, &value);
+            loader.last_id = key;
+            loader.rows += 1;
         }
-        pager->pages[page_num] = page;
     }
+    cursor_close(cursor);
+    bulk_load_build_tree(&loader);
+    return loader.rows;
+}
+
+void btree_mark_pages(Pager *pager, uint32_t page_num, std::vector<bool> *used) {
+    (*used)[page_num] = true;
+    void *node = get_page(pager, page_num);
+    if (get_node_type(node) == NODE_INTERNAL) {
+        uint32_t num_keys = *internal_node_num_keys(node);
+        for (uint32_t i = 0; i <= num_keys; i++)
+            btree_mark_pages(pager, *internal_node_child(node, i), used);
+    }
+    unpin_page(pager, page_num);
+}
 
-    return pager->pages[page_num];
+/*
+ * Put every page that neither the header nor a B+tree uses on a new free
+ * list, lowest page first, which also finds the pages a crash in the
+ * middle of a statement left unreachable. With truncate set the unused
+ * pages at the end of the file are left off, for the caller to cut away.
+ * Returns the number of pages the file keeps.
+ */
+uint32_t table_rebuild_free_list(Table *table, bool truncate) {
+    Pager *pager = table->pager;
+    std::vector<bool> used(pager->num_pages, false);
+    used[DB_HEADER_PAGE_NUM] = true;
+    btree_mark_pages(pager, table->root_page_num, &used);
+    for (Table *index : table->indexes) {
+        if (index != nullptr)
+            btree_mark_pages(pager, index->root_page_num, &used);
+    }
+    for (Table *created : table->tables)
+        btree_mark_pages(pager, created->root_page_num, &used);
+    uint32_t num_pages = pager->num_pages;
+    while (truncate && !used[num_pages - 1])
+        num_pages -= 1;
 
+    uint32_t none = 0;
+    void *header = get_page_for_write(pager, DB_HEADER_PAGE_NUM);
+    std::memcpy(static_cast<char *>(header) + DB_HEADER_FREE_PAGE_OFFSET, &none, DB_HEADER_FREE_PAGE_SIZE);
+    unpin_page(pager, DB_HEADER_PAGE_NUM);
+    for (uint32_t page_num = num_pages; page_num-- > 0;) {
+        if (used[page_num])
+            continue;
+        if (pager->write_set.size() >= std::max(pager->num_frames / 4, 1u))
+            pager_commit(pager);
+        free_page(pager, page_num);
+    }
+    pager_commit(pager);
+    return num_pages;
 }
 
+/*
+ * .vacuum: rebuild the table, its indexes and the created tables with
+ * every leaf full, then give the pages at the end of the file back. A
+ * single rebuild can only put the new trees in the holes the old ones
+ * leave or past the end, so it is done twice: the first copy goes past the
+ * end, and the second into the pages the original freed up, from the front
+ * of the file on. Open
+ * snapshots may still read the old pages, the file keeps its length then.
+ * Returns the number of pages in the file.
+ */
+uint32_t table_vacuum(Table *table) {
+    Pager *pager = table->pager;
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        if (pass > 0)
+            table_rebuild_free_list(table, false);
+        uint64_t rows = btree_rebuild(table);
+        for (Table *index : table->indexes) {
+            if (index != nullptr)
+                btree_rebuild(index);
+        }
+        for (Table *created : table->tables)
+            btree_rebuild(created);
+        if (table->num_rows != rows) {
+            table_row_count_changed(table);
+            table->num_rows = rows;
+        }
+    }
 
-void *row_slot(Table *table, uint32_t row_num) {
-    uint32_t page_num = row_num / ROWS_PER_PAGE;
-    void *page = get_page(table->pager, page_num);
-    uint32_t row_offset = row_num % ROWS_PER_PAGE;
-    uint32_t byte_offset = row_offset * ROW_SIZE;
-    return static_cast<char *>(page) + byte_offset;
+    bool truncate = pager->snapshot_lsns.empty();
+    uint32_t num_pages = table_rebuild_free_list(table, truncate);
+    if (truncate && num_pages < pager->num_pages) {
+        pager_checkpoint(pager);
+        pager_truncate(pager, num_pages);
+    }
+    return pager->num_pages;
 }
 
-ExecuteResult execute_insert(Statement *statement, Table *table) {
-    if (table->num_rows >= TABLE_MAX_ROWS) {
-        return EXECUTE_TABLE_FULL;
+/*
+ * Snapshots let any number of reader threads scan the table while one
+ * writer thread keeps running statements. A snapshot sees every statement
+ * committed before it was opened and nothing after, and reading through it
+ * never waits for the writer. The db has to be opened with
+ * PagerOptions::snapshots set.
+ */
+Snapshot *snapshot_open(Table *table) {
+    Pager *pager = table->pager;
+    if (!pager->versioned) {
+        std::cout << "Snapshots need a db opened with snapshots enabled.\n";
+        exit(EXIT_FAILURE);
     }
 
-    Row *row_to_insert = &(statement->row_to_insert);
-    serialize_row(row_to_insert, row_slot(table, table->num_rows));
-    table->num_rows += 1;
+    std::lock_guard<std::recursive_mutex> guard(pager->latch);
+    Snapshot *snapshot = new Snapshot();
+    snapshot->table = table;
+    snapshot->lsn = pager->committed_lsn;
+    pager->snapshot_lsns.insert(snapshot->lsn);
 
-    return EXECUTE_SUCCESS;
+    // the root as of the snapshot, a later root split must not show up
+    bool pinned;
+    void *header = get_page_version(pager, DB_HEADER_PAGE_NUM, snapshot->lsn, &pinned);
+    std::memcpy(&(snapshot->root_page_num), static_cast<char *>(header) + DB_HEADER_ROOT_PAGE_OFFSET,
+                DB_HEADER_ROOT_PAGE_SIZE);
+    std::memcpy(snapshot->index_root_page_nums, static_cast<char *>(header) + DB_HEADER_INDEX_ROOT_OFFSET,
+                INDEX_COLUMNS * DB_HEADER_INDEX_ROOT_SIZE);
+    if (pinned)
+        unpin_page(pager, DB_HEADER_PAGE_NUM);
+
+    return snapshot;
 }
 
-ExecuteResult execute_select(Statement *statement, Table *table) {
-    Row row;
-    for (uint32_t i = 0; i < table->num_rows; i++) {
-        deserialize_row(row_slot(table, i), &row);
-        print_row(&row);
-    }
+void snapshot_close(Snapshot *snapshot) {
+    Pager *pager = snapshot->table->pager;
+    std::lock_guard<std::recursive_mutex> guard(pager->latch);
+    pager->snapshot_lsns.erase(pager->snapshot_lsns.find(snapshot->lsn));
+    pager_collect_versions(pager);
+    delete snapshot;
+}
 
-    return EXECUTE_SUCCESS;
+// Run a select statement against a snapshot, from any thread.
+ExecuteResult snapshot_select(Snapshot *snapshot, Statement *statement, RowCallback callback, void *context) {
+    return scan_table(snapshot->table, snapshot, &(statement->where), statement->access_path, &(statement->order),
+                      callback, context);
 }
 
 
+/*
+ * Take a statement that failed part way back out, see
+ * pager_statement_rollback(), and bring the tables in memory back in line
+ * with the header: the roots it keeps and the row count it holds, if any.
+ * Id sets are rebuilt by the next insert.
+ */
+void table_statement_rollback(Table *table) {
+    Pager *pager = table->pager;
+    if (!pager_statement_rollback(pager))
+        return;
+
+    std::vector<Table *> trees(1, table);
+    for (Table *index : table->indexes) {
+        if (index != nullptr)
+            trees.push_back(index);
+    }
+    trees.insert(trees.end(), table->tables.begin(), table->tables.end());
+
+    char *header = static_cast<char *>(get_page(pager, DB_HEADER_PAGE_NUM));
+    for (Table *tree : trees) {
+        if (tree->root_offset != 0)
+            std::memcpy(&(tree->root_page_num), header + tree->root_offset, sizeof(tree->root_page_num));
+        delete tree->ids;
+        tree->ids = nullptr;
+        tree->num_rows = ROW_COUNT_UNKNOWN;
+    }
+    uint64_t row_count;
+    std::memcpy(&row_count, header + DB_HEADER_ROW_COUNT_OFFSET, DB_HEADER_ROW_COUNT_SIZE);
+    table->num_rows = row_count == 0 ? ROW_COUNT_UNKNOWN : row_count - 1;
+    table->row_count_stale = row_count == 0;
+    unpin_page(pager, DB_HEADER_PAGE_NUM);
+}
+
+// A statement that fails changes nothing, apart from what it had to commit
+// on the way outside of a transaction.
 ExecuteResult execute_statement(Statement *statement, Table *table) {
+    uint64_t started = stats_now_ns();
+    ExecuteResult result = EXECUTE_SUCCESS;
+    pager_statement_begin(table->pager);
     switch (statement->type) {
         case STATEMENT_INSERT:
-            return execute_insert(statement, table);
+            result = execute_insert(statement, table);
+            break;
         case STATEMENT_SELECT:
-            return execute_select(statement, table);
+            result = execute_select(statement, table);
+            break;
+        case STATEMENT_BEGIN:
+            table->in_transaction = true;
+            break;
+        case STATEMENT_COMMIT:
+            table->in_transaction = false;
+            break;
+        case STATEMENT_CREATE_INDEX:
+            result = table_create_index(table, statement->index_column);
+            break;
+        case STATEMENT_UPDATE:
+        case STATEMENT_DELETE:
+            result = execute_modify(statement, table);
+            break;
+        case STATEMENT_CREATE_TABLE:
+            result = catalog_create_table(table, statement->table, statement->columns);
+            break;
+    }
+    if (result != EXECUTE_SUCCESS)
+        table_statement_rollback(table);
+    pager_statement_end(table->pager);
+    stats_add(STAT_STATEMENTS, 1);
+    stats_record_phase(PHASE_EXECUTE, started);
+
+    // between begin and commit, every statement goes into the same commit
+    if (!table->in_transaction) {
+        started = stats_now_ns();
+        pager_commit(table->pager);
+        stats_record_phase(PHASE_COMMIT, started);
     }
+    return result;
+}
+
+// Run a prepared statement with the values bound to it so far.
+ExecuteResult execute_prepared(PreparedStatement *prepared, Table *table) {
+    return execute_statement(&(prepared->statement), table);
 }
 
-Pager* pager_open(const char* filename) {
+Pager* pager_open(const char* filename, const PagerOptions *options) {
 
     int fd = open(filename,
                  O_RDWR |      // Read/Write mode
@@ -242,100 +6712,317 @@ Pager* pager_open(const char* filename) {
         exit(EXIT_FAILURE);
     }
 
+    CompressedIoBackend *compressed = CompressedIoBackend::open(fd, static_cast<PageCodec>(options->page_codec));
+    IoBackend *io = compressed;
+    if (compressed == nullptr) {
+        io = io_backend_open(options->io_backend);
+    } else if (options->use_mmap || options->io_backend != IO_BACKEND_PREAD) {
+        std::cout << "Pages of a compressed file are read with pread.\n";
+    }
+
+    // bring the file up to date with whatever the last session committed
+    Wal *wal = wal_open(filename, options->synchronous);
+    wal_recover(wal, fd, io);
+
+    // the pager only sees the pages, not where a compressed file keeps them
     off_t file_length = lseek(fd, 0, SEEK_END);
+    if (compressed != nullptr)
+        file_length = static_cast<off_t>(compressed->num_pages()) * PAGE_SIZE;
 
     Pager* pager = new Pager();
+    pager->wal = wal;
     pager->file_descriptor = fd;
     pager->file_length = file_length;
+    pager->num_pages = file_length / PAGE_SIZE;
 
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++)
-        pager->pages[i] = nullptr;
+    if (file_length % PAGE_SIZE != 0) {
+        std::cout << "Db file is not a whole number of pages. Corrupt file.\n";
+        exit(EXIT_FAILURE);
+    }
 
+    uint32_t num_frames = options->num_frames;
+    if (num_frames < MIN_BUFFER_POOL_FRAMES)
+        num_frames = MIN_BUFFER_POOL_FRAMES;
+    pager->num_frames = num_frames;
+    pager->frames_in_use = 0;
+    pager->clock_hand = 0;
+    pager->frame_data = new char[static_cast<size_t>(num_frames) * PAGE_SIZE];
+    pager->frames = new Frame[num_frames];
+    for (uint32_t i = 0; i < num_frames; i++) {
+        pager->frames[i].page_num = INVALID_PAGE_NUM;
+        pager->frames[i].buffer = pager->frame_data + static_cast<size_t>(i) * PAGE_SIZE;
+        pager->frames[i].data = pager->frames[i].buffer;
+        pager->frames[i].mapped = false;
+        pager->frames[i].pin_count = 0;
+        pager->frames[i].dirty = false;
+        pager->frames[i].referenced = false;
+        pager->frames[i].in_write_set = false;
+        pager->frames[i].image_saved = false;
+        pager->frames[i].page_lsn = 0;
+        pager->frames[i].io_pending = false;
+    }
 
-    return pager;
-}
+    // at most half full, so probe runs stay short
+    uint32_t page_table_size = 1;
+    while (page_table_size < 2 * num_frames)
+        page_table_size <<= 1;
+    pager->page_table = new PageTableEntry[page_table_size];
+    pager->page_table_mask = page_table_size - 1;
+    for (uint32_t i = 0; i < page_table_size; i++)
+        pager->page_table[i].page_num = INVALID_PAGE_NUM;
 
+    pager->stats = PagerStats();
 
+    pager->map = nullptr;
+    pager->map_length = 0;
+    pager->committed_lsn = 0;
+    pager->versioned = options->snapshots;
+    pager->io = io;
+    pager->reads_in_flight = 0;
+    // pages read ahead must not push each other out before they are used
+    pager->readahead_pages = std::min(options->readahead_pages, static_cast<uint32_t>(MAX_READAHEAD_PAGES));
+    pager->readahead_pages = std::min(pager->readahead_pages, num_frames / 4);
 
+    if (options->use_mmap && compressed == nullptr) {
+        void *reserved = mmap(nullptr, MMAP_RESERVE_BYTES, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                              -1, 0);
+        if (reserved == MAP_FAILED) {
+            std::cout << "Unable to reserve address space for mmap, reading pages with pread.\n";
+        } else {
+            pager->map = static_cast<char *>(reserved);
+            pager_map_grow(pager);
+        }
+    }
 
+    pager->in_statement = false;
+    pager->statement_write_set = 0;
+    pager->statement_versions = 0;
+    pager->statement_num_pages = 0;
+    pager->checkpoint_requested = false;
+    pager->closing = false;
+    pager->checkpointer = std::thread(pager_checkpointer_main, pager);
+    return pager;
+}
 
 
 
-Table *db_open(const char* filename) {
 
-    Pager* pager = pager_open(filename);
-    uint32_t num_rows = pager->file_length / ROW_SIZE;
 
-    Table *table = new Table();
-    table->pager = pager;
-    table->num_rows = num_rows;
 
-    return table;
 
-}
+Table *db_open(const char* filename, const PagerOptions *options) {
 
-void pager_flush(Pager *pager, uint32_t page_num, uint32_t size) {
-    if (pager->pages[page_num] == nullptr) {
-        printf("Tried to flush null page\n");
-        exit(EXIT_FAILURE);
-    }
+    Pager* pager = pager_open(filename, options);
 
-    off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE,SEEK_SET);
+    Table *table = new Table();
+    // the root page and the layout of an existing file come from its header below
+    table_init(table, pager, DB_HEADER_ROOT_PAGE_OFFSET, 0, static_cast<LeafLayout>(options->leaf_layout));
+    table->output = new TextSink(stdout);
+    table->row_count_stale = false;
+    // every worker pins a leaf and reads a few ahead, keep clear of the pool size
+    uint32_t scan_threads = std::min(options->scan_threads, static_cast<uint32_t>(MAX_SCAN_THREADS));
+    scan_threads = std::min(scan_threads, pager->num_frames / 4);
+    if (scan_threads > 1)
+        table->scan_pool = worker_pool_open(scan_threads);
 
-    if (offset == -1) {
-        printf("Error seeking: %d\n", errno);
-        exit(EXIT_FAILURE);
+    if (pager->file_length == 0) {
+        // New database file. Page 0 is the header, page 1 the root leaf.
+        void *header = get_page_for_write(pager, DB_HEADER_PAGE_NUM);
+        std::memcpy(static_cast<char *>(header) + DB_HEADER_MAGIC_OFFSET, &DB_HEADER_MAGIC, DB_HEADER_MAGIC_SIZE);
+        std::memcpy(static_cast<char *>(header) + DB_HEADER_LEAF_LAYOUT_OFFSET, &(table->leaf_layout),
+                    DB_HEADER_LEAF_LAYOUT_SIZE);
+        uint64_t row_count = 1; // no rows
+        std::memcpy(static_cast<char *>(header) + DB_HEADER_ROW_COUNT_OFFSET, &row_count, DB_HEADER_ROW_COUNT_SIZE);
+        table->num_rows = 0;
+        unpin_page(pager, DB_HEADER_PAGE_NUM);
+        void *root_node = get_page_for_write(pager, 1);
+        initialize_leaf_node(root_node, static_cast<LeafLayout>(table->leaf_layout));
+        unpin_page(pager, 1);
+        table_set_root(table, 1);
+        pager_commit(pager);
+    } else {
+        void *header = get_page(pager, DB_HEADER_PAGE_NUM);
+        uint32_t magic;
+        std::memcpy(&magic, static_cast<char *>(header) + DB_HEADER_MAGIC_OFFSET, DB_HEADER_MAGIC_SIZE);
+        if (magic != DB_HEADER_MAGIC) {
+            std::cout << "Unrecognized database file format.\n";
+            exit(EXIT_FAILURE);
+        }
+        std::memcpy(&(table->root_page_num), static_cast<char *>(header) + DB_HEADER_ROOT_PAGE_OFFSET,
+                    DB_HEADER_ROOT_PAGE_SIZE);
+        std::memcpy(&(table->leaf_layout), static_cast<char *>(header) + DB_HEADER_LEAF_LAYOUT_OFFSET,
+                    DB_HEADER_LEAF_LAYOUT_SIZE);
+        for (uint32_t column = 0; column < INDEX_COLUMNS; column++) {
+            uint32_t index_root_page_num;
+            std::memcpy(&index_root_page_num,
+                        static_cast<char *>(header) + DB_HEADER_INDEX_ROOT_OFFSET + column * DB_HEADER_INDEX_ROOT_SIZE,
+                        DB_HEADER_INDEX_ROOT_SIZE);
+            if (index_root_page_num != 0)
+                table->indexes[column] = index_open(table, static_cast<IndexColumn>(column), index_root_page_num);
+        }
+        uint64_t row_count;
+        std::memcpy(&row_count, static_cast<char *>(header) + DB_HEADER_ROW_COUNT_OFFSET, DB_HEADER_ROW_COUNT_SIZE);
+        table->num_rows = row_count == 0 ? ROW_COUNT_UNKNOWN : row_count - 1;
+        catalog_load(table, static_cast<char *>(header));
+        unpin_page(pager, DB_HEADER_PAGE_NUM);
     }
 
-    ssize_t bytes_written = write(
-        pager->file_descriptor, pager->pages[page_num], size
-    );
-    if (bytes_written == -1) {
-        printf("Error writing: %d\n", errno);
-        exit(EXIT_FAILURE);
-    }
+    return table;
+
 }
 
 void db_close(Table *table) {
     Pager *pager = table->pager;
-    uint32_t num_full_pages = table->num_rows / ROWS_PER_PAGE;
 
-    for (uint32_t i = 0; i < num_full_pages; i++) {
-        if (pager->pages[i] == nullptr) {
-            continue;
-        }
-        pager_flush(pager, i, PAGE_SIZE);
-        free(pager->pages[i]);
-        pager->pages[i] = nullptr;
-    }
+    if (table->scan_pool != nullptr)
+        worker_pool_close(table->scan_pool);
+    pager_stop_checkpointer(pager);
 
-    // There may be a partial page to write to the end of the file
-    // This should not be needed after we switch to a B-tree
-    uint32_t num_additional_rows = table->num_rows % ROWS_PER_PAGE;
-    if (num_additional_rows > 0) {
-        uint32_t page_num = num_full_pages;
-        if (pager->pages[page_num] != nullptr) {
-            pager_flush(pager, page_num, num_additional_rows * ROW_SIZE);
-            free(pager->pages[page_num]);
-            pager->pages[page_num] = nullptr;
+    // no read may land in a frame after it is freed
+    while (pager->reads_in_flight > 0)
+        pager_reap_reads(pager);
+    if (table->in_transaction) {
+        // close as if crashing: the log holds everything committed and none
+        // of the open transaction, which the next open then leaves out
+        wal_flush(pager->wal, pager->wal->last_lsn, true);
+    } else {
+        if (table->row_count_stale && table->num_rows != ROW_COUNT_UNKNOWN) {
+            uint64_t row_count = table->num_rows + 1;
+            void *header = get_page_for_write(pager, DB_HEADER_PAGE_NUM);
+            std::memcpy(static_cast<char *>(header) + DB_HEADER_ROW_COUNT_OFFSET, &row_count,
+                        DB_HEADER_ROW_COUNT_SIZE);
+            unpin_page(pager, DB_HEADER_PAGE_NUM);
+            pager_commit(pager);
         }
+        pager_checkpoint(pager);
     }
+    wal_close(pager->wal, table->in_transaction);
 
     int result = close(pager->file_descriptor);
     if (result == -1) {
         printf("Error closing db file.\n");
         exit(EXIT_FAILURE);
     }
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        void *page = pager->pages[i];
-        if (page) {
-            free(page);
-            pager->pages[i] = nullptr;
-        }
+
+    if (pager->map != nullptr)
+        munmap(pager->map, MMAP_RESERVE_BYTES);
+    if (!pager->snapshot_lsns.empty()) {
+        std::cout << "Tried to close the db with snapshots still open.\n";
+        exit(EXIT_FAILURE);
+    }
+    delete pager->io;
+    for (char *buffer : pager->page_buffers)
+        delete[] buffer;
+    delete[] pager->page_table;
+    delete[] pager->frames;
+    delete[] pager->frame_data;
+    delete pager;
+    for (Table *index : table->indexes)
+        delete index;
+    for (Table *created : table->tables) {
+        delete created->schema;
+        delete created->ids;
+        delete created;
+    }
+    delete table->output;
+    delete table->ids;
+    delete table;
+}
+
+void indent(uint32_t level) {
+    for (uint32_t i = 0; i < level; i++)
+        std::cout << "  ";
+}
+
+void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level) {
+    void *node = get_page(pager, page_num);
+    uint32_t num_keys, child;
+
+    switch (get_node_type(node)) {
+        case NODE_LEAF:
+            num_keys = *leaf_node_num_cells(node);
+            indent(indentation_level);
+            std::cout << "- leaf (size " << num_keys << ")\n";
+            for (uint32_t i = 0; i < num_keys; i++) {
+                indent(indentation_level + 1);
+                std::cout << "- " << *leaf_node_key(node, i) << "\n";
+            }
+            break;
+        case NODE_INTERNAL:
+            num_keys = *internal_node_num_keys(node);
+            indent(indentation_level);
+            std::cout << "- internal (size " << num_keys << ")\n";
+            for (uint32_t i = 0; i < num_keys; i++) {
+                child = *internal_node_child(node, i);
+                print_tree(pager, child, indentation_level + 1);
+
+                indent(indentation_level + 1);
+                std::cout << "- key " << *internal_node_key(node, i) << "\n";
+            }
+            child = *internal_node_right_child(node);
+            print_tree(pager, child, indentation_level + 1);
+            break;
+        case NODE_FREE:
+            indent(indentation_level);
+            std::cout << "- free page " << page_num << "\n";
+            break;
     }
+    unpin_page(pager, page_num);
+}
+
+void print_pager_stats(Pager *pager) {
+    std::lock_guard<std::recursive_mutex> guard(pager->latch);
+    uint32_t pinned = 0;
+    uint32_t dirty = 0;
+    for (uint32_t i = 0; i < pager->frames_in_use; i++) {
+        if (pager->frames[i].pin_count > 0)
+            pinned += 1;
+        if (pager->frames[i].dirty)
+            dirty += 1;
+    }
+    std::cout << "io: " << pager->io->name() << "\n";
+    std::cout << "frames: " << pager->num_frames << "\n";
+    std::cout << "resident: " << pager->frames_in_use << "\n";
+    std::cout << "pinned: " << pinned << "\n";
+    std::cout << "dirty: " << dirty << "\n";
+    std::cout << "hits: " << pager->stats.hits << "\n";
+    std::cout << "misses: " << pager->stats.misses << "\n";
+    std::cout << "evictions: " << pager->stats.evictions << "\n";
+    std::cout << "writebacks: " << pager->stats.writebacks << "\n";
+    std::cout << "pages written: " << pager->stats.pages_written << "\n";
+    std::cout << "write calls: " << pager->stats.write_calls << "\n";
+    std::cout << "mapped reads: " << pager->stats.mapped_reads << "\n";
+    std::cout << "reads: " << pager->stats.reads << "\n";
+    std::cout << "prefetches: " << pager->stats.prefetches << "\n";
+    std::cout << "log bytes: " << wal_size(pager->wal) << "\n";
+    std::cout << "group commits: " << pager->wal->group_commits << "\n";
+    std::cout << "checkpoints: " << pager->stats.checkpoints << "\n";
+    size_t versions = 0;
+    for (const auto &entry : pager->versions)
+        versions += entry.second.size();
+    std::cout << "versions: " << versions << "\n";
+}
 
-    free(pager);
-    free(table);
+void print_stats() {
+    static const char *counter_names[STAT_COUNTERS] = {
+        "page hits", "page misses", "bytes read", "bytes written",
+        "syscalls", "rows scanned", "rows returned", "statements"};
+    static const char *phase_names[STAT_PHASES] = {"prepare", "execute", "commit"};
+
+    StatsSnapshot snapshot;
+    stats_collect(&snapshot);
+    std::cout << "threads: " << snapshot.threads << "\n";
+    for (uint32_t i = 0; i < STAT_COUNTERS; i++)
+        std::cout << counter_names[i] << ": " << snapshot.counters[i] << "\n";
+    for (uint32_t phase = 0; phase < STAT_PHASES; phase++) {
+        uint64_t count = 0;
+        for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+            count += snapshot.histograms[phase][i];
+        StatementPhase p = static_cast<StatementPhase>(phase);
+        std::cout << phase_names[phase] << ": " << count << " calls, " << snapshot.phase_ns[phase] / 1000
+                  << " us total, p50 < " << stats_phase_quantile(&snapshot, p, 0.5) / 1000.0
+                  << " us, p99 < " << stats_phase_quantile(&snapshot, p, 0.99) / 1000.0 << " us\n";
+    }
 }
 
 MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table) {
@@ -344,6 +7031,65 @@ MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table) {
         db_close(table);
         exit(EXIT_SUCCESS);
     }
+    if (std::strcmp(input_buffer->buffer, ".btree") == 0) {
+        std::cout << "Tree:\n";
+        print_tree(table->pager, table->root_page_num, 0);
+        return META_COMMAND_SUCCESS;
+    }
+    if (std::strcmp(input_buffer->buffer, ".pool") == 0) {
+        print_pager_stats(table->pager);
+        return META_COMMAND_SUCCESS;
+    }
+    if (std::strcmp(input_buffer->buffer, ".stats") == 0) {
+        print_stats();
+        return META_COMMAND_SUCCESS;
+    }
+    if (std::strcmp(input_buffer->buffer, ".stats reset") == 0) {
+        stats_reset();
+        return META_COMMAND_SUCCESS;
+    }
+    if (std::strcmp(input_buffer->buffer, ".vacuum") == 0) {
+        if (table->in_transaction) {
+            std::cout << "Error: Commit the transaction before a vacuum.\n";
+            return META_COMMAND_SUCCESS;
+        }
+        uint32_t num_pages = table_vacuum(table);
+        std::cout << "Vacuumed, " << num_pages << " pages.\n";
+        return META_COMMAND_SUCCESS;
+    }
+    if (std::strncmp(input_buffer->buffer, ".import ", 8) == 0) {
+        // .import <file>, csv when the name ends in .csv and binary otherwise
+        const char *filename = input_buffer->buffer + 8;
+        size_t length = std::strlen(filename);
+        ImportFormat format =
+            length >= 4 && std::strcmp(filename + length - 4, ".csv") == 0 ? IMPORT_CSV : IMPORT_BINARY;
+        const char *unit = format == IMPORT_CSV ? "line" : "record";
+        uint64_t rows, record;
+        switch (table_import(table, filename, format, &rows, &record)) {
+            case IMPORT_SUCCESS:
+                break;
+            case IMPORT_FILE_ERROR:
+                std::cout << "Unable to read " << filename << "\n";
+                break;
+            case IMPORT_SYNTAX_ERROR:
+                std::cout << "Syntax error on " << unit << " " << record << ".\n";
+                break;
+            case IMPORT_STRING_TOO_LONG:
+                std::cout << "String is too long on " << unit << " " << record << ".\n";
+                break;
+            case IMPORT_NEGATIVE_ID:
+                std::cout << "ID must be positive on " << unit << " " << record << ".\n";
+                break;
+            case IMPORT_TABLE_FULL:
+                std::cout << "Error: Table full.\n";
+                break;
+            case IMPORT_DUPLICATE_KEY:
+                std::cout << "Duplicate key on " << unit << " " << record << ".\n";
+                break;
+        }
+        std::cout << "Imported " << rows << " rows.\n";
+        return META_COMMAND_SUCCESS;
+    }
     return META_COMMAND_UNRECOGNIZED_COMMAND;
 }
 
@@ -358,10 +7104,80 @@ int main(int argc, char *argv[]) {
          }
 
     char* filename = argv[1];
-    Table* table = db_open(filename);
+    PagerOptions options;
+    options.num_frames = DEFAULT_BUFFER_POOL_FRAMES;
+    options.synchronous = true;
+    options.use_mmap = false;
+    options.leaf_layout = LEAF_LAYOUT_SLOTTED;
+    options.page_codec = PAGE_CODEC_NONE;
+    options.io_backend = IO_BACKEND_PREAD;
+    options.readahead_pages = DEFAULT_READAHEAD_PAGES;
+    options.snapshots = false;
+    options.scan_threads = 0;
+    bool column_output = false;
+    for (int i = 2; i < argc; i++) {
+        if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            options.num_frames = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--sync") == 0 && i + 1 < argc) {
+            // with --sync off a commit returns before its fdatasync
+            options.synchronous = std::strcmp(argv[++i], "off") != 0;
+        } else if (std::strcmp(argv[i], "--mmap") == 0) {
+            options.use_mmap = true;
+        } else if (std::strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+            // --io uring, or --io pread (the default)
+            options.io_backend = std::strcmp(argv[++i], "uring") == 0 ? IO_BACKEND_URING : IO_BACKEND_PREAD;
+        } else if (std::strcmp(argv[i], "--layout") == 0 && i + 1 < argc) {
+            // --layout row|pax|slotted picks how a new file lays out its leaves
+            i++;
+            if (std::strcmp(argv[i], "row") == 0) {
+                options.leaf_layout = LEAF_LAYOUT_ROW;
+            } else if (std::strcmp(argv[i], "pax") == 0) {
+                options.leaf_layout = LEAF_LAYOUT_PAX;
+            } else if (std::strcmp(argv[i], "slotted") == 0) {
+                options.leaf_layout = LEAF_LAYOUT_SLOTTED;
+            } else {
+                std::cout << "Unknown layout " << argv[i] << "\n";
+                exit(EXIT_FAILURE);
+            }
+        } else if (std::strcmp(argv[i], "--compress") == 0 && i + 1 < argc) {
+            // --compress lz4|none picks how a new file stores its pages
+            i++;
+            if (std::strcmp(argv[i], "lz4") == 0) {
+                options.page_codec = PAGE_CODEC_LZ4;
+            } else if (std::strcmp(argv[i], "none") == 0) {
+                options.page_codec = PAGE_CODEC_NONE;
+            } else {
+                std::cout << "Unknown compression " << argv[i] << "\n";
+                exit(EXIT_FAILURE);
+            }
+        } else if (std::strcmp(argv[i], "--readahead") == 0 && i + 1 < argc) {
+            options.readahead_pages = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            // --threads N scans with N workers
+            options.scan_threads = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            // --output text|binary, binary being the column blocks of ColumnSink
+            i++;
+            if (std::strcmp(argv[i], "binary") == 0) {
+                column_output = true;
+            } else if (std::strcmp(argv[i], "text") != 0) {
+                std::cout << "Unknown output " << argv[i] << "\n";
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            std::cout << "Unknown option " << argv[i] << "\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+    Table* table = db_open(filename, &options);
+    if (column_output) {
+        delete table->output;
+        table->output = new ColumnSink(stdout);
+    }
 
 
     InputBuffer *input_buffer = new_input_buffer();
+    StatementCache statement_cache;
     while (true) {
         print_prompt();
         read_input(input_buffer);
@@ -376,7 +7192,21 @@ int main(int argc, char *argv[]) {
         }
 
         Statement statement;
-        switch (prepare_statement(input_buffer, &statement)) {
+        PrepareResult prepare_result;
+        uint64_t started = stats_now_ns();
+        if (std::strncmp(input_buffer->buffer, "prepare ", 8) == 0) {
+            PreparedStatement *prepared =
+                statement_cache_prepare(&statement_cache, input_buffer->buffer + 8, &prepare_result);
+            stats_record_phase(PHASE_PREPARE, started);
+            if (prepared != nullptr) {
+                std::cout << "Prepared statement " << prepared->handle << ".\n";
+                continue;
+            }
+        } else {
+            prepare_result = prepare_statement(input_buffer, &statement, &statement_cache);
+            stats_record_phase(PHASE_PREPARE, started);
+        }
+        switch (prepare_result) {
             case PREPARE_SUCCESS:
                 break;
             case PREPARE_SYNTAX_ERROR:
@@ -388,6 +7218,12 @@ int main(int argc, char *argv[]) {
             case PREPARE_STRING_TOO_LONG:
                 std::cout << "String is too long.\n";
                 continue;
+            case PREPARE_ROW_TOO_LONG:
+                std::cout << "Rows of that table would be too long.\n";
+                continue;
+            case PREPARE_NO_SUCH_STATEMENT:
+                std::cout << "No such prepared statement.\n";
+                continue;
             case PREPARE_UNRECOGNIZED_STATEMENT:
                 std::cout << "unrecognized statement " << input_buffer->buffer << "\n";
                 continue;
@@ -399,6 +7235,30 @@ int main(int argc, char *argv[]) {
             case EXECUTE_TABLE_FULL:
                 std::cout << "Error: Table full.\n";
                 break;
+            case EXECUTE_TRANSACTION_FULL:
+                std::cout << "Error: Transaction full, commit it first.\n";
+                break;
+            case EXECUTE_INDEX_EXISTS:
+                std::cout << "Error: Index already exists.\n";
+                break;
+            case EXECUTE_DUPLICATE_KEY:
+                std::cout << "Error: Duplicate key.\n";
+                break;
+            case EXECUTE_TABLE_EXISTS:
+                std::cout << "Error: Table already exists.\n";
+                break;
+            case EXECUTE_NO_SUCH_TABLE:
+                std::cout << "Error: No such table.\n";
+                break;
+            case EXECUTE_CATALOG_FULL:
+                std::cout << "Error: Catalog full.\n";
+                break;
+            case EXECUTE_BAD_VALUES:
+                std::cout << "Error: Values do not match the columns.\n";
+                break;
+            case EXECUTE_WHERE_NOT_KEY:
+                std::cout << "Error: Where takes the first column only.\n";
+                break;
             default:
                 break;
         }
@@ -0,0 +1,128 @@
+/*
+ * Concurrency check for the snapshots of part05: one writer inserts rows in
+ * batches of BATCH_ROWS, each batch its own commit, while reader threads
+ * keep opening snapshots and scanning them. Every snapshot has to see a
+ * whole number of batches, the same count on a second scan, and never
+ * fewer rows than the reader's previous snapshot. Exits with an error on
+ * the first violation, so it can run under a sanitizer as it is.
+ *
+ *   snapshot_check [--rows N] [--readers N] [--dir DIR] [--frames N] [--mmap]
+ */
+#define main part05_main
+#include "part05.cpp"
+#undef main
+
+#include <atomic>
+#include <cstdio>
+
+#define BATCH_ROWS 50
+
+typedef struct {
+    uint64_t rows;
+    uint32_t readers;
+    std::string dir;
+    PagerOptions pager;
+} CheckOptions;
+
+void count_rows(Snapshot *snapshot, Statement *statement, uint64_t *rows) {
+    *rows = 0;
+    if (snapshot_select(snapshot, statement, count_row_callback, rows) != EXECUTE_SUCCESS) {
+        std::cout << "snapshot_select failed\n";
+        exit(EXIT_FAILURE);
+    }
+}
+
+void reader_main(Table *table, const std::atomic<bool> *done, uint64_t *snapshots) {
+    Statement statement;
+    statement.type = STATEMENT_SELECT;
+    statement.where.column = PREDICATE_NONE;
+    statement.where.id_high = UINT32_MAX;
+    statement.order.descending = false;
+    statement.order.limit = SELECT_NO_LIMIT;
+    statement.aggregate = AGGREGATE_NONE;
+    statement.access_path = ACCESS_FULL_SCAN;
+
+    uint64_t last = 0;
+    while (!done->load()) {
+        Snapshot *snapshot = snapshot_open(table);
+        uint64_t first, second;
+        count_rows(snapshot, &statement, &first);
+        count_rows(snapshot, &statement, &second);
+        snapshot_close(snapshot);
+        if (first != second || first % BATCH_ROWS != 0 || first < last) {
+            std::cout << "snapshot saw " << first << " then " << second << " rows, " << last << " before\n";
+            exit(EXIT_FAILURE);
+        }
+        last = first;
+        *snapshots += 1;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    CheckOptions options;
+    options.rows = 20000;
+    options.readers = 4;
+    options.dir = ".";
+    options.pager.num_frames = DEFAULT_BUFFER_POOL_FRAMES;
+    options.pager.synchronous = false;
+    options.pager.use_mmap = false;
+    options.pager.leaf_layout = LEAF_LAYOUT_SLOTTED;
+    options.pager.page_codec = PAGE_CODEC_NONE;
+    options.pager.io_backend = IO_BACKEND_PREAD;
+    options.pager.readahead_pages = DEFAULT_READAHEAD_PAGES;
+    options.pager.snapshots = true;
+    options.pager.scan_threads = 0;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+            options.rows = std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--readers") == 0 && i + 1 < argc) {
+            options.readers = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            options.dir = argv[++i];
+        } else if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            options.pager.num_frames = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--mmap") == 0) {
+            options.pager.use_mmap = true;
+        } else {
+            std::cout << "Unknown option " << argv[i] << "\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    std::string filename = options.dir + "/snapshot_check.db";
+    unlink(filename.c_str());
+    unlink((filename + "-wal").c_str());
+    Table *table = db_open(filename.c_str(), &(options.pager));
+
+    std::atomic<bool> done(false);
+    std::vector<uint64_t> snapshots(options.readers, 0);
+    std::vector<std::thread> readers;
+    for (uint32_t i = 0; i < options.readers; i++)
+        readers.emplace_back(reader_main, table, &done, &snapshots[i]);
+
+    Row row;
+    for (uint64_t id = 0; id < options.rows; id++) {
+        row.id = id;
+        std::snprintf(row.username, sizeof(row.username), "user%u", row.id);
+        std::snprintf(row.email, sizeof(row.email), "person%u@example.com", row.id);
+        if (table_insert(table, &row) != EXECUTE_SUCCESS) {
+            std::cout << "insert of row " << id << " failed\n";
+            exit(EXIT_FAILURE);
+        }
+        if ((id + 1) % BATCH_ROWS == 0)
+            pager_commit(table->pager);
+    }
+    pager_commit(table->pager);
+    done.store(true);
+    for (std::thread &reader : readers)
+        reader.join();
+
+    uint64_t total = 0;
+    for (uint64_t count : snapshots)
+        total += count;
+    std::cout << "ok, " << total << " snapshots over " << options.rows << " rows\n";
+    db_close(table);
+    unlink(filename.c_str());
+    unlink((filename + "-wal").c_str());
+    return 0;
+}
@@ -1,12 +1,14 @@
+require 'tmpdir'
+
 describe 'database' do
 
     before do
-        `rm ./cmake-build-debug/test.db`
+        `rm -f ./cmake-build-debug/test.db ./cmake-build-debug/test.db-wal`
     end
 
-  def run_script(commands)
+  def run_script(commands, options = "")
     raw_output = nil
-    IO.popen("./cmake-build-debug/part05 ./cmake-build-debug/test.db", "r+") do |pipe|
+    IO.popen("./cmake-build-debug/part05 ./cmake-build-debug/test.db #{options}", "r+") do |pipe|
       commands.each do |command|
         pipe.puts command
       end
@@ -40,6 +42,523 @@ describe 'database' do
     ])
   end
 
+  it 'keeps rows ordered by id' do
+    script = [3, 1, 2].map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+    expect(result).to eq([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "(3, user3, person3@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'looks up a row by id after leaf splits' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select where id = 17"
+    script << ".exit"
+    result = run_script(script)
+    expect(result.last(3)).to match_array([
+      "db > (17, user17, person17@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'holds more pages than the buffer pool has frames' do
+    script = (1..1500).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    result = run_script(script, "--frames 8")
+    expect(result.last(2)).to match_array([
+      "db > Executed.",
+      "db > ",
+    ])
+
+    result = run_script(["select", ".exit"], "--frames 8")
+    expect(result.length).to eq(1502)
+    expect(result[1499]).to eq("(1500, user1500, person1500@example.com)")
+  end
+
+  it 'keeps committed rows when the process dies before .exit' do
+    script = (1..20).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    result = run_script(script)
+    expect(result.last).to eq("db > Error reading input")
+
+    result = run_script(["select where id = 20", ".exit"])
+    expect(result).to match_array([
+      "db > (20, user20, person20@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'does not rewrite the db file after a read-only session' do
+    run_script(["insert 1 user1 person1@example.com", ".exit"])
+    modified_at = File.mtime("./cmake-build-debug/test.db")
+
+    run_script(["select", ".exit"])
+    expect(File.mtime("./cmake-build-debug/test.db")).to eq(modified_at)
+  end
+
+  it 'reads pages through the file mapping with --mmap' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    result = run_script(["select where id = 30", "insert 31 user31 person31@example.com", "select where id = 31", ".exit"], "--mmap")
+    expect(result).to match_array([
+      "db > (30, user30, person30@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > (31, user31, person31@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'scans with io_uring reads and readahead through a small pool' do
+    script = (1..300).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    result = run_script(["select", ".exit"], "--io uring --frames 8 --readahead 4")
+    expect(result.length).to eq(302)
+    expect(result[0]).to eq("db > (1, user1, person1@example.com)")
+    expect(result[299]).to eq("(300, user300, person300@example.com)")
+  end
+
+  it 'keeps reading a file created with the pax layout' do
+    script = (1..40).map do |i|
+      "insert #{41 - i} user#{41 - i} person#{41 - i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "--layout pax")
+
+    result = run_script(["select", ".exit"])
+    expect(result.length).to eq(42)
+    expect(result[0]).to eq("db > (1, user1, person1@example.com)")
+    expect(result[39]).to eq("(40, user40, person40@example.com)")
+  end
+
+  it 'stores short rows in far fewer pages than their fixed size would take' do
+    script = (1..200).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    # 200 fixed size rows would need 16 leaves
+    expect(File.size("./cmake-build-debug/test.db")).to be <= 6 * 4096
+    result = run_script(["select where id = 200", ".exit"])
+    expect(result[0]).to eq("db > (200, user200, person200@example.com)")
+  end
+
+  it 'filters rows with where on id and username' do
+    script = (1..50).map do |i|
+      "insert #{i} user#{i % 5} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    result = run_script(["select where id > 47", ".exit"])
+    expect(result).to match_array([
+      "db > (48, user3, person48@example.com)",
+      "(49, user4, person49@example.com)",
+      "(50, user0, person50@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+
+    result = run_script(["select where username = 'user3'", ".exit"])
+    expect(result.length).to eq(12)
+    expect(result[0]).to eq("db > (3, user3, person3@example.com)")
+    expect(result[9]).to eq("(48, user3, person48@example.com)")
+  end
+
+  it 'returns rows in id order from a parallel scan' do
+    script = (1..3000).map do |i|
+      id = (i * 7919) % 3001
+      "insert #{id} user#{id} person#{id}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    result = run_script(["select", ".exit"], "--threads 4")
+    rows = result.select { |line| line.include?("(") }
+    ids = rows.map { |line| line[/\((\d+),/, 1].to_i }
+    expect(ids.length).to eq(3000)
+    expect(ids).to eq(ids.sort)
+
+    result = run_script(["select where id <= 20", ".exit"], "--threads 4")
+    expect(result.select { |line| line.include?("(") }.length).to eq(20)
+  end
+
+  it 'imports rows from csv and binary files' do
+    Dir.mktmpdir do |dir|
+      File.open("#{dir}/import.csv", "w") do |file|
+        file.puts "id,username,email"
+        (1..2000).each { |i| file.puts "#{i},user#{i},person#{i}@example.com" }
+      end
+      File.open("#{dir}/import.bin", "wb") do |file|
+        [2500, 0, 2100].each do |i|
+          username = "user#{i}"
+          email = "person#{i}@example.com"
+          file.write([i, username.length].pack("VC") + username + [email.length].pack("C") + email)
+        end
+      end
+
+      result = run_script([".import #{dir}/import.csv", ".import #{dir}/import.bin", ".exit"])
+      expect(result).to match_array([
+        "db > Imported 2000 rows.",
+        "db > Imported 3 rows.",
+        "db > ",
+      ])
+
+      result = run_script(["select", ".exit"])
+      rows = result.select { |line| line.include?("(") }
+      expect(rows.length).to eq(2003)
+      expect(rows[0]).to eq("db > (0, user0, person0@example.com)")
+      expect(rows[1500]).to eq("(1500, user1500, person1500@example.com)")
+      expect(rows[2002]).to eq("(2500, user2500, person2500@example.com)")
+
+      File.write("#{dir}/import.csv", "3001,user3001,person3001@example.com\n3002,user3002\n")
+      result = run_script([".import #{dir}/import.csv", ".exit"])
+      expect(result).to match_array([
+        "db > Syntax error on line 2.",
+        "Imported 1 rows.",
+        "db > ",
+      ])
+    end
+  end
+
+  it 'runs prepared statements with bound values' do
+    result = run_script([
+      "prepare insert ? ? ?",
+      "execute 1 2 user2 person2@example.com",
+      "execute 1 1 user1 person1@example.com",
+      "prepare select where id = ?",
+      "prepare insert ? ? ?",
+      "execute 2 2",
+      "execute 1 3 user3",
+      "execute 99",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > Prepared statement 1.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Prepared statement 2.",
+      "db > Prepared statement 1.",
+      "db > (2, user2, person2@example.com)",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > No such prepared statement.",
+      "db > ",
+    ])
+  end
+
+  it 'inserts several rows per statement and groups statements in a transaction' do
+    result = run_script([
+      "insert values (3, user3, person3@example.com), (1, 'user1', person1@example.com)",
+      "begin",
+      "insert values (2, user2, person2@example.com)",
+      "insert 4 user4 person4@example.com",
+      "commit",
+      "begin",
+      "insert values (5, user5, person5@example.com)",
+      ".exit",
+    ])
+    expect(result.count("db > Executed.")).to eq(7)
+
+    result = run_script(["select", ".exit"])
+    expect(result).to match_array([
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "(3, user3, person3@example.com)",
+      "(4, user4, person4@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'leaves nothing of a statement that fills the transaction' do
+    rows = (2..3001).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" }
+    result = run_script([
+      "begin",
+      "insert 1 user1 person1@example.com",
+      "insert values #{rows.join(', ')}",
+      "commit",
+      "select count(*)",
+      ".exit",
+    ], "--frames 16")
+    expect(result).to include("db > Error: Transaction full, commit it first.")
+    expect(result).to include("db > (1)")
+
+    result = run_script(["select", ".exit"])
+    expect(result).to match_array([
+      "db > (1, user1, person1@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'counts rows and statements with .stats' do
+    result = run_script([
+      "insert 1 user1 person1@example.com",
+      "insert 2 user2 person2@example.com",
+      ".stats reset",
+      "select where id = 2",
+      ".stats",
+      ".exit",
+    ])
+    expect(result).to include("rows returned: 1")
+    expect(result).to include("statements: 1")
+    expect(result.grep(/^execute: 1 calls, /).size).to eq(1)
+  end
+
+  it 'compresses pages of a file created with --compress lz4' do
+    script = (1..200).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "--layout row --compress lz4")
+
+    # 200 fixed size rows take 16 leaves uncompressed
+    expect(File.size("./cmake-build-debug/test.db")).to be < 6 * 4096
+    result = run_script(["select where id = 150", ".exit"])
+    expect(result[0]).to eq("db > (150, user150, person150@example.com)")
+    result = run_script(["select", ".exit"])
+    expect(result.length).to eq(202)
+  end
+
+  it 'answers email lookups from an index kept up to date by inserts' do
+    script = (1..50).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "create index on email"
+    script << "create index on email"
+    script << "insert 51 user51 person7@example.com"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[-3]).to eq("db > Error: Index already exists.")
+
+    result = run_script([
+      ".stats reset",
+      "select where email = 'person7@example.com'",
+      ".stats",
+      ".exit",
+    ])
+    expect(result[0]).to eq("db > db > (7, user7, person7@example.com)")
+    expect(result[1]).to eq("(51, user51, person7@example.com)")
+    expect(result).to include("rows scanned: 2")
+  end
+
+  it 'writes select results as column blocks with --output binary' do
+    run_script(["insert 2 bob bob@example.com", "insert 1 al al@example.com", ".exit"])
+    output = IO.popen("./cmake-build-debug/part05 ./cmake-build-debug/test.db --output binary", "r+") do |pipe|
+      pipe.puts "select"
+      pipe.puts ".exit"
+      pipe.close_write
+      pipe.binmode
+      pipe.read
+    end
+    expect(output[0, 5]).to eq("db > ")
+    expect(output[5, 28].unpack("L7")).to eq([2, 1, 2, 2, 3, 14, 15])
+    expect(output[33, 5]).to eq("albob")
+    expect(output[38, 29]).to eq("al@example.combob@example.com")
+    expect(output[67, 4].unpack("L")).to eq([0])
+    expect(output[71..-1]).to eq("Executed.\ndb > ")
+  end
+
+  it 'selects id ranges in either order and stops at a limit' do
+    script = (1..500).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    result = run_script(["select where id between 200 and 202", ".exit"])
+    expect(result).to match_array([
+      "db > (200, user200, person200@example.com)",
+      "(201, user201, person201@example.com)",
+      "(202, user202, person202@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+
+    result = run_script([".stats reset", "select where id < 400 order by id desc limit 2", ".stats", ".exit"])
+    expect(result[0]).to eq("db > db > (399, user399, person399@example.com)")
+    expect(result[1]).to eq("(398, user398, person398@example.com)")
+    expect(result).to include("rows returned: 2")
+    expect(result.grep(/^page hits: /).first.split(": ").last.to_i).to be <= 3
+  end
+
+  it 'answers count, min, max and sum aggregates' do
+    script = (1..100).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    result = run_script([
+      "select count(*)",
+      "select min(id) where id > 40",
+      "select max(id) where id < 40",
+      "select sum(id) where id between 1 and 10",
+      "select count(*) where username = 'user7'",
+      "select min(id) where id > 100",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > (100)",
+      "Executed.",
+      "db > (41)",
+      "Executed.",
+      "db > (39)",
+      "Executed.",
+      "db > (55)",
+      "Executed.",
+      "db > (1)",
+      "Executed.",
+      "db > (NULL)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'rejects an id that is already taken' do
+    run_script(["insert 1 user1 person1@example.com", ".exit"])
+    result = run_script([
+      "insert 1 user2 person2@example.com",
+      "insert values (2, user2, person2@example.com), (2, user3, person3@example.com)",
+      "insert 2 user2 person2@example.com",
+      "select",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > Error: Duplicate key.",
+      "db > Error: Duplicate key.",
+      "db > Executed.",
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'deletes and updates rows, indexes included' do
+    script = (1..5).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "create index on username"
+    script << ".exit"
+    run_script(script)
+
+    result = run_script([
+      "delete where id = 2",
+      "delete where id between 4 and 9",
+      "update set username = 'bob', email = bob@example.com where id = 3",
+      "update set email = nobody@example.com where id = 7",
+      "select",
+      "select where username = user3",
+      "select where username = bob",
+      "select count(*)",
+      "update where id = 1",
+      "delete",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (1, user1, person1@example.com)",
+      "(3, bob, bob@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > (3, bob, bob@example.com)",
+      "Executed.",
+      "db > (2)",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'reuses the pages of deleted rows and gives them back on .vacuum' do
+    script = (1..1000).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+    full_size = File.size("./cmake-build-debug/test.db")
+
+    run_script(["delete where id > 0", ".exit"])
+    run_script(script)
+    expect(File.size("./cmake-build-debug/test.db")).to eq(full_size)
+
+    result = run_script(["delete where id > 10", ".vacuum", "select count(*)", ".exit"])
+    expect(result).to include("db > Vacuumed, 2 pages.")
+    expect(result).to include("db > (10)")
+    expect(File.size("./cmake-build-debug/test.db")).to eq(2 * 4096)
+  end
+
+  it 'creates tables with their own columns that persist in the catalog' do
+    run_script([
+      "create table scores (id int, name text(20), points int, code char(4))",
+      "create table pairs (k int, v int)",
+      "insert into scores values (2, 'bob', -7, ab), (1, alice, 30, wxyz)",
+      "insert into pairs values (5, 6)",
+      "insert 1 user1 person1@example.com",
+      ".exit",
+    ])
+    result = run_script([
+      "select * from scores",
+      "select * from pairs where k = 5",
+      "select * from pairs where v = 6",
+      "select * from users",
+      "insert into scores values (1, carol, 1, a)",
+      "insert into scores values (3, carol, many, a)",
+      "insert into nope values (1)",
+      "create table pairs (k int)",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > (1, alice, 30, wxyz)",
+      "(2, bob, -7, ab)",
+      "Executed.",
+      "db > (5, 6)",
+      "Executed.",
+      "db > Error: Where takes the first column only.",
+      "db > (1, user1, person1@example.com)",
+      "Executed.",
+      "db > Error: Duplicate key.",
+      "db > Error: Values do not match the columns.",
+      "db > Error: No such table.",
+      "db > Error: Table already exists.",
+      "db > ",
+    ])
+  end
+
 end
 
 